@@ -0,0 +1,116 @@
+// Measures what the compression of the sent frames (server --compress) costs
+// and saves: INFO frames like those of a market feed are compressed in
+// batches of the given sizes, as a connection does with the frames waiting
+// to be sent, for a few zlib levels; the CPU time of both ends is reported
+// against the bytes saved.
+//
+// usage: ./bench_compression [FRAMES]
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include "utils.h"
+#include "codec.hpp"
+
+using namespace std;
+
+// CPU time of this thread, in ns
+static uint64_t cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+    constexpr int TOPICS = 500;
+    const int levels[] = {1, 6, 9};
+    const size_t batch_sizes[] = {256, 4096, 65536};
+
+    size_t count = argc > 1 ? atol(argv[1]) : 200000;
+
+    // frames as the server formats them, ETX included
+    mt19937 generator(42);
+    vector<string> frames;
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        int instrument = generator() % TOPICS;
+        string frame = "3market/" + to_string(instrument % 20) + "/instrument" + to_string(instrument);
+
+        switch (generator() % 4) {
+            case 0:
+                frame += " - INT - " + to_string(generator() % 100000);
+                break;
+            case 1:
+                frame += " - SHORT_REAL - " + to_string(generator() % 10000 / 100) + "."
+                    + to_string(10 + generator() % 90);
+                break;
+            case 2:
+                frame += " - FLOAT - " + to_string((double)(generator() % 10000000) / 1000);
+                break;
+            default:
+                frame += " - STRING - status " + to_string(generator() % 8) + " ok";
+                break;
+        }
+
+        frame.push_back(0x3);
+        total += frame.size();
+        frames.push_back(frame);
+    }
+
+    cout << "frames: " << count << " (" << total / 1024 << "KB, "
+        << total / count << " bytes on average)" << endl;
+    cout << "level  batch   ratio   compress ns/KB   decompress ns/KB   saved per CPU ms" << endl;
+
+    for (int level : levels) {
+        for (size_t batch_size : batch_sizes) {
+            stream_codec* encoder = stream_codec::create(deflate_codec::NAME, level);
+            stream_codec* decoder = stream_codec::create(deflate_codec::NAME, level);
+
+            // the batches are made first, so that only the codec is measured
+            vector<string> batches(1);
+            for (auto& frame : frames) {
+                if (batches.back().size() >= batch_size) {
+                    batches.emplace_back();
+                }
+                batches.back() += frame;
+            }
+
+            vector<string> blocks(batches.size());
+            uint64_t start = cpu_ns();
+            for (size_t i = 0; i < batches.size(); i++) {
+                DIE(!encoder->encode(batches[i].data(), batches[i].size(), blocks[i]),
+                    "compression failed");
+            }
+            uint64_t compress_time = cpu_ns() - start;
+
+            size_t compressed = 0;
+            string decoded;
+            start = cpu_ns();
+            for (auto& block : blocks) {
+                compressed += block.size();
+                decoded.clear();
+                DIE(!decoder->decode(block.data(), block.size(), decoded), "decompression failed");
+            }
+            uint64_t decompress_time = cpu_ns() - start;
+
+            DIE(decoded != batches.back(), "the frames do not survive the codec");
+
+            double kilobytes = total / 1024.0;
+            cout << setw(5) << level << setw(7) << batch_size
+                << setw(8) << fixed << setprecision(3) << (double)compressed / total
+                << setw(17) << (uint64_t)(compress_time / kilobytes)
+                << setw(19) << (uint64_t)(decompress_time / kilobytes)
+                << setw(16) << (total - compressed) / 1024 * 1000000 / (compress_time + 1) << "KB"
+                << endl;
+
+            delete encoder;
+            delete decoder;
+        }
+    }
+
+    return 0;
+}
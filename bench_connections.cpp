@@ -0,0 +1,119 @@
+// Opens many idle subscriber sessions to a server and reports the memory
+// used by the server for each of them.
+//
+// usage: ./bench_connections <IP_SERVER> <PORT_SERVER> <COUNT> [SERVER_PID]
+//
+// On loopback, the sessions are spread over 127.0.0.1 - 127.0.0.N so that
+// more than one range of ephemeral ports can be used.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "utils.h"
+#include "subscriber.hpp"
+
+using namespace std;
+
+// resident memory of a process, in KB (0 if it cannot be read)
+static long read_rss_kb(const char* pid) {
+    ifstream status(string("/proc/") + pid + "/status");
+    string line;
+
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            return atol(line.data() + 6);
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    constexpr int SESSIONS_PER_ADDRESS = 25000;
+
+    if (argc != 4 && argc != 5) {
+        cerr << "usage: " << argv[0] << " <IP_SERVER> <PORT_SERVER> <COUNT> [SERVER_PID]\n";
+        return 1;
+    }
+
+    const char* pid = argc == 5 ? argv[4] : nullptr;
+    uint16_t port = atoi(argv[2]);
+    int count = atoi(argv[3]);
+
+    rlimit files;
+    DIE(getrlimit(RLIMIT_NOFILE, &files) == -1, "getrlimit failed");
+    files.rlim_cur = files.rlim_max;
+    DIE(setrlimit(RLIMIT_NOFILE, &files) == -1, "Raising the file limit failed");
+
+    in_addr server_addr;
+    DIE(inet_aton(argv[1], &server_addr) == 0, "Invalid server address");
+    bool loopback = (ntohl(server_addr.s_addr) >> 24) == 127;
+
+    long rss_before = pid ? read_rss_kb(pid) : 0;
+
+    subscriber_loop loop;
+    vector<subscriber*> sessions;
+    int accepted = 0;
+    int refused = 0;
+
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < count; i++) {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr = server_addr;
+
+        if (loopback) {
+            addr.sin_addr.s_addr = htonl(ntohl(server_addr.s_addr) + i / SESSIONS_PER_ADDRESS);
+        }
+
+        subscriber* session = new subscriber(loop, "bench" + to_string(i));
+        session->on_connect([&accepted, &refused](bool ok) {
+            ok ? accepted++ : refused++;
+        });
+
+        if (!session->connect(addr)) {
+            cerr << "Connection " << i << " failed" << endl;
+            delete session;
+            break;
+        }
+
+        sessions.push_back(session);
+
+        // keep the answers flowing while connecting
+        loop.poll(0);
+    }
+
+    while (accepted + refused < (int)sessions.size()) {
+        loop.poll(-1);
+    }
+
+    uint64_t elapsed = now_ns() - start;
+
+    cout << "sessions: " << accepted << " accepted, " << refused << " refused in "
+        << elapsed / 1000000 << "ms" << endl;
+
+    if (pid) {
+        long rss_after = read_rss_kb(pid);
+        cout << "server RSS: " << rss_before << "KB -> " << rss_after << "KB, "
+            << (accepted ? (rss_after - rss_before) * 1024 / accepted : 0)
+            << " bytes per idle connection" << endl;
+    }
+
+    for (auto session : sessions) {
+        session->close();
+    }
+
+    loop.run();
+
+    for (auto session : sessions) {
+        delete session;
+    }
+
+    return 0;
+}
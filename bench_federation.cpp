@@ -0,0 +1,154 @@
+// Measures the fan-out throughput of one server versus a group of linked
+// servers (--peer): the subscribers are spread over the given ports and
+// every datagram is published to the first one, so with several nodes the
+// deliveries are shared between them.
+//
+// usage: ./bench_federation <IP_SERVER> <PORT>[,PORT...] [SUBSCRIBERS] [MESSAGES]
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "subscriber.hpp"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    constexpr int BURST = 64;
+    constexpr uint64_t IDLE_TIMEOUT = 2000000000;
+    constexpr uint64_t PROBE_INTERVAL = 10000000;
+    const string TOPIC = "bench/federation";
+
+    if (argc < 3) {
+        cerr << "usage: " << argv[0]
+            << " <IP_SERVER> <PORT>[,PORT...] [SUBSCRIBERS] [MESSAGES]\n";
+        return 1;
+    }
+
+    vector<sockaddr_in> nodes;
+    stringstream ports(argv[2]);
+    string port;
+
+    while (getline(ports, port, ',')) {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(port.data()));
+        DIE(inet_aton(argv[1], &addr.sin_addr) == 0, "Invalid server address");
+
+        nodes.push_back(addr);
+    }
+
+    int count = argc > 3 ? atoi(argv[3]) : 100;
+    int messages = argc > 4 ? atoi(argv[4]) : 20000;
+
+    subscriber_loop loop;
+    vector<subscriber*> sessions;
+    uint64_t delivered = 0;
+    int subscribed = 0;
+
+    // sessions that received something; the interest of a node reaches the
+    // first one some time after the subscription is confirmed
+    vector<bool> reached(count, false);
+    int reached_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        subscriber* session = new subscriber(loop, "bench-fed-" + to_string(getpid())
+                                                    + "-" + to_string(i));
+
+        session->on_subscribe([&subscribed](const string&, bool ok) { subscribed += ok; });
+        session->on_message([&, i](const message_view&) {
+            delivered++;
+            if (!reached[i]) {
+                reached[i] = true;
+                reached_count++;
+            }
+        });
+
+        DIE(!session->connect(nodes[i % nodes.size()]), "connect failed");
+        session->subscribe(TOPIC);
+        sessions.push_back(session);
+    }
+
+    while (subscribed < count) {
+        DIE(loop.poll(1000) == 0 && subscribed < count, "subscribe failed");
+    }
+
+    int publisher = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(publisher == -1, "Cannot create the UDP socket");
+
+    // topic (50 bytes), INT, sign, value
+    char datagram[50 + 1 + 1 + 4];
+    memset(datagram, 0, sizeof(datagram));
+    memcpy(datagram, TOPIC.data(), TOPIC.size());
+
+    // publish a probe every PROBE_INTERVAL until every node forwards to its
+    // subscribers (faster probes could keep the first node busy reading them)
+    uint64_t warmup_start = now_ns();
+    uint64_t next_probe = warmup_start;
+    while (reached_count < count) {
+        DIE(now_ns() - warmup_start > IDLE_TIMEOUT * 5, "some subscribers are not reached");
+
+        if (now_ns() >= next_probe) {
+            DIE(sendto(publisher, datagram, sizeof(datagram), 0,
+                        (const sockaddr*) &nodes[0], sizeof(nodes[0])) == -1,
+                "sendto failed");
+            next_probe = now_ns() + PROBE_INTERVAL;
+        }
+
+        loop.poll(PROBE_INTERVAL / 1000000);
+    }
+
+    while (loop.poll(100) > 0) {}
+    delivered = 0;
+
+    uint64_t expected = (uint64_t)count * messages;
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < messages; i++) {
+        uint32_t value = htonl(i);
+        memcpy(datagram + 52, &value, sizeof(value));
+
+        DIE(sendto(publisher, datagram, sizeof(datagram), 0,
+                    (const sockaddr*) &nodes[0], sizeof(nodes[0])) == -1,
+            "sendto failed");
+
+        // do not overflow the socket buffers of the server
+        if (i % BURST == BURST - 1) {
+            while (delivered + (uint64_t)count * BURST < (uint64_t)count * (i + 1)
+                    && loop.poll(100) > 0) {}
+        }
+    }
+
+    uint64_t last_progress = now_ns();
+    while (delivered < expected && now_ns() - last_progress < IDLE_TIMEOUT) {
+        if (loop.poll(100) > 0) {
+            last_progress = now_ns();
+        }
+    }
+
+    uint64_t elapsed = (delivered < expected ? last_progress : now_ns()) - start;
+
+    cout << "nodes: " << nodes.size() << ", subscribers: " << count
+        << ", messages: " << messages << endl
+        << "deliveries: " << delivered << " of " << expected << " in "
+        << elapsed / 1000000 << "ms (" << (uint64_t)(delivered * 1e9 / elapsed)
+        << "/s)" << endl;
+
+    for (auto session : sessions) {
+        session->close();
+    }
+    loop.run();
+
+    for (auto session : sessions) {
+        delete session;
+    }
+
+    close(publisher);
+    return 0;
+}
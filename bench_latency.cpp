@@ -0,0 +1,125 @@
+// Measures the delay between sending a UDP datagram to the server and
+// receiving the matching INFO frame in a subscriber, one message at a time
+// with a pause between them (the case where the wakeup latency of a
+// blocking epoll_wait shows). Run it against a server started with and
+// without --busy-poll to compare them.
+//
+// usage: ./bench_latency <IP_SERVER> <PORT_SERVER> [COUNT] [GAP_US]
+//          [--busy-poll=US] [--shm]
+#include <iostream>
+#include <string>
+#include <string.h>
+
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "histogram.hpp"
+#include "subscriber.hpp"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    constexpr int WARMUP = 100;
+    constexpr uint64_t MESSAGE_TIMEOUT = 1000000000;
+    const string TOPIC = "bench/latency";
+
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " <IP_SERVER> <PORT_SERVER> [COUNT] [GAP_US]"
+            << " [--busy-poll=US] [--shm]\n";
+        return 1;
+    }
+
+    uint16_t port = atoi(argv[2]);
+    int count = argc > 3 && argv[3][0] != '-' ? atoi(argv[3]) : 10000;
+    int gap = argc > 4 && argv[4][0] != '-' ? atoi(argv[4]) : 200;
+
+    int busy_poll = -1;
+    bool shared_memory = false;
+
+    for (int i = 3; i < argc; i++) {
+        if (strncmp(argv[i], "--busy-poll=", sizeof("--busy-poll=") - 1) == 0) {
+            busy_poll = atoi(argv[i] + sizeof("--busy-poll=") - 1);
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            shared_memory = true;
+        }
+    }
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    DIE(inet_aton(argv[1], &server_addr.sin_addr) == 0, "Invalid server address");
+
+    subscriber_loop loop;
+    if (busy_poll >= 0) {
+        loop.set_busy_poll(busy_poll * 1000ull);
+    }
+
+    subscriber session(loop, "bench-latency-" + to_string(getpid()));
+    session.set_shared_memory(shared_memory);
+
+    bool subscribed = false;
+    long long received = -1;
+
+    session.on_subscribe([&subscribed](const string&, bool ok) { subscribed = ok; });
+    session.on_message([&received](const message_view& message) {
+        received = message.as_int();
+    });
+
+    DIE(!session.connect(server_addr), "connect failed");
+    session.subscribe(TOPIC);
+
+    while (!subscribed && session.is_open()) {
+        loop.poll(-1);
+    }
+    DIE(!subscribed, "subscribe failed");
+
+    int publisher = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(publisher == -1, "Cannot create the UDP socket");
+
+    // topic (50 bytes), INT, sign, value
+    char datagram[50 + 1 + 1 + 4];
+    memset(datagram, 0, sizeof(datagram));
+    memcpy(datagram, TOPIC.data(), TOPIC.size());
+
+    latency_histogram latency;
+    int lost = 0;
+
+    for (int i = 0; i < count + WARMUP; i++) {
+        uint32_t value = htonl(i);
+        memcpy(datagram + 52, &value, sizeof(value));
+
+        uint64_t start = now_ns();
+        DIE(sendto(publisher, datagram, sizeof(datagram), 0,
+                    (const sockaddr*) &server_addr, sizeof(server_addr)) == -1,
+            "sendto failed");
+
+        while (received != i && now_ns() - start < MESSAGE_TIMEOUT) {
+            loop.poll(1);
+        }
+
+        if (received != i) {
+            lost++;
+        } else if (i >= WARMUP) {
+            latency.add(now_ns() - start);
+        }
+
+        timespec pause = {0, gap * 1000l};
+        nanosleep(&pause, nullptr);
+    }
+
+    cout << "messages: " << count << " (gap " << gap << "us, "
+        << (busy_poll >= 0 ? "busy polling" : "blocking") << " subscriber"
+        << (session.uses_shared_memory() ? ", shared memory" : "") << ")" << endl
+        << "p50: " << latency.percentile(50) / 1000.0 << "us, p99: "
+        << latency.percentile(99) / 1000.0 << "us" << endl;
+    latency.print(cout);
+    cout << endl << "lost: " << lost << endl;
+
+    session.close();
+    loop.run();
+    close(publisher);
+    return 0;
+}
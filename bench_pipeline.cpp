@@ -0,0 +1,247 @@
+// Measures the CPU cost of the server's own code, without the kernel: the
+// server runs in this process over memory_transport, the subscribers are
+// connections of the same transport and the datagrams are injected in
+// memory, so everything but the system calls is the real code path. For
+// each stage it prints the time and the allocations (operator new calls of
+// this thread) per item:
+//   handshake  a subscriber connects, sends its ID and subscription and
+//              reads the answers (per subscriber)
+//   ingest     datagrams of a topic without subscribers: parsing and
+//              matching (per datagram)
+//   fan-out    datagrams of the subscribed topics: parsing, matching,
+//              queueing and sending the frames (per datagram and per frame)
+//   receive    the subscribers split the frames they received (per frame)
+//
+// PROFILE runs the server with --profile=PROFILE (0, the default, without).
+//
+// usage: ./bench_pipeline [SUBSCRIBERS] [MESSAGES] [TOPICS] [PROFILE]
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "server.hpp"
+#include "memory_transport.hpp"
+
+using namespace std;
+
+// the logger thread allocates as well; only the loop's thread is counted
+static thread_local uint64_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+
+    void* memory = malloc(size ? size : 1);
+    if (memory == nullptr) {
+        throw bad_alloc();
+    }
+
+    return memory;
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t /* size */) noexcept {
+    free(memory);
+}
+
+struct stage {
+    const char* name;
+    uint64_t count;
+    uint64_t time;
+    uint64_t allocations;
+
+    uint64_t start_time;
+    uint64_t start_allocations;
+
+    explicit stage(const char* name)
+        : name(name), count(0), time(0), allocations(0), start_time(0), start_allocations(0) {}
+
+    void start() {
+        start_allocations = ::allocations;
+        start_time = now_ns();
+    }
+
+    void stop(uint64_t items) {
+        time += now_ns() - start_time;
+        allocations += ::allocations - start_allocations;
+        count += items;
+    }
+
+    void print(ostream& out) const {
+        out << setw(18) << left << name << right << setw(12) << count
+            << setw(12) << fixed << setprecision(1) << (double)time / max<uint64_t>(count, 1)
+            << setw(16) << setprecision(2) << (double)allocations / max<uint64_t>(count, 1)
+            << endl;
+    }
+};
+
+// run the server's loop until it waits with nothing to do
+static void drive(server* srv, const memory_transport& io) {
+    uint64_t idle = io.get_empty_waits();
+    while (io.get_empty_waits() == idle) {
+        srv->run_once();
+    }
+}
+
+static string make_datagram(const string& topic, uint32_t value) {
+    string datagram(topic);
+    datagram.resize(50, '\0');
+    datagram.push_back(PAYLOAD_INT);
+    // positive
+    datagram.push_back(0);
+
+    uint32_t network_value = htonl(value);
+    datagram.append((const char*)&network_value, sizeof(network_value));
+    return datagram;
+}
+
+int main(int argc, char* argv[]) {
+    constexpr uint16_t PORT = 12345;
+    // datagrams handled between two reads of the subscribers
+    constexpr int BATCH = 256;
+
+    int count = argc > 1 ? atoi(argv[1]) : 1000;
+    int messages = argc > 2 ? atoi(argv[2]) : 200000;
+    int topics = argc > 3 ? atoi(argv[3]) : 10;
+    int profile = argc > 4 ? atoi(argv[4]) : 0;
+
+    if (argc > 5 || count <= 0 || messages <= 0 || topics <= 0 || profile < 0) {
+        cerr << "usage: " << argv[0] << " [SUBSCRIBERS] [MESSAGES] [TOPICS] [PROFILE]\n";
+        return 1;
+    }
+
+    transport* kernel = transport::get();
+    memory_transport io;
+    transport::install(&io);
+
+    // the server logs every connection to STDOUT
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    DIE(out == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1,
+        "Cannot redirect STDOUT");
+    close(null);
+
+    server_config config;
+    config.port = PORT;
+    config.profile = profile;
+    server* srv = new server(config);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    stage handshake("handshake");
+    stage ingest("ingest");
+    stage fanout("fan-out");
+    stage fanout_frames("fan-out per frame");
+    stage receive("receive");
+
+    uint64_t frames = 0;
+    connection::frame_callback count_frame = [&frames](string_view /* frame */) {
+        frames++;
+    };
+
+    int pollfd = io.create_poller();
+    vector<connection*> subscribers;
+
+    handshake.start();
+    for (int i = 0; i < count; i++) {
+        int fd = io.socket(SOCK_STREAM);
+        DIE(io.connect(fd, addr) == -1, "connect failed");
+
+        connection* conn = new connection(pollfd, fd, addr, true);
+        conn->queue_send_message((char)ID + string("bench-") + to_string(i));
+        conn->queue_send_message((char)SUBSCRIBE + string("bench/") + to_string(i % topics));
+        conn->send_messages();
+        subscribers.push_back(conn);
+    }
+
+    drive(srv, io);
+
+    for (auto conn : subscribers) {
+        conn->recv_frames(count_frame);
+    }
+    handshake.stop(count);
+
+    // the ID accepted and the subscription confirmed
+    DIE(frames != 2ull * count, "The handshakes failed");
+    frames = 0;
+
+    string unsubscribed = make_datagram("bench/nobody", 0);
+    for (int sent = 0; sent < messages; sent += BATCH) {
+        int batch = min(BATCH, messages - sent);
+        for (int i = 0; i < batch; i++) {
+            io.inject(PORT, unsubscribed.data(), unsubscribed.size());
+        }
+
+        ingest.start();
+        drive(srv, io);
+        ingest.stop(batch);
+    }
+
+    vector<string> datagrams;
+    for (int topic = 0; topic < topics; topic++) {
+        datagrams.push_back(make_datagram("bench/" + to_string(topic), topic));
+    }
+
+    uint64_t expected = 0;
+    for (int sent = 0; sent < messages; sent += BATCH) {
+        int batch = min(BATCH, messages - sent);
+        for (int i = 0; i < batch; i++) {
+            int topic = (sent + i) % topics;
+            io.inject(PORT, datagrams[topic].data(), datagrams[topic].size());
+
+            // the subscribers of the topic
+            expected += count / topics + (topic < count % topics);
+        }
+
+        fanout.start();
+        drive(srv, io);
+        fanout.stop(batch);
+
+        uint64_t received = frames;
+        receive.start();
+        for (auto conn : subscribers) {
+            conn->recv_frames(count_frame);
+        }
+        receive.stop(frames - received);
+    }
+
+    fanout_frames.time = fanout.time;
+    fanout_frames.allocations = fanout.allocations;
+    fanout_frames.count = frames;
+
+    delete srv;
+    for (auto conn : subscribers) {
+        delete conn;
+    }
+    io.close(pollfd);
+    transport::install(kernel);
+
+    DIE(dup2(out, STDOUT_FILENO) == -1, "Cannot restore STDOUT");
+    close(out);
+
+    cout << "subscribers: " << count << ", topics: " << topics << ", messages: " << messages
+        << (profile ? ", profiling one datagram in " + to_string(profile) : string())
+        << " (in memory; " << frames << " of " << expected << " frames delivered)" << endl
+        << "stage                    count     ns each  allocations each" << endl;
+    handshake.print(cout);
+    ingest.print(cout);
+    fanout.print(cout);
+    fanout_frames.print(cout);
+    receive.print(cout);
+
+    return 0;
+}
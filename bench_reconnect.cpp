@@ -0,0 +1,168 @@
+// Measures how long a server takes to take back many clients that all
+// reconnect at once (as after a restart): every connection is opened at the
+// same time, sends its ID as soon as it is established and waits for the
+// server's answer. Connections that are reset or time out (their SYN was
+// dropped by a full backlog) start over, as the clients do.
+//
+// usage: ./bench_reconnect <IP_SERVER> <PORT_SERVER> [COUNT]
+//
+// On loopback, the connections are spread over 127.0.0.1 - 127.0.0.N so that
+// more than one range of ephemeral ports can be used.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "histogram.hpp"
+
+using namespace std;
+
+struct client {
+    int fd;
+    // when the first attempt started
+    uint64_t start;
+    bool sent;
+    bool done;
+};
+
+int main(int argc, char* argv[]) {
+    constexpr int CONNECTIONS_PER_ADDRESS = 25000;
+    constexpr int MAX_EVENTS = 256;
+    constexpr uint64_t TIMEOUT = 30000000000ull;
+
+    if (argc != 3 && argc != 4) {
+        cerr << "usage: " << argv[0] << " <IP_SERVER> <PORT_SERVER> [COUNT]\n";
+        return 1;
+    }
+
+    uint16_t port = atoi(argv[2]);
+    int count = argc > 3 ? atoi(argv[3]) : 50000;
+
+    rlimit files;
+    DIE(getrlimit(RLIMIT_NOFILE, &files) == -1, "getrlimit failed");
+    files.rlim_cur = files.rlim_max;
+    DIE(setrlimit(RLIMIT_NOFILE, &files) == -1, "Raising the file limit failed");
+
+    in_addr server_addr;
+    DIE(inet_aton(argv[1], &server_addr) == 0, "Invalid server address");
+    bool loopback = (ntohl(server_addr.s_addr) >> 24) == 127;
+
+    int epollfd = epoll_create1(0);
+    DIE(epollfd == -1, "Cannot create epoll");
+
+    vector<client> clients(count);
+    string prefix = "storm" + to_string(getpid()) + "-";
+
+    auto open_connection = [&](int i) {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr = server_addr;
+
+        if (loopback) {
+            addr.sin_addr.s_addr = htonl(ntohl(server_addr.s_addr) + i / CONNECTIONS_PER_ADDRESS);
+        }
+
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        DIE(fd == -1, "Cannot create socket (raise the file limit)");
+        DIE(connect(fd, (const sockaddr*) &addr, sizeof(addr)) == -1 && errno != EINPROGRESS,
+            "connect failed");
+
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.u32 = i;
+        DIE(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == -1, "epoll_ctl failed");
+
+        clients[i].fd = fd;
+        clients[i].sent = false;
+    };
+
+    latency_histogram latency;
+    uint64_t retries = 0;
+    int done = 0;
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < count; i++) {
+        clients[i].start = now_ns();
+        clients[i].done = false;
+        open_connection(i);
+    }
+    uint64_t opened = now_ns() - start;
+
+    epoll_event events[MAX_EVENTS];
+    while (done < count && now_ns() - start < TIMEOUT) {
+        int ready = epoll_wait(epollfd, events, MAX_EVENTS, 1000);
+        DIE(ready == -1 && errno != EINTR, "epoll_wait failed");
+
+        for (int e = 0; e < ready; e++) {
+            int i = events[e].data.u32;
+            client& current = clients[i];
+
+            if (events[e].events & (EPOLLERR | EPOLLHUP)) {
+                // refused or reset; connect again
+                close(current.fd);
+                retries++;
+                open_connection(i);
+                continue;
+            }
+
+            if ((events[e].events & EPOLLOUT) && !current.sent) {
+                string handshake = "0" + prefix + to_string(i) + "\x03";
+                DIE(send(current.fd, handshake.data(), handshake.size(), MSG_NOSIGNAL)
+                        != (ssize_t)handshake.size(), "send failed");
+                current.sent = true;
+
+                epoll_event event;
+                event.events = EPOLLIN;
+                event.data.u32 = i;
+                DIE(epoll_ctl(epollfd, EPOLL_CTL_MOD, current.fd, &event) == -1,
+                    "epoll_ctl failed");
+            }
+
+            if (events[e].events & EPOLLIN) {
+                char reply[64];
+                ssize_t size = recv(current.fd, reply, sizeof(reply), 0);
+
+                if (size <= 0) {
+                    close(current.fd);
+                    retries++;
+                    open_connection(i);
+                    continue;
+                }
+
+                if (!current.done && reply[0] == '0') {
+                    current.done = true;
+                    latency.add(now_ns() - current.start);
+                    done++;
+
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, current.fd, nullptr);
+                }
+            }
+        }
+    }
+
+    uint64_t elapsed = now_ns() - start;
+
+    cout << "connections: " << done << " of " << count << " answered in "
+        << elapsed / 1000000 << "ms (opened in " << opened / 1000000 << "ms, "
+        << retries << " retries)" << endl
+        << "time to answer: p50 " << latency.percentile(50) / 1000000 << "ms, p99 "
+        << latency.percentile(99) / 1000000 << "ms, max "
+        << latency.get_max() / 1000000 << "ms" << endl;
+
+    for (auto& current : clients) {
+        close(current.fd);
+    }
+    close(epollfd);
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+// Measures how long it takes to restore the subscriptions of the server:
+// replaying them one at a time (as resubscribing clients do) versus loading
+// them in bulk from a snapshot.
+//
+// usage: ./bench_snapshot [SUBSCRIPTIONS] [SNAPSHOT_PATH]
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "utils.h"
+#include "topics.hpp"
+#include "persistence.hpp"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    constexpr int SUBSCRIPTIONS_PER_CLIENT = 10;
+    constexpr int TOPICS = 50000;
+
+    size_t count = argc > 1 ? atol(argv[1]) : 1000000;
+    string path = argc > 2 ? argv[2] : "bench_snapshot.snap";
+
+    // clients subscribe to overlapping topics, some of them with wildcards
+    vector<string> topics;
+    for (int i = 0; i < TOPICS; i++) {
+        string topic = "market/" + to_string(i % 100) + "/instrument" + to_string(i);
+        if (i % 10 == 0) {
+            topic = "market/+/instrument" + to_string(i);
+        } else if (i % 25 == 0) {
+            topic = "market/" + to_string(i % 100) + "/*";
+        }
+
+        topics.push_back(topic);
+    }
+
+    subscription_options options;
+
+    uint64_t start = now_ns();
+    topics_tree replayed;
+    for (size_t i = 0; i < count; i++) {
+        string ID = "client" + to_string(i / SUBSCRIPTIONS_PER_CLIENT);
+        replayed.subscribe(ID, topics[(i * 7919) % TOPICS].data(), options);
+    }
+    uint64_t replay_time = now_ns() - start;
+
+    subscription_store writer(path);
+    start = now_ns();
+    writer.write_snapshot(replayed);
+    uint64_t write_time = now_ns() - start;
+
+    topics_tree loaded;
+    subscription_store reader(path);
+    start = now_ns();
+    size_t loaded_count = reader.load(loaded);
+    uint64_t load_time = now_ns() - start;
+
+    cout << "subscriptions: " << count << endl
+        << "one at a time: " << replay_time / 1000000 << "ms" << endl
+        << "snapshot write: " << write_time / 1000000 << "ms" << endl
+        << "snapshot load: " << load_time / 1000000 << "ms ("
+        << loaded_count << " loaded)" << endl;
+
+    unlink(path.data());
+    unlink((path + ".journal").data());
+    return 0;
+}
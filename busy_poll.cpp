@@ -0,0 +1,18 @@
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "busy_poll.hpp"
+
+bool pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+void set_socket_busy_poll(int fd, int usec) {
+#ifdef SO_BUSY_POLL
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+#endif
+}
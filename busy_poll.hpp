@@ -0,0 +1,64 @@
+#ifndef _BUSY_POLL_HPP
+#define _BUSY_POLL_HPP
+
+#include <stdint.h>
+
+// spin-then-sleep policy of an epoll loop: after an event, the loop polls
+// without blocking (no wakeup latency) for spin_ns, then goes back to a
+// blocking epoll_wait until the next event
+class busy_poller {
+public:
+    busy_poller() : enabled(false), spin_ns(0), last_event(0), empty_polls(0), sleeps(0) {}
+
+    // spin_ns = 0 spins forever
+    void enable(uint64_t spin_ns) {
+        enabled = true;
+        this->spin_ns = spin_ns;
+    }
+
+    bool is_enabled() const { return enabled; }
+
+    // timeout for the next epoll_wait: 0 while spinning, blocking_timeout
+    // (the one the loop would use without busy polling) otherwise
+    int timeout(int blocking_timeout, uint64_t now) {
+        if (!enabled || blocking_timeout == 0) {
+            return blocking_timeout;
+        }
+
+        if (spin_ns == 0 || now - last_event < spin_ns) {
+            return 0;
+        }
+
+        sleeps++;
+        return blocking_timeout;
+    }
+
+    // account the result of epoll_wait
+    void record(int events, uint64_t now) {
+        if (events > 0) {
+            last_event = now;
+        } else {
+            empty_polls++;
+        }
+    }
+
+    uint64_t get_empty_polls() const { return empty_polls; }
+    uint64_t get_sleeps() const { return sleeps; }
+private:
+    bool enabled;
+    uint64_t spin_ns;
+    uint64_t last_event;
+
+    uint64_t empty_polls;
+    uint64_t sleeps;
+};
+
+// pin the calling thread to the given CPU; returns false on failure
+bool pin_to_cpu(int cpu);
+
+// ask the kernel to busy poll the device queue of the socket for up to usec
+// when a read finds no data (SO_BUSY_POLL); silently ignored where it is not
+// supported or not permitted
+void set_socket_busy_poll(int fd, int usec);
+
+#endif  // _BUSY_POLL_HPP
@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "capture.hpp"
+
+using namespace std;
+
+static const char CAPTURE_MAGIC[] = "TCPCAP01";
+static constexpr size_t MAGIC_SIZE = sizeof(CAPTURE_MAGIC) - 1;
+
+// time, address, port, size
+static constexpr size_t RECORD_HEADER = 8 + 4 + 2 + 2;
+
+capture_writer::capture_writer(const string& path) : datagrams(0), bytes(0) {
+    fd = open(path.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    DIE(fd == -1, "Cannot create the capture file");
+
+    buffer.append(CAPTURE_MAGIC, MAGIC_SIZE);
+}
+
+capture_writer::~capture_writer() {
+    flush();
+    close(fd);
+}
+
+void capture_writer::record(uint64_t time, const sockaddr_in& source,
+                            const char* data, size_t size) {
+    uint16_t record_size = size < UINT16_MAX ? size : UINT16_MAX;
+
+    buffer.append((const char*)&time, sizeof(time));
+    buffer.append((const char*)&source.sin_addr.s_addr, sizeof(source.sin_addr.s_addr));
+    buffer.append((const char*)&source.sin_port, sizeof(source.sin_port));
+    buffer.append((const char*)&record_size, sizeof(record_size));
+    buffer.append(data, record_size);
+
+    datagrams++;
+    bytes += record_size;
+
+    if (buffer.size() > MAX_BUFFER) {
+        flush();
+    }
+}
+
+void capture_writer::flush() {
+    if (buffer.empty()) {
+        return;
+    }
+
+    DIE(write(fd, buffer.data(), buffer.size()) != (ssize_t)buffer.size(),
+        "Cannot write the capture file");
+    buffer.clear();
+}
+
+capture_reader::capture_reader(const string& path) : position(MAGIC_SIZE) {
+    int fd = open(path.data(), O_RDONLY);
+    DIE(fd == -1, "Cannot open the capture file");
+
+    struct stat info;
+    DIE(fstat(fd, &info) == -1, "Cannot read the capture size");
+    size = info.st_size;
+
+    DIE(size < MAGIC_SIZE, "Not a capture file");
+
+    data = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    DIE(data == MAP_FAILED, "Cannot map the capture file");
+    close(fd);
+
+    DIE(memcmp(data, CAPTURE_MAGIC, MAGIC_SIZE) != 0, "Not a capture file");
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+}
+
+capture_reader::~capture_reader() {
+    munmap((void*)data, size);
+}
+
+bool capture_reader::next(captured_datagram& datagram) {
+    if (size - position < RECORD_HEADER) {
+        return false;
+    }
+
+    const char* record = data + position;
+    uint16_t record_size;
+    memcpy(&record_size, record + 14, sizeof(record_size));
+
+    if (size - position - RECORD_HEADER < record_size) {
+        return false;
+    }
+
+    memset(&datagram.source, 0, sizeof(datagram.source));
+    datagram.source.sin_family = AF_INET;
+
+    memcpy(&datagram.time, record, sizeof(datagram.time));
+    memcpy(&datagram.source.sin_addr.s_addr, record + 8, sizeof(datagram.source.sin_addr.s_addr));
+    memcpy(&datagram.source.sin_port, record + 12, sizeof(datagram.source.sin_port));
+    datagram.size = record_size;
+    datagram.data = record + RECORD_HEADER;
+
+    position += RECORD_HEADER + record_size;
+    return true;
+}
+
+void capture_reader::rewind() {
+    position = MAGIC_SIZE;
+}
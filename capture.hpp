@@ -0,0 +1,63 @@
+#ifndef _CAPTURE_HPP
+#define _CAPTURE_HPP
+
+#include <stdint.h>
+#include <string>
+
+#include <arpa/inet.h>
+
+// binary capture of the datagrams received by the server
+//
+// file: "TCPCAP01", then one record per datagram: u64 receive time (ns,
+// monotonic clock), u32 source address and u16 source port (network
+// order), u16 size, the datagram
+struct captured_datagram {
+    uint64_t time;
+    sockaddr_in source;
+    const char* data;
+    uint16_t size;
+};
+
+class capture_writer {
+public:
+    // truncates the file; dies if it cannot be created
+    explicit capture_writer(const std::string& path);
+    ~capture_writer();
+
+    void record(uint64_t time, const sockaddr_in& source, const char* data, size_t size);
+
+    // write the buffered records
+    void flush();
+
+    uint64_t get_datagrams() const { return datagrams; }
+    uint64_t get_bytes() const { return bytes; }
+private:
+    static constexpr size_t MAX_BUFFER = 64 * 1024;
+
+    int fd;
+    std::string buffer;
+
+    uint64_t datagrams;
+    uint64_t bytes;
+};
+
+// reads a capture file through a read-only mapping
+class capture_reader {
+public:
+    // dies if the file cannot be mapped or is not a capture
+    explicit capture_reader(const std::string& path);
+    ~capture_reader();
+
+    // the views of the returned record point into the mapping; returns
+    // false at the end of the file (a torn last record is ignored)
+    bool next(captured_datagram& datagram);
+
+    // go back to the first record
+    void rewind();
+private:
+    const char* data;
+    size_t size;
+    size_t position;
+};
+
+#endif  // _CAPTURE_HPP
@@ -0,0 +1,106 @@
+// Checks that a subscriber is told every topic alias it receives when the
+// frames of a conflated topic are replaced while the socket is full: the
+// connections run over memory_transport with small socket buffers, so the
+// sends block right after a frame was prepared (and its alias recorded).
+//
+// usage: ./check_aliases (exits with an error message on failure)
+#include <iostream>
+#include <set>
+#include <string>
+#include <string.h>
+
+#include "utils.h"
+#include "connection.hpp"
+#include "memory_transport.hpp"
+
+using namespace std;
+
+int main() {
+    constexpr uint16_t PORT = 12345;
+    constexpr size_t BUFFER_SIZE = 64;
+    constexpr int ROUNDS = 1000;
+    const string TOPICS[] = {"check/first/topic", "check/second/topic", "check/third/topic"};
+
+    memory_transport io(BUFFER_SIZE);
+    transport::install(&io);
+
+    int pollfd = io.create_poller();
+    int listenfd = io.socket(SOCK_STREAM);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    DIE(io.bind(listenfd, addr) == -1 || io.listen(listenfd, 1) == -1, "listen failed");
+
+    int clientfd = io.socket(SOCK_STREAM);
+    DIE(io.connect(clientfd, addr) == -1, "connect failed");
+
+    sockaddr_in peer;
+    connection* sender = new connection(pollfd, io.accept(listenfd, &peer), peer, true);
+    connection* receiver = new connection(pollfd, clientfd, addr, true);
+    sender->enable_topic_aliases();
+
+    set<string> announced;
+    uint64_t messages = 0;
+
+    connection::frame_callback check_frame = [&](string_view frame) {
+        if (frame[0] == HEARTBEAT) {
+            return;
+        }
+
+        if (frame[0] == TOPIC_ALIAS) {
+            announced.insert(string(frame.substr(1, frame.find(' ') - 1)));
+            return;
+        }
+
+        string alias(frame.substr(1, frame.find(" - ") - 1));
+        DIE(announced.count(alias) == 0, "An alias was used before being announced");
+        messages++;
+    };
+
+    for (int round = 0; round < ROUNDS; round++) {
+        // fills the socket exactly, so that the next frame is prepared and
+        // then waits for the socket before any of its bytes is written
+        sender->queue_send_message(string(BUFFER_SIZE - 1, (char)HEARTBEAT));
+
+        for (auto& topic : TOPICS) {
+            string frame = (char)INFO + topic + " - INT - " + to_string(round);
+            sender->queue_conflated_message(topic, frame, PRIORITY_NORMAL, -1, topic.size());
+        }
+        sender->send_messages();
+
+        // the newer values replace the frames that did not start
+        for (auto& topic : TOPICS) {
+            string frame = (char)INFO + topic + " - INT - " + to_string(-round);
+            sender->queue_conflated_message(topic, frame, PRIORITY_NORMAL, -1, topic.size());
+        }
+
+        // every few rounds, a new topic gets a new alias
+        if (round % 7 == 0) {
+            string topic = "check/other/" + to_string(round);
+            sender->queue_send_message((char)INFO + topic + " - INT - 0", PRIORITY_NORMAL,
+                                        -1, topic.size());
+        }
+
+        // a few bytes get through at a time
+        for (int step = 0; step < 100; step++) {
+            sender->send_messages();
+            receiver->recv_frames(check_frame);
+        }
+
+        DIE(sender->state == connection::STATE_CONNECTION_BROKEN, "The connection broke");
+    }
+
+    delete sender;
+    delete receiver;
+    io.close(listenfd);
+    io.close(pollfd);
+
+    cout << "aliases: " << messages << " messages checked, " << announced.size()
+        << " aliases announced" << endl;
+
+    return 0;
+}
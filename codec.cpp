@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "codec.hpp"
+
+using namespace std;
+
+stream_codec* stream_codec::create(const string& name, int level) {
+    if (name == deflate_codec::NAME) {
+        return new deflate_codec(level);
+    }
+
+    return nullptr;
+}
+
+deflate_codec::deflate_codec(int level)
+    : level(level), deflater_ready(false), inflater_ready(false) {
+    memset(&deflater, 0, sizeof(deflater));
+    memset(&inflater, 0, sizeof(inflater));
+}
+
+deflate_codec::~deflate_codec() {
+    if (deflater_ready) {
+        deflateEnd(&deflater);
+    }
+
+    if (inflater_ready) {
+        inflateEnd(&inflater);
+    }
+}
+
+bool deflate_codec::encode(const char* data, size_t size, string& out) {
+    if (!deflater_ready) {
+        if (deflateInit(&deflater, level) != Z_OK) {
+            return false;
+        }
+        deflater_ready = true;
+    }
+
+    deflater.next_in = (Bytef*)data;
+    deflater.avail_in = size;
+
+    // the sync flush emits everything, so the output is complete once the
+    // deflater stops filling the buffer
+    do {
+        size_t offset = out.size();
+        size_t room = deflateBound(&deflater, deflater.avail_in) + 16;
+        out.resize(offset + room);
+
+        deflater.next_out = (Bytef*)out.data() + offset;
+        deflater.avail_out = room;
+
+        int result = deflate(&deflater, Z_SYNC_FLUSH);
+        out.resize(out.size() - deflater.avail_out);
+
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            return false;
+        }
+    } while (deflater.avail_out == 0);
+
+    return true;
+}
+
+bool deflate_codec::decode(const char* data, size_t size, string& out) {
+    constexpr size_t CHUNK = 16 * 1024;
+
+    if (!inflater_ready) {
+        if (inflateInit(&inflater) != Z_OK) {
+            return false;
+        }
+        inflater_ready = true;
+    }
+
+    inflater.next_in = (Bytef*)data;
+    inflater.avail_in = size;
+
+    // a full buffer may leave output inside zlib, so inflate again until
+    // it stops filling the buffer
+    do {
+        size_t offset = out.size();
+        out.resize(offset + CHUNK);
+
+        inflater.next_out = (Bytef*)out.data() + offset;
+        inflater.avail_out = CHUNK;
+
+        int result = inflate(&inflater, Z_SYNC_FLUSH);
+        out.resize(out.size() - inflater.avail_out);
+
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            return false;
+        }
+
+        if (inflater.avail_out > 0 && inflater.avail_in > 0) {
+            // no progress with room left: not a deflate stream
+            return false;
+        }
+    } while (inflater.avail_in > 0 || inflater.avail_out == 0);
+
+    return true;
+}
@@ -0,0 +1,53 @@
+#ifndef _CODEC_HPP
+#define _CODEC_HPP
+
+#include <stdint.h>
+#include <string>
+
+#include <zlib.h>
+
+// streaming compression of one direction of a connection; the output of
+// every encode() call can be decoded as soon as it is received, and the
+// dictionary carries over from call to call
+class stream_codec {
+public:
+    virtual ~stream_codec() {}
+
+    // the name used in the handshake
+    virtual const char* name() const = 0;
+
+    // compress the data and append it to out; returns false on error
+    virtual bool encode(const char* data, size_t size, std::string& out) = 0;
+
+    // decompress the data and append it to out; returns false if the data
+    // is corrupted
+    virtual bool decode(const char* data, size_t size, std::string& out) = 0;
+
+    // a codec for the name (as given in the handshake), or nullptr if
+    // there is none; the level is used for compressing
+    static stream_codec* create(const std::string& name, int level);
+};
+
+// zlib deflate, flushed (Z_SYNC_FLUSH) at the end of every encode()
+class deflate_codec : public stream_codec {
+public:
+    static constexpr const char* NAME = "deflate";
+
+    explicit deflate_codec(int level);
+    ~deflate_codec();
+
+    const char* name() const override { return NAME; }
+
+    bool encode(const char* data, size_t size, std::string& out) override;
+    bool decode(const char* data, size_t size, std::string& out) override;
+private:
+    int level;
+
+    // each initialized on first use (a codec is used in one direction)
+    z_stream deflater;
+    z_stream inflater;
+    bool deflater_ready;
+    bool inflater_ready;
+};
+
+#endif  // _CODEC_HPP
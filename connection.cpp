@@ -1,34 +1,126 @@
 #include <iostream>
 #include <string.h>
 
-#include <fcntl.h>
 #include <sys/epoll.h>
-#include <sys/unistd.h>
-#include <netinet/tcp.h>
+// linux/tcp.h has the recent fields of tcp_info
+#include <linux/tcp.h>
 
 #include "utils.h"
 #include "connection.hpp"
+#include "transport.hpp"
 
 using namespace std;
 
-connection::connection(int epollfd, int connectionfd, const sockaddr_in& addr) 
-                                                : epoll_info(this),
+connection::scheduling_policy connection::scheduling = connection::SCHEDULE_STRICT;
+int connection::class_weights[PRIORITY_CLASSES] = {4, 2, 1};
+bool connection::pack_frames = false;
+thread_local int64_t connection::alias_saved_bytes = 0;
+thread_local uint64_t connection::compression_input_bytes = 0;
+thread_local uint64_t connection::compression_output_bytes = 0;
+thread_local uint64_t connection::compression_time = 0;
+thread_local uint64_t connection::send_calls = 0;
+thread_local uint64_t connection::recv_calls = 0;
+thread_local uint64_t connection::epoll_ctl_calls = 0;
+thread_local uint64_t connection::total_frames_sent = 0;
+thread_local latency_histogram connection::queue_latency[PRIORITY_CLASSES];
+thread_local slab_pool connection::pool("connections", sizeof(connection));
+
+string make_timed_info(const string& info_message, uint64_t recv_time, bool with_send_time) {
+    char stamp[TIMESTAMP_DIGITS + 1];
+    snprintf(stamp, sizeof(stamp), "%0*llu", TIMESTAMP_DIGITS, (unsigned long long)recv_time);
+
+    string timed(1, (char)TIMED_INFO);
+    timed.append(stamp, TIMESTAMP_DIGITS);
+
+    if (with_send_time) {
+        timed.push_back(',');
+        timed.append(TIMESTAMP_DIGITS, '0');
+    }
+
+    timed.push_back(' ');
+    timed.append(info_message, 1, string::npos);
+    return timed;
+}
+
+bool topic_matches(const char* pattern, const char* topic) {
+    if (*pattern == '\0' || *topic == '\0') {
+        return *pattern == *topic;
+    }
+
+    const char* pattern_end = strchrnul(pattern, '/');
+    const char* topic_end = strchrnul(topic, '/');
+    const char* next_pattern = *pattern_end ? pattern_end + 1 : pattern_end;
+    const char* next_topic = *topic_end ? topic_end + 1 : topic_end;
+    size_t pattern_size = pattern_end - pattern;
+
+    if (pattern_size == 1 && *pattern == '*') {
+        // * takes this level and any number of the next ones
+        return topic_matches(next_pattern, next_topic) || topic_matches(pattern, next_topic);
+    }
+
+    if (!(pattern_size == 1 && *pattern == '+')
+            && (pattern_size != (size_t)(topic_end - topic)
+                || memcmp(pattern, topic, pattern_size) != 0)) {
+        return false;
+    }
+
+    return topic_matches(next_pattern, next_topic);
+}
+
+void* connection::operator new(size_t size) {
+    // the pool blocks only fit a connection
+    if (size != sizeof(connection)) {
+        return ::operator new(size);
+    }
+
+    return pool.allocate();
+}
+
+void connection::operator delete(void* conn, size_t size) {
+    if (size != sizeof(connection)) {
+        ::operator delete(conn);
+        return;
+    }
+
+    pool.deallocate(conn);
+}
+
+connection::connection(int epollfd, int connectionfd, const sockaddr_in& addr, bool prepared)
+                                                : state(STATE_CONNECTING),
+                                                    addr(addr),
+                                                    last_activity(0),
+                                                    ring(nullptr),
+                                                    flush_deadline(0),
+                                                    unflushed_bytes(0),
+                                                    frames_sent(0),
+                                                    multicast(false),
                                                     epollfd(epollfd),
                                                     connectionfd(connectionfd),
-                                                    addr(addr),
+                                                    epoll_info(this),
+                                                    conflated_frames(nullptr),
+                                                    aliases(nullptr),
+                                                    encoder(nullptr),
+                                                    decoder(nullptr),
+                                                    raw_frames{},
+                                                    min_compressed_batch(0),
+                                                    block_sent(0),
+                                                    block_remaining(0),
+                                                    block_compressed(false),
                                                     index_send_message(0),
-                                                    state(STATE_CONNECTING) {
+                                                    sending_class(PRIORITY_HIGH),
+                                                    deficit() {
 
-    // set connection as non-blocking
-    int connectionfd_flags = fcntl(connectionfd, F_GETFL);
-    DIE(connectionfd_flags == -1 
-            || fcntl(connectionfd, F_SETFL, connectionfd_flags | O_NONBLOCK) == -1, 
-        "Cannot set this connection as non-blocking");
+    if (!prepared) {
+        // set connection as non-blocking
+        DIE(transport::get()->set_nonblocking(connectionfd) == -1,
+            "Cannot set this connection as non-blocking");
 
-    // disable Nagle's algorithm
-    int sockopt = 1;
-    DIE(setsockopt(connectionfd, SOL_TCP, TCP_NODELAY, &sockopt, sizeof(sockopt)) == -1, 
-        "disable of Naggle's algorithm failed");
+        // disable Nagle's algorithm
+        int sockopt = 1;
+        DIE(transport::get()->set_option(connectionfd, IPPROTO_TCP, TCP_NODELAY, &sockopt,
+                                            sizeof(sockopt)) == -1,
+            "disable of Naggle's algorithm failed");
+    }
 
     // put this connection in epoll
     monitored_events = EPOLLIN;
@@ -36,17 +128,31 @@ connection::connection(int epollfd, int connectionfd, const sockaddr_in& addr)
     event.events = monitored_events;
     event.data.ptr = &epoll_info;
 
-    DIE(epoll_ctl(epollfd, EPOLL_CTL_ADD, connectionfd, &event) == -1,
+    epoll_ctl_calls++;
+    DIE(transport::get()->control(epollfd, EPOLL_CTL_ADD, connectionfd, &event) == -1,
         "Adding connection to epoll failed");
 }
 
 connection::~connection() {
-    DIE(epoll_ctl(epollfd, EPOLL_CTL_DEL, connectionfd, NULL) == -1,
+    delete ring;
+    delete conflated_frames;
+    delete aliases;
+    delete encoder;
+    delete decoder;
+
+    epoll_ctl_calls++;
+    DIE(transport::get()->control(epollfd, EPOLL_CTL_DEL, connectionfd, NULL) == -1,
         "Error at removing a connection");
-    DIE(close(connectionfd) == -1, "Error at closing a connection socket");
+    DIE(transport::get()->close(connectionfd) == -1, "Error at closing a connection socket");
 }
 
 void connection::recv_message() {
+    recv_frames([this](string_view frame) {
+        recv_messages.push(string(frame));
+    });
+}
+
+void connection::recv_frames(const frame_callback& callback) {
     constexpr int MAX_BUFFER_SIZE = 2048;
 
     if ((monitored_events & EPOLLIN) == 0) {
@@ -54,24 +160,24 @@ void connection::recv_message() {
         set_monitor(monitored_events | EPOLLIN);
     }
 
+    transport* io = transport::get();
     ssize_t read_size;
     char buffer[MAX_BUFFER_SIZE];
 
-    while ((read_size = recv(connectionfd, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[read_size] = '\0';
-
+    while (recv_calls++, (read_size = io->recv(connectionfd, buffer, sizeof(buffer))) > 0) {
         const char* iter = buffer;
-        const char* etx_pos;
+        const char* end = buffer + read_size;
 
-        // split the whole received buffer into messages
-        while ((etx_pos = strchr(iter, ETX)) != nullptr) {
-            receiving_message.append(iter, etx_pos - iter);
-            recv_messages.push(receiving_message);
-            receiving_message.clear();
-            iter = etx_pos + 1;
+        if (decoder == nullptr) {
+            // a frame (the handshake reply) may enable the decompression;
+            // what follows it is made of blocks
+            iter = split_frames(iter, end, callback, true);
         }
 
-        receiving_message.append(iter, (buffer + read_size) - iter);
+        if (decoder && !read_blocks(iter, end, callback)) {
+            state = STATE_CONNECTION_BROKEN;
+            return;
+        }
     }
 
     if (read_size == 0 || (read_size == -1 && errno != EAGAIN)) {
@@ -79,32 +185,261 @@ void connection::recv_message() {
     }
 }
 
-void connection::push_send_message(const string& message) {
-    // set epoll to monitor writing as well
-    if ((monitored_events & EPOLLOUT) == 0) {
-        set_monitor(monitored_events | EPOLLOUT);
+const char* connection::split_frames(const char* iter, const char* end,
+                                        const frame_callback& callback, bool stop_at_codec) {
+    const char* etx_pos;
+
+    // split the whole received buffer into messages
+    while ((etx_pos = (const char*)memchr(iter, ETX, end - iter)) != nullptr) {
+        if (receiving_message.empty()) {
+            // the whole frame is in this buffer; do not copy it
+            callback(string_view(iter, etx_pos - iter));
+        } else {
+            receiving_message.append(iter, etx_pos - iter);
+            callback(receiving_message);
+            receiving_message.clear();
+        }
+
+        iter = etx_pos + 1;
+
+        if (stop_at_codec && decoder) {
+            return iter;
+        }
+    }
+
+    receiving_message.append(iter, end - iter);
+    return end;
+}
+
+bool connection::read_blocks(const char* iter, const char* end, const frame_callback& callback) {
+    while (iter < end) {
+        if (block_remaining == 0) {
+            // the header may be split between reads
+            size_t missing = BLOCK_HEADER_SIZE - block.size();
+            size_t taken = min<size_t>(missing, end - iter);
+            block.append(iter, taken);
+            iter += taken;
+
+            if (block.size() < BLOCK_HEADER_SIZE) {
+                break;
+            }
+
+            uint32_t header;
+            memcpy(&header, block.data(), BLOCK_HEADER_SIZE);
+            header = ntohl(header);
+            block.clear();
+
+            block_compressed = header & COMPRESSED_BLOCK;
+            block_remaining = header & ~COMPRESSED_BLOCK;
+            continue;
+        }
+
+        size_t taken = min<size_t>(block_remaining, end - iter);
+        if (block_compressed) {
+            batch.clear();
+            if (!decoder->decode(iter, taken, batch)) {
+                return false;
+            }
+
+            split_frames(batch.data(), batch.data() + batch.size(), callback, false);
+        } else {
+            split_frames(iter, iter + taken, callback, false);
+        }
+
+        iter += taken;
+        block_remaining -= taken;
     }
 
-    string final_message(message);
-    final_message.push_back(ETX);
-    sending_messages.push(final_message);
+    return true;
+}
 
+void connection::push_send_message(const string& message, priority_class priority,
+                                    int stamp_offset) {
+    queue_send_message(message, priority, stamp_offset);
     send_messages();
 }
 
+void connection::queue_send_message(const string& message, priority_class priority,
+                                    int stamp_offset, size_t topic_size) {
+    // epoll is told to monitor writing only when send_messages() cannot
+    // send everything
+    pending_frame frame;
+    frame.data.reserve(message.size() + 1);
+    frame.data.append(message.data(), message.size());
+    frame.data.push_back(ETX);
+    frame.enqueue_time = now_ns();
+    frame.stamp_offset = stamp_offset;
+    frame.prepared = false;
+    frame.conflated = false;
+    set_topic(frame, topic_size);
+    sending_messages[priority].push(std::move(frame));
+}
+
+void connection::set_topic(pending_frame& frame, size_t topic_size) {
+    frame.topic_size = topic_size;
+    frame.topic_offset = 0;
+
+    if (topic_size) {
+        // "3<topic> - ..." or "5<recv>[,<send>] <topic> - ..."
+        frame.topic_offset = frame.data[0] == TIMED_INFO ? frame.data.find(' ') + 1 : 1;
+    }
+}
+
+bool connection::queue_conflated_message(const string& key, const string& message,
+                                            priority_class priority, int stamp_offset,
+                                            size_t topic_size) {
+    if (conflated_frames == nullptr) {
+        conflated_frames = new conflation_index;
+    }
+
+    auto slot = conflated_frames->find(key);
+    if (slot != conflated_frames->end()) {
+        pending_frame* queued = slot->second;
+
+        // a prepared frame started being sent, or its alias was recorded
+        // as announced; replacing it would lose the announcement
+        if (!queued->prepared) {
+            // keep the place (and the enqueue time) of the old frame
+            queued->data.assign(message.data(), message.size());
+            queued->data.push_back(ETX);
+            queued->stamp_offset = stamp_offset;
+            set_topic(*queued, topic_size);
+            return true;
+        }
+
+        // the new frame goes after it, and takes its place in the index
+        queued->conflated = false;
+        conflated_frames->erase(slot);
+    }
+
+    queue_send_message(message, priority, stamp_offset, topic_size);
+
+    // the references to the elements of a deque survive pushes and pops
+    pending_frame& frame = sending_messages[priority].back();
+    frame.conflated = true;
+    frame.slot = conflated_frames->emplace(key, &frame).first;
+    return false;
+}
+
+size_t connection::pending_frames() const {
+    size_t frames = 0;
+    for (auto& class_queue : sending_messages) {
+        frames += class_queue.size();
+    }
+
+    return frames;
+}
+
+uint32_t connection::get_data_segments() const {
+    tcp_info info;
+    socklen_t size = sizeof(info);
+
+    if (transport::get()->get_option(connectionfd, IPPROTO_TCP, TCP_INFO, &info, &size) == -1
+        || size < offsetof(tcp_info, tcpi_data_segs_out) + sizeof(info.tcpi_data_segs_out)) {
+        // older kernel
+        return 0;
+    }
+
+    return info.tcpi_data_segs_out;
+}
+
+bool connection::has_pending_messages() const {
+    for (auto& class_queue : sending_messages) {
+        if (!class_queue.empty()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int connection::next_raw_class() {
+    if (index_send_message > 0) {
+        return sending_class;
+    }
+
+    // in queue order, the same as without compression
+    for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+        if (raw_frames[priority]) {
+            return sending_class = priority;
+        }
+    }
+
+    return -1;
+}
+
+int connection::next_sending_class() {
+    if (index_send_message > 0) {
+        // finish the frame that is partially sent
+        return sending_class;
+    }
+
+    // keep the EXIT message last when closing, whatever the policy
+    if (scheduling == SCHEDULE_STRICT || state == STATE_INVALID) {
+        for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+            if (!sending_messages[priority].empty()) {
+                return sending_class = priority;
+            }
+        }
+    }
+
+    // deficit round robin: a class sends while it has enough credit
+    while (true) {
+        auto& class_queue = sending_messages[sending_class];
+
+        if (!class_queue.empty()
+            && deficit[sending_class] >= (int)class_queue.front().data.size()) {
+            return sending_class;
+        }
+
+        if (class_queue.empty()) {
+            // idle classes do not accumulate credit
+            deficit[sending_class] = 0;
+        }
+
+        sending_class = (sending_class + 1) % PRIORITY_CLASSES;
+        if (!sending_messages[sending_class].empty()) {
+            deficit[sending_class] += class_weights[sending_class] * SCHEDULE_QUANTUM;
+        }
+    }
+}
+
 void connection::send_messages() {
-    while (!sending_messages.empty()) {
-        while (index_send_message < sending_messages.front().size()) {
-            ssize_t send_size = send(connectionfd,
-                            sending_messages.front().data() + index_send_message,
-                            sending_messages.front().size() - index_send_message,
-                            0);
+    // the frames queued before the compression was enabled go out as they are
+    while (has_pending_messages()) {
+        int priority = encoder ? next_raw_class() : next_sending_class();
+        if (priority < 0) {
+            break;
+        }
+
+        pending_frame& frame = sending_messages[priority].front();
+
+        if (!frame.prepared) {
+            prepare_frame(frame);
+        }
+
+        while (index_send_message < frame.data.size()) {
+            // with more frames behind this one, let the kernel wait for them
+            // to fill the segment
+            int flags = MSG_NOSIGNAL;
+            if (pack_frames && pending_frames() > 1) {
+                flags |= MSG_MORE;
+            }
+
+            send_calls++;
+            ssize_t send_size = transport::get()->send(connectionfd,
+                            frame.data.data() + index_send_message,
+                            frame.data.size() - index_send_message,
+                            flags);
 
             if (send_size > 0) {
                 index_send_message += send_size;
             } else {
                 if (send_size == 0 || errno != EAGAIN) {
                     state = STATE_CONNECTION_BROKEN;
+                } else {
+                    // the rest is sent once the socket is writable again
+                    set_monitor(monitored_events | EPOLLOUT);
                 }
 
                 return;
@@ -112,23 +447,196 @@ void connection::send_messages() {
         }
 
         index_send_message = 0;
-        sending_messages.pop();
+        frame_sent(priority);
+
+        if (encoder) {
+            raw_frames[priority]--;
+        }
+    }
+
+    if (encoder && !send_blocks()) {
+        return;
     }
 
     // no more messages shall be sent, change epoll so that it does not
-    // monitot transmitting information anymore
+    // monitor transmitting information anymore (if it did)
     set_monitor(EPOLLIN);
 
     if (state == STATE_INVALID)
         state = STATE_DISCONNECTED;
 }
 
+void connection::prepare_frame(pending_frame& frame) {
+    frame.prepared = true;
+
+    if (frame.stamp_offset >= 0) {
+        // the frame leaves now; fill in its send timestamp
+        char stamp[TIMESTAMP_DIGITS + 1];
+        snprintf(stamp, sizeof(stamp), "%0*llu", TIMESTAMP_DIGITS,
+                    (unsigned long long)realtime_ns());
+        frame.data.replace(frame.stamp_offset, TIMESTAMP_DIGITS, stamp, TIMESTAMP_DIGITS);
+        frame.stamp_offset = -1;
+    }
+
+    if (frame.topic_size && aliases) {
+        apply_topic_alias(frame);
+    }
+}
+
+void connection::frame_sent(int priority) {
+    pending_frame& frame = sending_messages[priority].front();
+
+    queue_latency[priority].add(now_ns() - frame.enqueue_time);
+    if (scheduling == SCHEDULE_WEIGHTED) {
+        deficit[priority] -= frame.data.size();
+    }
+
+    if (frame.conflated) {
+        conflated_frames->erase(frame.slot);
+    }
+
+    sending_messages[priority].pop();
+    frames_sent++;
+    total_frames_sent++;
+}
+
+bool connection::send_blocks() {
+    while (true) {
+        if (block_sent == block.size()) {
+            if (!has_pending_messages()) {
+                return true;
+            }
+
+            make_block();
+        }
+
+        send_calls++;
+        ssize_t send_size = transport::get()->send(connectionfd, block.data() + block_sent,
+                                                    block.size() - block_sent, MSG_NOSIGNAL);
+
+        if (send_size > 0) {
+            block_sent += send_size;
+        } else {
+            if (send_size == 0 || errno != EAGAIN) {
+                state = STATE_CONNECTION_BROKEN;
+            } else {
+                set_monitor(monitored_events | EPOLLOUT);
+            }
+
+            return false;
+        }
+    }
+}
+
+void connection::make_block() {
+    // the batch: the queued frames, in the order of the scheduling
+    batch.clear();
+    while (has_pending_messages() && batch.size() < MAX_BLOCK_INPUT) {
+        int priority = next_sending_class();
+        pending_frame& frame = sending_messages[priority].front();
+
+        prepare_frame(frame);
+        batch.append(frame.data.data(), frame.data.size());
+        frame_sent(priority);
+    }
+
+    block.assign(BLOCK_HEADER_SIZE, '\0');
+    block_sent = 0;
+
+    uint32_t header;
+    if (batch.size() >= min_compressed_batch) {
+        uint64_t start = now_ns();
+        DIE(!encoder->encode(batch.data(), batch.size(), block), "Compression failed");
+        compression_time += now_ns() - start;
+
+        header = htonl((block.size() - BLOCK_HEADER_SIZE) | COMPRESSED_BLOCK);
+    } else {
+        block.append(batch);
+        header = htonl(batch.size());
+    }
+    memcpy(&block[0], &header, BLOCK_HEADER_SIZE);
+
+    compression_input_bytes += batch.size();
+    compression_output_bytes += block.size();
+}
+
+void connection::enable_compression(stream_codec* codec, size_t min_batch) {
+    encoder = codec;
+    min_compressed_batch = min_batch;
+    for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+        raw_frames[priority] = sending_messages[priority].size();
+    }
+}
+
+void connection::enable_decompression(stream_codec* codec) {
+    decoder = codec;
+}
+
+void connection::enable_topic_aliases() {
+    if (aliases == nullptr) {
+        aliases = new alias_table;
+        aliases->next = 0;
+    }
+}
+
+void connection::apply_topic_alias(pending_frame& frame) {
+    string_view topic(frame.data.data() + frame.topic_offset, frame.topic_size);
+    frame.topic_size = 0;
+
+    auto found = aliases->topics.find(topic);
+    bool announce = found == aliases->topics.end();
+
+    if (announce) {
+        uint32_t alias = aliases->next;
+        aliases->next = (alias + 1) % MAX_TOPIC_ALIASES;
+
+        if (alias < aliases->by_alias.size()) {
+            // the oldest alias changes topic
+            aliases->topics.erase(aliases->by_alias[alias]);
+            found = aliases->topics.emplace(topic, alias).first;
+            aliases->by_alias[alias] = found;
+        } else {
+            found = aliases->topics.emplace(topic, alias).first;
+            aliases->by_alias.push_back(found);
+        }
+    }
+
+    char alias[16];
+    int alias_size = snprintf(alias, sizeof(alias), "%u", found->second);
+    alias_saved_bytes += (int64_t)topic.size() - alias_size;
+
+    if (!announce) {
+        frame.data.replace(frame.topic_offset, topic.size(), alias, alias_size);
+        return;
+    }
+
+    // "A<alias> <topic>" ETX, then the frame with the alias
+    frame_buffer announced;
+    announced.reserve(frame.data.size() + alias_size * 2 + 3);
+    announced.push_back(TOPIC_ALIAS);
+    announced.append(alias, alias_size);
+    announced.push_back(' ');
+    announced.append(topic.data(), topic.size());
+    announced.push_back(ETX);
+    announced.append(frame.data.data(), frame.topic_offset);
+    announced.append(alias, alias_size);
+    announced.append(frame.data, frame.topic_offset + topic.size(), frame_buffer::npos);
+
+    alias_saved_bytes -= alias_size + topic.size() + 3;
+    frame.data.swap(announced);
+}
+
 void connection::set_monitor(int new_monitor) {
+    if (new_monitor == monitored_events) {
+        return;
+    }
+
     monitored_events = new_monitor;
     epoll_event event;
     event.events = monitored_events;
     event.data.ptr = &epoll_info;
 
-    DIE(epoll_ctl(epollfd, EPOLL_CTL_MOD, connectionfd, &event) == -1,
+    epoll_ctl_calls++;
+    DIE(transport::get()->control(epollfd, EPOLL_CTL_MOD, connectionfd, &event) == -1,
             "Modifying connection to epoll failed");
 }
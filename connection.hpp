@@ -2,11 +2,20 @@
 #define _CONNECTION_HPP
 
 #include <string>
+#include <string_view>
 #include <queue>
+#include <vector>
+#include <map>
+#include <functional>
 
 #include <arpa/inet.h>
 
 #include "epoll_info.hpp"
+#include "histogram.hpp"
+#include "pool.hpp"
+#include "timer_wheel.hpp"
+#include "shm_ring.hpp"
+#include "codec.hpp"
 
 // first byte from every message
 enum message_info {
@@ -14,11 +23,109 @@ enum message_info {
     SUBSCRIBE = '1',
     UNSUBSCRIBE = '2',
     INFO = '3',
-    EXIT = '4'
+    EXIT = '4',
+    // INFO preceded by the server timestamps: "5<recv>[,<send>] <info>"
+    TIMED_INFO = '5',
+    // keepalive; the client answers with the same frame
+    HEARTBEAT = '6',
+    // shared memory ring: "7" (server) new frames in the ring,
+    // "7ok" / "7no" (client) the ring was mapped or not
+    SHM_RING = '7',
+    // between servers: "8+<pattern>" / "8-<pattern>" the sender got its first
+    // subscriber to the pattern or lost its last one
+    PEER_INTEREST = '8',
+    // between servers: "9<datagram>", with the ETX and escape bytes escaped
+    PEER_FORWARD = '9',
+    // "A<alias> <topic>": on the connections that asked for aliases in the
+    // handshake, the following INFO and TIMED_INFO frames carry the number
+    // in place of the topic (until the alias is announced again)
+    TOPIC_ALIAS = 'A',
+    // "B<first> <last> <topic>" (client): the multicast messages of the topic
+    // with these sequence numbers were lost; the server sends the ones it
+    // retained over TCP
+    MULTICAST_RECOVER = 'B'
+};
+
+// payload types of the INFO messages (same codes as in the UDP datagrams)
+enum payload_type {
+    PAYLOAD_INT = 0,
+    PAYLOAD_SHORT_REAL = 1,
+    PAYLOAD_FLOAT = 2,
+    PAYLOAD_STRING = 3,
+    PAYLOAD_UNKNOWN
+};
+
+// number of digits of the timestamps from the TIMED_INFO frames
+constexpr int TIMESTAMP_DIGITS = 19;
+
+// position of the send timestamp in a TIMED_INFO frame
+constexpr int SEND_STAMP_OFFSET = 1 + TIMESTAMP_DIGITS + 1;
+
+// longest frame built from a datagram: a TIMED_INFO frame with both
+// timestamps, a 50 bytes topic and a 1500 bytes string
+constexpr size_t MAX_DATA_FRAME_SIZE = SEND_STAMP_OFFSET + TIMESTAMP_DIGITS + 1 + 50
+                                        + sizeof(" - STRING - ") - 1 + 1500;
+
+// build the TIMED_INFO frame for the given INFO frame; the send timestamp
+// is left to be filled by the connection
+std::string make_timed_info(const std::string& info_message, uint64_t recv_time,
+                            bool with_send_time);
+
+// true if the topic matches the subscription pattern ("*" stands for one or
+// more levels and "+" for exactly one)
+bool topic_matches(const char* pattern, const char* topic);
+
+// delivery classes of the outgoing frames; lower values are sent first
+enum priority_class {
+    PRIORITY_HIGH = 0,      // control frames and latency-critical topics
+    PRIORITY_NORMAL = 1,
+    PRIORITY_LOW = 2,       // bulk topics
+    PRIORITY_CLASSES
 };
 
 class connection {
 public:
+    // how send_messages() chooses the class of the next frame
+    enum scheduling_policy {
+        SCHEDULE_STRICT,    // always the highest non-empty class
+        SCHEDULE_WEIGHTED   // deficit round robin, using class_weights
+    };
+
+    static scheduling_policy scheduling;
+    // number of bytes (in units of SCHEDULE_QUANTUM) that each class
+    // may send in a round of the weighted scheduling
+    static int class_weights[PRIORITY_CLASSES];
+
+    // the statistics below, and the pools of the connections and of their
+    // frames, are kept per thread: the threads running connections (the
+    // loop of the server, the subscribers of the library) never share them,
+    // so they need no locking; the server prints those of its loop
+
+    // time spent by the frames in the sending queues, for each class
+    static thread_local latency_histogram queue_latency[PRIORITY_CLASSES];
+
+    // send the queued frames with MSG_MORE, so that the kernel packs the
+    // frames of a batch into full segments (see queue_send_message)
+    static bool pack_frames;
+
+    // bytes of topics that were not sent thanks to the aliases, minus the
+    // announcements, on all the connections
+    static thread_local int64_t alias_saved_bytes;
+
+    // frames given to the compression (all the connections), the blocks
+    // made of them and the time spent compressing (ns)
+    static thread_local uint64_t compression_input_bytes;
+    static thread_local uint64_t compression_output_bytes;
+    static thread_local uint64_t compression_time;
+
+    // system calls made for all the connections, and the frames they sent;
+    // the write interest of a connection is only changed (epoll_ctl) when
+    // a send cannot go on and when its queue is drained again
+    static thread_local uint64_t send_calls;
+    static thread_local uint64_t recv_calls;
+    static thread_local uint64_t epoll_ctl_calls;
+    static thread_local uint64_t total_frames_sent;
+
     enum {
         STATE_CONNECTING,
         STATE_ACTIVE,
@@ -33,19 +140,97 @@ public:
     // unread received messages
     std::queue<std::string> recv_messages;
 
-    connection(int epollfd, int connectionfd, const sockaddr_in& addr);
+    // idle detection, managed by the owner: the time of the last received
+    // data and the timer that checks it
+    uint64_t last_activity;
+    wheel_timer idle_timer;
+
+    // INFO frames go through this ring instead of the socket, if set
+    // (released with the connection)
+    shm_ring* ring;
+
+    // coalescing, managed by the owner: when the queued frames must be sent
+    // (0 if none is waiting) and how many bytes they hold
+    uint64_t flush_deadline;
+    size_t unflushed_bytes;
+
+    // frames fully written to the socket
+    uint64_t frames_sent;
+
+    // the client receives the multicast group (managed by the owner)
+    bool multicast;
+
+    // with prepared, the socket is already non-blocking and has TCP_NODELAY
+    // (accept4 with SOCK_NONBLOCK from a listener with TCP_NODELAY), which
+    // saves three syscalls
+    connection(int epollfd, int connectionfd, const sockaddr_in& addr, bool prepared = false);
     ~connection();
 
+    // connections are taken from the slab pool of the thread (it may be
+    // freed by another thread, the slabs are never given back)
+    static void* operator new(size_t size);
+    static void operator delete(void* conn, size_t size);
+    static const slab_pool& get_pool() { return pool; }
+
+    // called for every complete frame (without its ETX); the view points
+    // straight into the receive buffer and is valid only during the call
+    typedef std::function<void(std::string_view)> frame_callback;
+
     // read from the connection untill it would block
     void recv_message();
 
+    // read from the connection untill it would block, handing each frame
+    // to the callback instead of copying it into recv_messages
+    void recv_frames(const frame_callback& callback);
+
     // add a message to the sending queue and call send_messages()
-    void push_send_message(const std::string& message);
+    void push_send_message(const std::string& message,
+                            priority_class priority = PRIORITY_HIGH,
+                            int stamp_offset = -1);
+
+    // add a message to the sending queue without sending it; used to batch
+    // several frames into a single send_messages() call; if stamp_offset is
+    // not -1, the wall clock time at which the frame starts being sent is
+    // written there (TIMESTAMP_DIGITS digits); topic_size is the size of
+    // the topic of an INFO or TIMED_INFO frame, replaced by its alias when
+    // the frame starts being sent if the connection uses aliases
+    void queue_send_message(const std::string& message,
+                            priority_class priority = PRIORITY_HIGH,
+                            int stamp_offset = -1, size_t topic_size = 0);
+
+    // same as queue_send_message(), except that if a frame queued with the
+    // same key has not started being sent, it is replaced in place by this
+    // one; returns true if a frame was replaced
+    bool queue_conflated_message(const std::string& key, const std::string& message,
+                                    priority_class priority = PRIORITY_HIGH,
+                                    int stamp_offset = -1, size_t topic_size = 0);
+
+    // send numeric aliases in place of the topics (see TOPIC_ALIAS)
+    void enable_topic_aliases();
+
+    // compression of the sent bytes (negotiated in the handshake): the
+    // frames queued from now on are sent in blocks, "<u32 size> <data>"
+    // (big endian; the top bit of the size is set if the data is
+    // compressed), each made of the frames waiting when it is built, and
+    // compressed with the codec (taken over) if they are at least
+    // min_batch bytes
+    void enable_compression(stream_codec* codec, size_t min_batch);
+
+    // the received bytes after the frame being handled are blocks, decoded
+    // with the codec (taken over)
+    void enable_decompression(stream_codec* codec);
+    bool uses_topic_aliases() const { return aliases != nullptr; }
 
     // send as much info as possible on the socket
     void send_messages();
 
-    // modify epoll event parameter
+    // TCP segments with data sent on the socket so far (0 if the kernel
+    // does not tell)
+    uint32_t get_data_segments() const;
+
+    int get_fd() const { return connectionfd; }
+
+    // modify epoll event parameter; nothing is done if it is unchanged
     void set_monitor(int new_monitor);
 private:
     const static char ETX = 0x3; // Marks the end of a message
@@ -58,8 +243,125 @@ private:
 
     std::string receiving_message;
 
-    std::queue<std::string> sending_messages;
+    static constexpr int SCHEDULE_QUANTUM = 1024;
+
+    static thread_local slab_pool pool;
+
+    // frames are stored in buffers from the size classed pools
+    typedef std::basic_string<char, std::char_traits<char>, pool_allocator<char>> frame_buffer;
+
+    struct pending_frame;
+
+    // queued frames that a newer frame of the same topic may replace
+    typedef std::map<std::string, pending_frame*> conflation_index;
+
+    struct pending_frame {
+        frame_buffer data;
+        uint64_t enqueue_time;
+        int stamp_offset;
+        // the topic to replace by its alias (topic_size is 0 if none)
+        uint8_t topic_offset;
+        uint8_t topic_size;
+        // set once its send timestamp and alias are filled in (it may
+        // carry the announcement of the alias); it then goes out as it is
+        bool prepared;
+        // set if the frame is in the conflation index, at slot
+        bool conflated;
+        conflation_index::iterator slot;
+    };
+
+    // allocated by the first conflated frame
+    conflation_index* conflated_frames;
+
+    // the aliases are given in order and, once they are all taken, the
+    // oldest one is announced again for the new topic; this is safe since
+    // the aliases are applied in the order in which the frames leave
+    static constexpr uint32_t MAX_TOPIC_ALIASES = 4096;
+
+    typedef std::map<std::string, uint32_t, std::less<>> alias_index;
+
+    struct alias_table {
+        alias_index topics;
+        // the topic of each alias
+        std::vector<alias_index::iterator> by_alias;
+        uint32_t next;
+    };
+
+    // nullptr if the connection does not use aliases
+    alias_table* aliases;
+
+    static constexpr size_t BLOCK_HEADER_SIZE = 4;
+    static constexpr uint32_t COMPRESSED_BLOCK = 0x80000000;
+    // frames are added to a block until it holds this much
+    static constexpr size_t MAX_BLOCK_INPUT = 64 * 1024;
+
+    // nullptr if the sent (received) bytes are not compressed
+    stream_codec* encoder;
+    stream_codec* decoder;
+
+    // frames of each class to send as they are before the blocks start
+    size_t raw_frames[PRIORITY_CLASSES];
+    size_t min_compressed_batch;
+
+    // the block being sent and how much of it was sent; when receiving,
+    // the part of the header received so far
+    std::string block;
+    size_t block_sent;
+    // frames of the block being built, or decoded from a received block
+    std::string batch;
+
+    // what is left of the received block
+    uint32_t block_remaining;
+    bool block_compressed;
+
+    // fill in the send timestamp and the topic alias of the frame that
+    // starts being sent
+    void prepare_frame(pending_frame& frame);
+
+    // account for the front frame of the class and remove it
+    void frame_sent(int priority);
+
+    // send the blocks until the queues are empty; returns false if the
+    // socket is full or broken
+    bool send_blocks();
+
+    // build the next block out of the queued frames
+    void make_block();
+
+    // hand the frames of the received bytes to the callback; with
+    // stop_at_codec, it stops after the frame that enabled the
+    // decompression; returns the end of what was consumed
+    const char* split_frames(const char* iter, const char* end,
+                                const frame_callback& callback, bool stop_at_codec);
+
+    // decode the received blocks; returns false if they are corrupted
+    bool read_blocks(const char* iter, const char* end, const frame_callback& callback);
+
+    // locate the topic of an INFO or TIMED_INFO frame
+    static void set_topic(pending_frame& frame, size_t topic_size);
+
+    // replace the topic of the frame by its alias, preceded by the
+    // announcement of the alias if it is new
+    void apply_topic_alias(pending_frame& frame);
+
+    typedef std::queue<pending_frame,
+                        std::deque<pending_frame, pool_allocator<pending_frame>>> frame_queue;
+
+    // one FIFO for each priority class
+    frame_queue sending_messages[PRIORITY_CLASSES];
     int index_send_message;
+
+    // class of the frame being sent (it is finished before switching)
+    int sending_class;
+    int deficit[PRIORITY_CLASSES];
+
+    bool has_pending_messages() const;
+    size_t pending_frames() const;
+
+    // choose the class whose front frame is sent next
+    // the class of the next frame queued before the compression, -1 if none
+    int next_raw_class();
+    int next_sending_class();
 };
 
 #endif  // _CONNECTION_HPP
@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <map>
+#include <stdlib.h>
+
+#include "filter.hpp"
+
+using namespace std;
+
+// the compiled filters, shared by all the subscriptions using them
+static map<string, payload_filter*> filters;
+
+// the merged filters, by the two filters they were made of
+static map<pair<const payload_filter*, const payload_filter*>, payload_filter*> merged_filters;
+
+const payload_filter* payload_filter::get(const string& source) {
+    auto iter = filters.find(source);
+    if (iter != filters.end()) {
+        iter->second->references++;
+        return iter->second;
+    }
+
+    payload_filter* filter = new payload_filter();
+    if (!filter->compile(source)) {
+        delete filter;
+        return nullptr;
+    }
+
+    filter->references = 1;
+    filters[source] = filter;
+    return filter;
+}
+
+const payload_filter* payload_filter::either(const payload_filter* first,
+                                                const payload_filter* second) {
+    if (first == second) {
+        return first;
+    }
+
+    auto iter = merged_filters.find({first, second});
+    if (iter != merged_filters.end()) {
+        return iter->second;
+    }
+
+    // the alternatives of both (MAX_SOURCE is checked only for the
+    // subscriptions, so that merging never fails)
+    payload_filter* merged = new payload_filter();
+    merged->source = first->source + "|" + second->source;
+
+    for (auto part : {first, second}) {
+        vector<const payload_filter*> compiled(1, part);
+        const vector<const payload_filter*>& parts =
+            part->alternatives.empty() ? compiled : part->alternatives;
+
+        for (auto alternative : parts) {
+            if (find(merged->alternatives.begin(), merged->alternatives.end(), alternative)
+                    == merged->alternatives.end()) {
+                merged->alternatives.push_back(alternative);
+            }
+        }
+    }
+
+    merged_filters[{first, second}] = merged;
+    return merged;
+}
+
+void payload_filter::acquire(const payload_filter* filter) {
+    if (filter && filter->alternatives.empty()) {
+        filter->references++;
+    }
+}
+
+void payload_filter::release(const payload_filter* filter) {
+    if (filter == nullptr || !filter->alternatives.empty() || --filter->references > 0) {
+        return;
+    }
+
+    // the merged filters made of it (merged ones included) go with it
+    for (auto iter = merged_filters.begin(); iter != merged_filters.end();) {
+        const vector<const payload_filter*>& parts = iter->second->alternatives;
+        if (find(parts.begin(), parts.end(), filter) != parts.end()) {
+            delete iter->second;
+            iter = merged_filters.erase(iter);
+        } else {
+            iter++;
+        }
+    }
+
+    filters.erase(filter->source);
+    delete filter;
+}
+
+bool payload_filter::compile(const string& text) {
+    source = text;
+
+    // patched when the next alternative starts
+    vector<size_t> pending_jumps;
+    size_t start = 0;
+
+    while (start <= text.size()) {
+        size_t end = text.find('|', start);
+        if (end == string::npos) {
+            end = text.size();
+        }
+
+        string_view alternative(text.data() + start, end - start);
+        if (alternative.empty()) {
+            return false;
+        }
+
+        for (size_t jump : pending_jumps) {
+            code[jump].on_false = code.size();
+        }
+        pending_jumps.clear();
+
+        size_t term_start = 0;
+        while (term_start <= alternative.size()) {
+            size_t term_end = alternative.find('&', term_start);
+            if (term_end == string_view::npos) {
+                term_end = alternative.size();
+            }
+
+            instruction term{};
+            if (!compile_term(alternative.substr(term_start, term_end - term_start), term)) {
+                return false;
+            }
+
+            pending_jumps.push_back(code.size());
+            code.push_back(term);
+            term_start = term_end + 1;
+        }
+
+        instruction accept{};
+        accept.op = OP_ACCEPT;
+        code.push_back(accept);
+
+        start = end + 1;
+    }
+
+    for (size_t jump : pending_jumps) {
+        code[jump].on_false = code.size();
+    }
+
+    instruction reject{};
+    reject.op = OP_REJECT;
+    code.push_back(reject);
+
+    return code.size() < UINT16_MAX;
+}
+
+bool payload_filter::compile_term(string_view term, instruction& result) {
+    static const struct {
+        string_view name;
+        uint8_t types;
+    } type_names[] = {
+        {"int", 1 << PAYLOAD_INT},
+        {"short_real", 1 << PAYLOAD_SHORT_REAL},
+        {"float", 1 << PAYLOAD_FLOAT},
+        {"string", 1 << PAYLOAD_STRING},
+        {"number", (1 << PAYLOAD_INT) | (1 << PAYLOAD_SHORT_REAL) | (1 << PAYLOAD_FLOAT)}
+    };
+
+    static const struct {
+        string_view symbol;
+        opcode op;
+    } comparisons[] = {
+        // the two character operators first
+        {">=", OP_GE}, {"<=", OP_LE}, {"==", OP_EQ}, {"!=", OP_NE},
+        {">", OP_GT}, {"<", OP_LT}
+    };
+
+    // the whole term must be a number
+    auto parse_number = [](string_view text, double& value) {
+        if (text.empty()) {
+            return false;
+        }
+
+        string number(text);
+        char* end;
+        value = strtod(number.data(), &end);
+        return *end == '\0';
+    };
+
+    if (term.empty()) {
+        return false;
+    }
+
+    if (term[0] == '^') {
+        result.op = OP_PREFIX;
+        result.offset = literals.size();
+        result.size = term.size() - 1;
+        literals.append(term.data() + 1, term.size() - 1);
+        return true;
+    }
+
+    for (auto& type : type_names) {
+        if (term == type.name) {
+            result.op = OP_TYPE;
+            result.types = type.types;
+            return true;
+        }
+    }
+
+    for (auto& comparison : comparisons) {
+        if (term.compare(0, comparison.symbol.size(), comparison.symbol) == 0) {
+            result.op = comparison.op;
+            return parse_number(term.substr(comparison.symbol.size()), result.low);
+        }
+    }
+
+    size_t range = term.find("..");
+    if (range != string_view::npos) {
+        result.op = OP_RANGE;
+        return parse_number(term.substr(0, range), result.low)
+                && parse_number(term.substr(range + 2), result.high);
+    }
+
+    return false;
+}
+
+bool payload_filter::evaluate(const typed_payload& payload) const {
+    bool numeric = payload.type == PAYLOAD_INT
+                    || payload.type == PAYLOAD_SHORT_REAL
+                    || payload.type == PAYLOAD_FLOAT;
+    double value = payload.number;
+    size_t pc = 0;
+
+    while (true) {
+        const instruction& current = code[pc];
+        bool holds;
+
+        switch (current.op) {
+            case OP_TYPE:
+                holds = (current.types >> payload.type) & 1;
+                break;
+            case OP_GT:
+                holds = numeric && value > current.low;
+                break;
+            case OP_GE:
+                holds = numeric && value >= current.low;
+                break;
+            case OP_LT:
+                holds = numeric && value < current.low;
+                break;
+            case OP_LE:
+                holds = numeric && value <= current.low;
+                break;
+            case OP_EQ:
+                holds = numeric && value == current.low;
+                break;
+            case OP_NE:
+                holds = numeric && value != current.low;
+                break;
+            case OP_RANGE:
+                holds = numeric && value >= current.low && value <= current.high;
+                break;
+            case OP_PREFIX:
+                holds = payload.type == PAYLOAD_STRING
+                        && payload.text.compare(0, current.size,
+                                                string_view(literals.data() + current.offset,
+                                                            current.size)) == 0;
+                break;
+            case OP_ACCEPT:
+                return true;
+            default:
+                return false;
+        }
+
+        pc = holds ? pc + 1 : current.on_false;
+    }
+}
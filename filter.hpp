@@ -0,0 +1,123 @@
+#ifndef _FILTER_HPP
+#define _FILTER_HPP
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "connection.hpp"
+
+// the payload of a datagram, decoded once for all the filters
+struct typed_payload {
+    payload_type type;
+    // value of the numeric types
+    double number;
+    // value of STRING
+    std::string_view text;
+};
+
+// predicate on the payload of the messages of a subscription ("filter=..."
+// option), compiled into a small bytecode
+//
+// syntax (no spaces): alternatives separated by '|', each made of terms
+// separated by '&'; a message passes if all the terms of an alternative
+// hold. Terms:
+//  - int, short_real, float, string, number (any of the first three) - type
+//  - >N, >=N, <N, <=N, ==N, !=N - comparison of a numeric value
+//  - A..B - numeric value in [A, B]
+//  - ^PREFIX - string value starting with PREFIX
+// e.g. "int&>100", "float&0..1|int&<0", "^ALERT"
+class payload_filter {
+public:
+    // the compiled filter for the given source, or nullptr if it is not
+    // valid; the filters are interned (subscriptions with the same filter
+    // share it, so it is evaluated once per message) and counted: the
+    // caller holds a reference, given back with release()
+    static const payload_filter* get(const std::string& source);
+
+    // a filter passing the messages that pass any of the two, evaluated as
+    // the list of their compiled filters; it is cached for the pair and is
+    // not counted: it is freed with the first of its compiled filters
+    static const payload_filter* either(const payload_filter* first,
+                                        const payload_filter* second);
+
+    // take and give back a reference (nullptr and merged filters are
+    // ignored); the filter is freed with its last reference
+    static void acquire(const payload_filter* filter);
+    static void release(const payload_filter* filter);
+
+    const std::string& get_source() const { return source; }
+
+    // the result is cached for the message with the given sequence number
+    bool matches(const typed_payload& payload, uint64_t message) const {
+        if (cached_message != message) {
+            cached_message = message;
+
+            if (alternatives.empty()) {
+                cached_result = evaluate(payload);
+            } else {
+                cached_result = false;
+                for (auto alternative : alternatives) {
+                    if (alternative->matches(payload, message)) {
+                        cached_result = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        return cached_result;
+    }
+    // longest filter accepted in a subscription
+    static constexpr size_t MAX_SOURCE = 256;
+private:
+    enum opcode : uint8_t {
+        OP_TYPE,        // the type is in `types`
+        OP_GT,
+        OP_GE,
+        OP_LT,
+        OP_LE,
+        OP_EQ,
+        OP_NE,
+        OP_RANGE,       // low <= value <= high
+        OP_PREFIX,      // the text starts with literals[offset, offset + size)
+        OP_ACCEPT,
+        OP_REJECT
+    };
+
+    // a test that goes on with the next instruction if it holds, and jumps
+    // to on_false otherwise
+    struct instruction {
+        opcode op;
+        uint8_t types;
+        uint16_t on_false;
+        uint32_t offset;
+        uint32_t size;
+        double low;
+        double high;
+    };
+
+    std::string source;
+    std::vector<instruction> code;
+    std::string literals;
+
+    // merged filters: the compiled filters whose messages pass (no code)
+    std::vector<const payload_filter*> alternatives;
+
+    // compiled filters: the subscriptions using it
+    mutable uint32_t references;
+
+    mutable uint64_t cached_message;
+    mutable bool cached_result;
+
+    payload_filter() : references(0), cached_message(UINT64_MAX), cached_result(false) {}
+
+    // returns false for invalid sources
+    bool compile(const std::string& text);
+    bool compile_term(std::string_view term, instruction& result);
+
+    bool evaluate(const typed_payload& payload) const;
+};
+
+#endif  // _FILTER_HPP
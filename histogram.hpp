@@ -0,0 +1,107 @@
+#ifndef _HISTOGRAM_HPP
+#define _HISTOGRAM_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <ostream>
+
+// log-linear histogram of durations (in ns): every power of two is split
+// into SUB_BUCKETS buckets, so percentiles are within ~25% of the real value
+class latency_histogram {
+public:
+    latency_histogram() { reset(); }
+
+    void add(uint64_t value) {
+        buckets[bucket_of(value)]++;
+        count++;
+        sum += value;
+        if (value > max) {
+            max = value;
+        }
+    }
+
+    void merge(const latency_histogram& other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            buckets[i] += other.buckets[i];
+        }
+
+        count += other.count;
+        sum += other.sum;
+        if (other.max > max) {
+            max = other.max;
+        }
+    }
+
+    void reset() {
+        memset(buckets, 0, sizeof(buckets));
+        count = sum = max = 0;
+    }
+
+    uint64_t get_count() const { return count; }
+    uint64_t get_max() const { return max; }
+    uint64_t get_mean() const { return count ? sum / count : 0; }
+
+    // upper bound of the bucket containing the given percentile (0 - 100)
+    uint64_t percentile(double p) const {
+        if (count == 0) {
+            return 0;
+        }
+
+        uint64_t rank = (uint64_t)(p / 100 * count);
+        if (rank >= count) {
+            rank = count - 1;
+        }
+
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen > rank) {
+                uint64_t bound = bucket_upper_bound(i);
+                return bound < max ? bound : max;
+            }
+        }
+
+        return max;
+    }
+
+    // one line summary: count, mean, p50, p99, p99.9 and max
+    void print(std::ostream& out) const {
+        out << "count " << count
+            << " mean " << get_mean()
+            << "ns p50 " << percentile(50)
+            << "ns p99 " << percentile(99)
+            << "ns p99.9 " << percentile(99.9)
+            << "ns max " << max << "ns";
+    }
+private:
+    static constexpr int SUB_BUCKET_BITS = 2;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr int BUCKETS = 64 * SUB_BUCKETS;
+
+    uint64_t buckets[BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+
+    static int bucket_of(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return (int)value;
+        }
+
+        int msb = 63 - __builtin_clzll(value);
+        int sub = (int)(value >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return (msb - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t bucket_upper_bound(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+
+        int msb = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        uint64_t sub = bucket % SUB_BUCKETS;
+        return ((SUB_BUCKETS + sub + 1) << (msb - SUB_BUCKET_BITS)) - 1;
+    }
+};
+
+#endif  // _HISTOGRAM_HPP
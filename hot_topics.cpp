@@ -0,0 +1,86 @@
+#include <string.h>
+#include <algorithm>
+
+#include "utils.h"
+#include "hot_topics.hpp"
+
+using namespace std;
+
+void count_min_sketch::reset() {
+    memset(counters, 0, sizeof(counters));
+}
+
+void heavy_hitters::sort() {
+    std::sort(entries, entries + size, [](const entry& a, const entry& b) {
+        return a.estimate > b.estimate;
+    });
+}
+
+void hot_topics::record(const char* topic, size_t topic_size, uint64_t match_time,
+                        const topics_tree::matched_patterns& patterns, uint64_t frame_size,
+                        uint64_t fanout_bytes, uint64_t weight) {
+    uint64_t hash = hash_bytes(topic, topic_size);
+    match_time *= weight;
+    frame_size *= weight;
+    fanout_bytes *= weight;
+
+    auto topic_name = [topic, topic_size](char* name, size_t max_size) {
+        size_t size = min(topic_size, max_size);
+        memcpy(name, topic, size);
+        name[size] = '\0';
+    };
+
+    topic_bytes.add(hash, fanout_bytes);
+    topic_time.add(hash, match_time);
+    hot_topics_bytes.offer(hash, topic_bytes.estimate(hash), topic_name);
+    hot_topics_time.offer(hash, topic_time.estimate(hash), topic_name);
+
+    for (auto pattern : patterns) {
+        uint64_t pattern_hash = topics_tree::pattern_hash(pattern);
+
+        // the name is only built when the pattern enters a table
+        auto pattern_name = [pattern](char* name, size_t max_size) {
+            string full_name = topics_tree::pattern_of(pattern);
+            size_t size = min(full_name.size(), max_size);
+            memcpy(name, full_name.data(), size);
+            name[size] = '\0';
+        };
+
+        pattern_bytes.add(pattern_hash, frame_size * pattern->subscribers.size());
+        pattern_time.add(pattern_hash, match_time);
+        hot_patterns_bytes.offer(pattern_hash, pattern_bytes.estimate(pattern_hash), pattern_name);
+        hot_patterns_time.offer(pattern_hash, pattern_time.estimate(pattern_hash), pattern_name);
+    }
+}
+
+void hot_topics::print_table(ostream& out, const char* title, heavy_hitters& table,
+                                const count_min_sketch& bytes, const count_min_sketch& time) {
+    table.sort();
+
+    out << title << ":" << endl;
+    for (int i = 0; i < table.get_size(); i++) {
+        const heavy_hitters::entry& entry = table.get(i);
+        out << "  " << entry.name
+            << " - " << bytes.estimate(entry.hash) << " bytes"
+            << ", " << time.estimate(entry.hash) / 1000 << "us matching" << endl;
+    }
+}
+
+void hot_topics::print(ostream& out) {
+    print_table(out, "Topics by fan-out bytes", hot_topics_bytes, topic_bytes, topic_time);
+    print_table(out, "Topics by matching time", hot_topics_time, topic_bytes, topic_time);
+    print_table(out, "Patterns by fan-out bytes", hot_patterns_bytes, pattern_bytes, pattern_time);
+    print_table(out, "Patterns by matching time", hot_patterns_time, pattern_bytes, pattern_time);
+}
+
+void hot_topics::reset() {
+    topic_bytes.reset();
+    topic_time.reset();
+    pattern_bytes.reset();
+    pattern_time.reset();
+
+    hot_topics_bytes.reset();
+    hot_topics_time.reset();
+    hot_patterns_bytes.reset();
+    hot_patterns_time.reset();
+}
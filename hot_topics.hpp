@@ -0,0 +1,131 @@
+#ifndef _HOT_TOPICS_HPP
+#define _HOT_TOPICS_HPP
+
+#include <stdint.h>
+#include <ostream>
+
+#include "topics.hpp"
+
+// approximate counters for an unbounded set of keys in fixed memory; the
+// estimate of a key is never lower than its real value
+class count_min_sketch {
+public:
+    count_min_sketch() { reset(); }
+
+    void add(uint64_t hash, uint64_t value) {
+        for (int row = 0; row < DEPTH; row++) {
+            counters[row][index(hash, row)] += value;
+        }
+    }
+
+    uint64_t estimate(uint64_t hash) const {
+        uint64_t result = UINT64_MAX;
+
+        for (int row = 0; row < DEPTH; row++) {
+            uint64_t value = counters[row][index(hash, row)];
+            if (value < result) {
+                result = value;
+            }
+        }
+
+        return result;
+    }
+
+    void reset();
+private:
+    static constexpr int DEPTH = 4;
+    static constexpr int WIDTH = 2048;
+
+    uint64_t counters[DEPTH][WIDTH];
+
+    // a different part of the hash for each row
+    static int index(uint64_t hash, int row) {
+        return (int)((hash >> (row * 16)) & (WIDTH - 1));
+    }
+};
+
+// the K keys with the biggest estimates seen so far (space saving)
+class heavy_hitters {
+public:
+    static constexpr int CAPACITY = 16;
+    static constexpr int MAX_NAME = 64;
+
+    struct entry {
+        uint64_t hash;
+        uint64_t estimate;
+        char name[MAX_NAME + 1];
+    };
+
+    heavy_hitters() { reset(); }
+
+    // offer a key with its current estimate; the name is only read when the
+    // key enters the table
+    template <typename name_function>
+    void offer(uint64_t hash, uint64_t estimate, const name_function& name) {
+        int min_index = 0;
+
+        for (int i = 0; i < size; i++) {
+            if (entries[i].hash == hash) {
+                entries[i].estimate = estimate;
+                return;
+            }
+
+            if (entries[i].estimate < entries[min_index].estimate) {
+                min_index = i;
+            }
+        }
+
+        if (size < CAPACITY) {
+            min_index = size++;
+        } else if (estimate <= entries[min_index].estimate) {
+            return;
+        }
+
+        entries[min_index].hash = hash;
+        entries[min_index].estimate = estimate;
+        name(entries[min_index].name, MAX_NAME);
+    }
+
+    // sort the entries by their estimates, biggest first
+    void sort();
+
+    int get_size() const { return size; }
+    const entry& get(int index) const { return entries[index]; }
+
+    void reset() { size = 0; }
+private:
+    entry entries[CAPACITY];
+    int size;
+};
+
+// tracks the topics and the subscription patterns that cost the most
+// fan-out bytes and matching time; the memory does not depend on the number
+// of topics
+class hot_topics {
+public:
+    // account a datagram: its topic, the time spent matching it, the
+    // patterns that matched and the bytes queued for its subscribers; a
+    // sampled datagram stands for `weight` datagrams
+    void record(const char* topic, size_t topic_size, uint64_t match_time,
+                const topics_tree::matched_patterns& patterns, uint64_t frame_size,
+                uint64_t fanout_bytes, uint64_t weight = 1);
+
+    void print(std::ostream& out);
+
+    void reset();
+private:
+    count_min_sketch topic_bytes;
+    count_min_sketch topic_time;
+    count_min_sketch pattern_bytes;
+    count_min_sketch pattern_time;
+
+    heavy_hitters hot_topics_bytes;
+    heavy_hitters hot_topics_time;
+    heavy_hitters hot_patterns_bytes;
+    heavy_hitters hot_patterns_time;
+
+    static void print_table(std::ostream& out, const char* title, heavy_hitters& table,
+                            const count_min_sketch& bytes, const count_min_sketch& time);
+};
+
+#endif  // _HOT_TOPICS_HPP
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <string>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "utils.h"
+#include "logger.hpp"
+
+using namespace std;
+
+async_logger::async_logger() : head(0), tail(0), dropped(0), stopping(false), sleeping(false) {
+    writer = thread(&async_logger::write_records, this);
+}
+
+async_logger::~async_logger() {
+    {
+        lock_guard<mutex> lock(wake_lock);
+        stopping.store(true, memory_order_release);
+        wake.notify_one();
+    }
+    writer.join();
+
+    // the loop is gone; write what was added after the last drain
+    drain();
+}
+
+void async_logger::log(event type, const string& ID, const sockaddr_in* addr) {
+    uint64_t position = head.load(memory_order_relaxed);
+    uint64_t records = ID.size() <= MAX_ID ? 1 : (ID.size() + MAX_ID - 1) / MAX_ID;
+
+    if (position + records - tail.load(memory_order_acquire) > RING_SIZE) {
+        dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    record& entry = ring[position & (RING_SIZE - 1)];
+    entry.type = type;
+    entry.ID_size = ID.size();
+
+    if (addr) {
+        entry.addr = addr->sin_addr;
+        entry.port = addr->sin_port;
+    }
+
+    // the ID, in chunks of MAX_ID bytes
+    for (uint64_t index = 0; index < records; index++) {
+        size_t offset = index * MAX_ID;
+        memcpy(ring[(position + index) & (RING_SIZE - 1)].ID, ID.data() + offset,
+                min<size_t>(ID.size() - offset, MAX_ID));
+    }
+
+    // seq_cst, so that the store is ordered before the load of `sleeping`
+    head.store(position + records, memory_order_seq_cst);
+
+    if (sleeping.load(memory_order_seq_cst)) {
+        lock_guard<mutex> lock(wake_lock);
+        wake.notify_one();
+    }
+}
+
+bool async_logger::drain() {
+    uint64_t first = tail.load(memory_order_relaxed);
+    uint64_t last = head.load(memory_order_acquire);
+
+    if (first == last) {
+        return false;
+    }
+
+    string output;
+
+    string ID;
+
+    for (uint64_t position = first; position != last; position++) {
+        const record& entry = ring[position & (RING_SIZE - 1)];
+        ID.assign(entry.ID, min<size_t>(entry.ID_size, MAX_ID));
+
+        // the rest of a long ID
+        while (ID.size() < entry.ID_size) {
+            position++;
+            ID.append(ring[position & (RING_SIZE - 1)].ID,
+                        min<size_t>(entry.ID_size - ID.size(), MAX_ID));
+        }
+
+        switch (entry.type) {
+            case CLIENT_CONNECTED:
+                {
+                    char ip[INET_ADDRSTRLEN];
+                    inet_ntop(AF_INET, &entry.addr, ip, sizeof(ip));
+
+                    output += "New client " + ID + " connected from " + ip + ":"
+                                + to_string(ntohs(entry.port)) + ".\n";
+                }
+                break;
+            case CLIENT_REFUSED:
+                output += "Client " + ID + " already connected.\n";
+                break;
+            case CLIENT_DISCONNECTED:
+                output += "Client " + ID + " disconnected.\n";
+                break;
+            case PEER_CONNECTED:
+                {
+                    char ip[INET_ADDRSTRLEN];
+                    inet_ntop(AF_INET, &entry.addr, ip, sizeof(ip));
+
+                    output += "Peer " + ID + " connected from " + ip + ":"
+                                + to_string(ntohs(entry.port)) + ".\n";
+                }
+                break;
+            case PEER_DISCONNECTED:
+                output += "Peer " + ID + " disconnected.\n";
+                break;
+        }
+    }
+
+    // the records are formatted; give their slots back to the loop
+    tail.store(last, memory_order_release);
+
+    const char* data = output.data();
+    size_t size = output.size();
+
+    while (size > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, size);
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+void async_logger::write_records() {
+    while (!stopping.load(memory_order_acquire)) {
+        if (drain()) {
+            continue;
+        }
+
+        // the loop takes the lock to wake us up only after it sees the
+        // flag; it cannot notify between our check and the wait
+        unique_lock<mutex> lock(wake_lock);
+        sleeping.store(true, memory_order_seq_cst);
+
+        if (head.load(memory_order_seq_cst) == tail.load(memory_order_relaxed)
+            && !stopping.load(memory_order_acquire)) {
+            wake.wait(lock);
+        }
+
+        sleeping.store(false, memory_order_relaxed);
+    }
+}
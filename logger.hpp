@@ -0,0 +1,73 @@
+#ifndef _LOGGER_HPP
+#define _LOGGER_HPP
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <arpa/inet.h>
+
+// logger for the event loop: the loop only copies a small binary record into
+// a lock-free ring (single producer, single consumer) and a background thread
+// formats the records and writes them to STDOUT; the thread sleeps while the
+// ring is empty and the loop wakes it up with the next record
+class async_logger {
+public:
+    enum event {
+        CLIENT_CONNECTED,       // "New client <ID> connected from <IP>:<PORT>."
+        CLIENT_REFUSED,         // "Client <ID> already connected."
+        CLIENT_DISCONNECTED,    // "Client <ID> disconnected."
+        PEER_CONNECTED,         // "Peer <node> connected from <IP>:<PORT>."
+        PEER_DISCONNECTED       // "Peer <node> disconnected."
+    };
+
+    async_logger();
+
+    // writes everything that is still in the ring
+    ~async_logger();
+
+    // add a record; it is dropped (and counted) if the ring is full
+    void log(event type, const std::string& ID, const sockaddr_in* addr = nullptr);
+
+    uint64_t get_dropped() const { return dropped.load(std::memory_order_relaxed); }
+private:
+    static constexpr int RING_SIZE = 4096;      // power of two
+    // bytes of the ID held by a record; a longer ID goes on in the ID of
+    // the next records
+    static constexpr int MAX_ID = 108;
+
+    struct record {
+        uint8_t type;
+        uint16_t port;          // network order
+        in_addr addr;
+        uint32_t ID_size;       // the whole ID
+        char ID[MAX_ID];
+    };
+
+    record ring[RING_SIZE];
+
+    // head is written only by the loop, tail only by the writer thread
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint64_t> dropped;
+
+    std::atomic<bool> stopping;
+    std::thread writer;
+
+    // raised by the writer thread before it waits for new records
+    std::atomic<bool> sleeping;
+    std::mutex wake_lock;
+    std::condition_variable wake;
+
+    // body of the writer thread
+    void write_records();
+
+    // format and write the records between tail and head; returns false if
+    // there were none
+    bool drain();
+};
+
+#endif  // _LOGGER_HPP
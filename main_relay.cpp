@@ -0,0 +1,106 @@
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/unistd.h>
+#include "relay.hpp"
+#include "utils.h"
+
+using namespace std;
+
+static void usage(const char* name) {
+    cerr << "Usage: " << name << " <IP_PORT> <IP_SERVER> <PORT_SERVER> [options]\n"
+        << "  --id=NAME         ID of the relay's session to the server\n"
+        << "                   (relay-<hostname> by default)\n"
+        << "  --aliases         ask the server for topic aliases\n"
+        << "  --compress        ask the server to compress what it sends\n";
+}
+
+// parse the options after the server's address; returns false for invalid ones
+static bool parse_options(int argc, char* argv[], relay_config& config) {
+    enum {
+        OPT_ID = 1,
+        OPT_ALIASES,
+        OPT_COMPRESS
+    };
+
+    static const option long_options[] = {
+        {"id", required_argument, nullptr, OPT_ID},
+        {"aliases", no_argument, nullptr, OPT_ALIASES},
+        {"compress", no_argument, nullptr, OPT_COMPRESS},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_ID:
+                config.ID = optarg;
+                // the ID is a word of the handshake
+                if (config.ID.empty() || config.ID.find_first_of(" \t") != string::npos) {
+                    return false;
+                }
+                break;
+            case OPT_ALIASES:
+                config.upstream_aliases = true;
+                break;
+            case OPT_COMPRESS:
+                config.upstream_compression = true;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return optind == argc;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        // Wrong call of relay: it should be
+        // ./relay <IP_PORT> <IP_SERVER> <PORT_SERVER> [options]
+        usage(argv[0]);
+        return 1;
+    }
+
+    relay_config config;
+    config.port = atoi(argv[1]);
+
+    memset(&config.upstream, 0, sizeof(config.upstream));
+    config.upstream.sin_family = AF_INET;
+    config.upstream.sin_port = htons(atoi(argv[3]));
+    if (inet_aton(argv[2], &config.upstream.sin_addr) == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char hostname[256] = "";
+    gethostname(hostname, sizeof(hostname) - 1);
+    config.ID = string("relay-") + hostname;
+
+    // the options follow the server's address
+    if (!parse_options(argc - 3, argv + 3, config)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // allow as many connections as the system lets us
+    rlimit files;
+    DIE(getrlimit(RLIMIT_NOFILE, &files) == -1, "getrlimit failed");
+    files.rlim_cur = files.rlim_max;
+    DIE(setrlimit(RLIMIT_NOFILE, &files) == -1, "Raising the file limit failed");
+
+    // let cin keep its own buffer, so that in_avail() sees buffered commands;
+    // cout then has its own buffer too, which setvbuf does not reach
+    ios::sync_with_stdio(false);
+
+    // unbuffer STDOUT
+    cout << unitbuf;
+
+    relay* Relay = new relay(config);
+    Relay->run();
+    delete Relay;
+
+    return 0;
+}
@@ -1,21 +1,407 @@
 #include <iostream>
 #include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/resource.h>
 #include "server.hpp"
 #include "utils.h"
 
 using namespace std;
 
+static void usage(const char* name) {
+    cerr << "Usage: " << name << " <IP_PORT> [options]\n"
+        << "  --weights=H,N,L  weighted scheduling of the high / normal / low\n"
+        << "                   delivery classes (strict priority by default)\n"
+        << "  --hugepages      back the memory pools with huge pages\n"
+        << "  --udp-rate=RATE[,BURST]\n"
+        << "                   limit every UDP publisher (address:port) to RATE\n"
+        << "                   datagrams per second, with bursts of BURST\n"
+        << "  --udp-source-rate=ADDR[:PORT]=RATE[,BURST]\n"
+        << "                   specific limit for a publisher (may be repeated)\n"
+        << "  --profile[=N]    track the topics and patterns with the biggest\n"
+        << "                   fan-out cost (printed by the 'hot' command), on one\n"
+        << "                   datagram in N at random (16 by default, 1: all)\n"
+        << "  --snapshot=PATH  keep the subscriptions in PATH (and PATH.journal)\n"
+        << "                   and restore them at startup\n"
+        << "  --resume-grace=SECONDS\n"
+        << "                   drop the subscriptions of a disconnected client\n"
+        << "                   if it does not return in SECONDS (kept forever\n"
+        << "                   by default)\n"
+        << "  --heartbeat=SECONDS\n"
+        << "                   send a heartbeat to clients silent for SECONDS\n"
+        << "  --idle-timeout=SECONDS\n"
+        << "                   close the connections silent for SECONDS\n"
+        << "  --shm-ring=KB     size of the shared memory ring of the local\n"
+        << "                   subscribers (a power of two, at least 2; 1024 by\n"
+        << "                   default, 0 disables it)\n"
+        << "  --busy-poll=US    keep polling for US microseconds after each\n"
+        << "                   event before blocking (0: never block)\n"
+        << "  --cpu=N           pin the event loop to CPU N\n"
+        << "  --capture=FILE    record the received datagrams (see ./replay)\n"
+        << "  --coalesce=US[,BYTES]\n"
+        << "                   send the messages of a connection together, at\n"
+        << "                   the end of the loop iteration (US = 0) or US\n"
+        << "                   microseconds after the first one, or once they\n"
+        << "                   reach BYTES (16384 by default)\n"
+        << "  --retain=N[,MB]   send the last N messages of every topic to its\n"
+        << "                   new subscribers, keeping at most MB megabytes\n"
+        << "                   of them (64 by default)\n"
+        << "  --backlog=N       connections waiting to be accepted (4096 by\n"
+        << "                   default, capped by net.core.somaxconn)\n"
+        << "  --accept-budget=N accept at most N connections per loop iteration\n"
+        << "                   (256 by default)\n"
+        << "  --defer-accept=SECONDS\n"
+        << "                   let the kernel hold a new connection until its\n"
+        << "                   ID arrives, for at most SECONDS (2 by default,\n"
+        << "                   0 disables it)\n"
+        << "  --compress=LEVEL[,BYTES]\n"
+        << "                   compress (zlib level 1-9) the messages sent to\n"
+        << "                   the clients that ask for it, in batches of at\n"
+        << "                   least BYTES (256 by default)\n"
+        << "  --node=NAME       name of this server for its peers (node-<port>\n"
+        << "                   by default)\n"
+        << "  --peer=IP:PORT    link to another server (may be repeated); link\n"
+        << "                   every pair of nodes once, in either direction\n"
+        << "  --multicast=GROUP:PORT[,MIN]\n"
+        << "                   send the messages of the topics with at least MIN\n"
+        << "                   (64 by default) \"mcast\" subscriptions once, to\n"
+        << "                   the multicast group, instead of once per client;\n"
+        << "                   needs --retain, that keeps the messages the\n"
+        << "                   subscribers ask again\n"
+        << "  --multicast-if=ADDR\n"
+        << "                   local address of the interface of the group\n";
+}
+
+// parse "RATE[,BURST]"; the burst defaults to one second of traffic
+static bool parse_limits(const char* text, rate_limiter::limits& limits) {
+    int fields = sscanf(text, "%lf,%lf", &limits.rate, &limits.burst);
+    if (fields < 1 || limits.rate < 0) {
+        return false;
+    }
+
+    if (fields == 1) {
+        limits.burst = limits.rate;
+    }
+
+    return limits.burst >= 1 || limits.rate == 0;
+}
+
+// parse "ADDR[:PORT]=RATE[,BURST]"
+static bool parse_source_limits(const char* text, server_config::udp_source& source) {
+    const char* limits = strchr(text, '=');
+    if (limits == nullptr) {
+        return false;
+    }
+
+    string addr(text, limits - text);
+    source.port = 0;
+
+    size_t port_pos = addr.find(':');
+    if (port_pos != string::npos) {
+        source.port = atoi(addr.data() + port_pos + 1);
+        addr.resize(port_pos);
+    }
+
+    return inet_aton(addr.data(), &source.addr) != 0
+            && parse_limits(limits + 1, source.limits);
+}
+
+// parse "IP:PORT"
+static bool parse_peer(const char* text, sockaddr_in& addr) {
+    const char* port = strchr(text, ':');
+    if (port == nullptr) {
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port + 1));
+
+    return inet_aton(string(text, port - text).data(), &addr.sin_addr) != 0
+            && addr.sin_port != 0;
+}
+
+// parse the options after the port; returns false for invalid ones
+static bool parse_options(int argc, char* argv[], server_config& config) {
+    enum {
+        OPT_WEIGHTS = 1,
+        OPT_HUGEPAGES,
+        OPT_UDP_RATE,
+        OPT_UDP_SOURCE_RATE,
+        OPT_PROFILE,
+        OPT_SNAPSHOT,
+        OPT_RESUME_GRACE,
+        OPT_HEARTBEAT,
+        OPT_IDLE_TIMEOUT,
+        OPT_SHM_RING,
+        OPT_BUSY_POLL,
+        OPT_CPU,
+        OPT_CAPTURE,
+        OPT_COALESCE,
+        OPT_RETAIN,
+        OPT_COMPRESS,
+        OPT_BACKLOG,
+        OPT_ACCEPT_BUDGET,
+        OPT_DEFER_ACCEPT,
+        OPT_NODE,
+        OPT_PEER,
+        OPT_MULTICAST,
+        OPT_MULTICAST_IF
+    };
+
+    static const option long_options[] = {
+        {"weights", required_argument, nullptr, OPT_WEIGHTS},
+        {"hugepages", no_argument, nullptr, OPT_HUGEPAGES},
+        {"udp-rate", required_argument, nullptr, OPT_UDP_RATE},
+        {"udp-source-rate", required_argument, nullptr, OPT_UDP_SOURCE_RATE},
+        {"profile", optional_argument, nullptr, OPT_PROFILE},
+        {"snapshot", required_argument, nullptr, OPT_SNAPSHOT},
+        {"resume-grace", required_argument, nullptr, OPT_RESUME_GRACE},
+        {"heartbeat", required_argument, nullptr, OPT_HEARTBEAT},
+        {"idle-timeout", required_argument, nullptr, OPT_IDLE_TIMEOUT},
+        {"shm-ring", required_argument, nullptr, OPT_SHM_RING},
+        {"busy-poll", required_argument, nullptr, OPT_BUSY_POLL},
+        {"cpu", required_argument, nullptr, OPT_CPU},
+        {"capture", required_argument, nullptr, OPT_CAPTURE},
+        {"coalesce", required_argument, nullptr, OPT_COALESCE},
+        {"retain", required_argument, nullptr, OPT_RETAIN},
+        {"compress", required_argument, nullptr, OPT_COMPRESS},
+        {"backlog", required_argument, nullptr, OPT_BACKLOG},
+        {"accept-budget", required_argument, nullptr, OPT_ACCEPT_BUDGET},
+        {"defer-accept", required_argument, nullptr, OPT_DEFER_ACCEPT},
+        {"node", required_argument, nullptr, OPT_NODE},
+        {"peer", required_argument, nullptr, OPT_PEER},
+        {"multicast", required_argument, nullptr, OPT_MULTICAST},
+        {"multicast-if", required_argument, nullptr, OPT_MULTICAST_IF},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_WEIGHTS:
+                if (sscanf(optarg, "%d,%d,%d",
+                            &config.class_weights[PRIORITY_HIGH],
+                            &config.class_weights[PRIORITY_NORMAL],
+                            &config.class_weights[PRIORITY_LOW]) != 3) {
+                    return false;
+                }
+
+                for (int weight : config.class_weights) {
+                    if (weight <= 0) {
+                        return false;
+                    }
+                }
+
+                config.scheduling = connection::SCHEDULE_WEIGHTED;
+                break;
+            case OPT_HUGEPAGES:
+                config.hugepages = true;
+                break;
+            case OPT_UDP_RATE:
+                if (!parse_limits(optarg, config.udp_limits)) {
+                    return false;
+                }
+                break;
+            case OPT_UDP_SOURCE_RATE:
+                {
+                    server_config::udp_source source;
+                    if (!parse_source_limits(optarg, source)) {
+                        return false;
+                    }
+
+                    config.udp_sources.push_back(source);
+                }
+                break;
+            case OPT_PROFILE:
+                config.profile = optarg ? atoi(optarg) : 16;
+                if (config.profile <= 0) {
+                    return false;
+                }
+                break;
+            case OPT_SNAPSHOT:
+                config.snapshot_path = optarg;
+                break;
+            case OPT_RESUME_GRACE:
+                config.resume_grace = atoi(optarg);
+                if (config.resume_grace < 0) {
+                    return false;
+                }
+                break;
+            case OPT_HEARTBEAT:
+                config.heartbeat = atoi(optarg);
+                if (config.heartbeat <= 0) {
+                    return false;
+                }
+                break;
+            case OPT_IDLE_TIMEOUT:
+                config.idle_timeout = atoi(optarg);
+                if (config.idle_timeout <= 0) {
+                    return false;
+                }
+                break;
+            case OPT_SHM_RING:
+                {
+                    long size = atol(optarg);
+                    // the ring indexes need a power of two, and the ring
+                    // must hold the longest frame
+                    if (size < 0 || (size & (size - 1))
+                        || (size && size * 1024ul < shm_ring::record_size(MAX_DATA_FRAME_SIZE))) {
+                        return false;
+                    }
+
+                    config.shm_ring_size = size * 1024;
+                }
+                break;
+            case OPT_BUSY_POLL:
+                config.busy_poll = atoi(optarg);
+                if (config.busy_poll < 0) {
+                    return false;
+                }
+                break;
+            case OPT_CPU:
+                config.cpu = atoi(optarg);
+                if (config.cpu < 0) {
+                    return false;
+                }
+                break;
+            case OPT_CAPTURE:
+                config.capture_path = optarg;
+                break;
+            case OPT_COALESCE:
+                {
+                    long bytes = config.coalesce_bytes;
+                    if (sscanf(optarg, "%d,%ld", &config.coalesce, &bytes) < 1
+                        || config.coalesce < 0 || bytes <= 0) {
+                        return false;
+                    }
+
+                    config.coalesce_bytes = bytes;
+                }
+                break;
+            case OPT_RETAIN:
+                {
+                    long megabytes = config.retain_bytes >> 20;
+                    if (sscanf(optarg, "%d,%ld", &config.retain, &megabytes) < 1
+                        || config.retain <= 0 || megabytes <= 0) {
+                        return false;
+                    }
+
+                    config.retain_bytes = (size_t)megabytes << 20;
+                }
+                break;
+            case OPT_COMPRESS:
+                {
+                    long bytes = config.compress_min_batch;
+                    if (sscanf(optarg, "%d,%ld", &config.compress_level, &bytes) < 1
+                        || config.compress_level < 1 || config.compress_level > 9
+                        || bytes < 0) {
+                        return false;
+                    }
+
+                    config.compress_min_batch = bytes;
+                }
+                break;
+            case OPT_BACKLOG:
+                config.listen_backlog = atoi(optarg);
+                if (config.listen_backlog <= 0) {
+                    return false;
+                }
+                break;
+            case OPT_ACCEPT_BUDGET:
+                config.accept_budget = atoi(optarg);
+                if (config.accept_budget <= 0) {
+                    return false;
+                }
+                break;
+            case OPT_DEFER_ACCEPT:
+                config.defer_accept = atoi(optarg);
+                if (config.defer_accept < 0) {
+                    return false;
+                }
+                break;
+            case OPT_NODE:
+                config.node_name = optarg;
+                // the name is a word of the handshake
+                if (config.node_name.empty()
+                    || config.node_name.find_first_of(" \t") != string::npos) {
+                    return false;
+                }
+                break;
+            case OPT_PEER:
+                {
+                    sockaddr_in addr;
+                    if (!parse_peer(optarg, addr)) {
+                        return false;
+                    }
+
+                    config.peers.push_back(addr);
+                }
+                break;
+            case OPT_MULTICAST:
+                {
+                    string group = optarg;
+                    size_t min = group.find(',');
+                    if (min != string::npos) {
+                        config.multicast_min = atoi(group.data() + min + 1);
+                        group.resize(min);
+                    }
+
+                    if (!parse_peer(group.data(), config.multicast_group)
+                        || !IN_MULTICAST(ntohl(config.multicast_group.sin_addr.s_addr))
+                        || config.multicast_min < 1) {
+                        return false;
+                    }
+                }
+                break;
+            case OPT_MULTICAST_IF:
+                if (inet_aton(optarg, &config.multicast_if) == 0) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+
+    // the gaps of the group are filled from the retained messages
+    if (config.multicast_group.sin_port && config.retain == 0) {
+        return false;
+    }
+
+    return optind == argc;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        // Wrong call of server: it should be ./server <IP_PORT>
+    if (argc < 2) {
+        // Wrong call of server: it should be ./server <IP_PORT> [options]
+        usage(argv[0]);
+        return 1;
+    }
+
+    server_config config(atoi(argv[1]));
+
+    // the options follow the port
+    if (!parse_options(argc - 1, argv + 1, config)) {
+        usage(argv[0]);
         return 1;
     }
 
+    // allow as many connections as the system lets us
+    rlimit files;
+    DIE(getrlimit(RLIMIT_NOFILE, &files) == -1, "getrlimit failed");
+    files.rlim_cur = files.rlim_max;
+    DIE(setrlimit(RLIMIT_NOFILE, &files) == -1, "Raising the file limit failed");
+
+    // let cin keep its own buffer, so that in_avail() sees buffered commands;
+    // cout then has its own buffer too, which setvbuf does not reach
+    ios::sync_with_stdio(false);
+
     // unbuffer STDOUT
-    DIE(setvbuf(stdout, NULL, _IONBF, BUFSIZ), "Unbuffering STDOUT failed");
+    cout << unitbuf;
 
     try {
-        server* Server = new server(atoi(argv[1]));
+        server* Server = new server(config);
         Server->run();
         delete Server;
     } catch (exception& e) {
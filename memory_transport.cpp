@@ -0,0 +1,490 @@
+#include <errno.h>
+#include <string.h>
+
+#include "memory_transport.hpp"
+
+using namespace std;
+
+memory_transport::memory_transport(size_t buffer_size)
+    : buffer_size(buffer_size), empty_waits(0), unrouted_datagrams(0) {}
+
+memory_transport::~memory_transport() {
+    for (auto point : endpoints) {
+        delete point;
+    }
+}
+
+memory_transport::endpoint* memory_transport::find(int fd) const {
+    if (fd < FIRST_FD || fd - FIRST_FD >= (int)endpoints.size()
+        || endpoints[fd - FIRST_FD] == nullptr) {
+        errno = EBADF;
+        return nullptr;
+    }
+
+    return endpoints[fd - FIRST_FD];
+}
+
+int memory_transport::add(endpoint* point) {
+    endpoints.push_back(point);
+    return FIRST_FD + endpoints.size() - 1;
+}
+
+uint32_t memory_transport::ready_events(const endpoint& point) const {
+    switch (point.kind) {
+        case endpoint::STREAM:
+            {
+                uint32_t ready = 0;
+
+                if (point.read_pos < point.received.size()) {
+                    ready |= EPOLLIN;
+                }
+
+                if (point.connected && point.peer == -1) {
+                    // the other end is gone: EOF, and the sends fail
+                    ready |= EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+                } else if (point.connected) {
+                    const endpoint* peer = find(point.peer);
+                    if (peer->received.size() - peer->read_pos < buffer_size) {
+                        ready |= EPOLLOUT;
+                    }
+                }
+
+                return ready;
+            }
+        case endpoint::LISTENER:
+            return point.backlog.empty() ? 0 : (uint32_t)EPOLLIN;
+        case endpoint::DATAGRAM:
+            return (point.datagrams.empty() ? 0 : (uint32_t)EPOLLIN) | EPOLLOUT;
+        default:
+            return 0;
+    }
+}
+
+void memory_transport::notify(int fd) {
+    endpoint* point = find(fd);
+    if (point == nullptr || point->pollfd == -1 || point->queued) {
+        return;
+    }
+
+    endpoint* poller = find(point->pollfd);
+    if (poller == nullptr) {
+        return;
+    }
+
+    if (ready_events(*point) & (point->events | EPOLLERR | EPOLLHUP)) {
+        poller->ready.push_back(fd);
+        point->queued = true;
+    }
+}
+
+int memory_transport::socket(int type) {
+    endpoint* point = new endpoint();
+
+    switch (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) {
+        case SOCK_STREAM:
+            point->kind = endpoint::STREAM;
+            break;
+        case SOCK_DGRAM:
+            point->kind = endpoint::DATAGRAM;
+            break;
+        default:
+            delete point;
+            errno = EPROTONOSUPPORT;
+            return -1;
+    }
+
+    return add(point);
+}
+
+int memory_transport::bind(int fd, const sockaddr_in& addr) {
+    endpoint* point = find(fd);
+    if (point == nullptr) {
+        return -1;
+    }
+
+    point->port = ntohs(addr.sin_port);
+
+    if (point->kind == endpoint::DATAGRAM) {
+        if (datagram_ports.count(point->port)) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+
+        datagram_ports[point->port] = fd;
+    }
+
+    return 0;
+}
+
+int memory_transport::listen(int fd, int /* backlog */) {
+    endpoint* point = find(fd);
+    if (point == nullptr) {
+        return -1;
+    }
+
+    if (point->kind != endpoint::STREAM || listeners.count(point->port)) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    point->kind = endpoint::LISTENER;
+    listeners[point->port] = fd;
+    return 0;
+}
+
+int memory_transport::accept(int fd, sockaddr_in* addr) {
+    endpoint* point = find(fd);
+    if (point == nullptr) {
+        return -1;
+    }
+
+    if (point->kind != endpoint::LISTENER) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (point->backlog.empty()) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int accepted = point->backlog.front();
+    point->backlog.pop_front();
+
+    // every client looks like a different port of the loopback
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr->sin_port = htons(find(accepted)->peer & 0xffff);
+
+    return accepted;
+}
+
+int memory_transport::connect(int fd, const sockaddr_in& addr) {
+    endpoint* point = find(fd);
+    if (point == nullptr) {
+        return -1;
+    }
+
+    if (point->kind != endpoint::STREAM || point->connected) {
+        errno = EISCONN;
+        return -1;
+    }
+
+    auto listener = listeners.find(ntohs(addr.sin_port));
+    if (listener == listeners.end()) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    endpoint* accepted = new endpoint();
+    accepted->port = ntohs(addr.sin_port);
+    accepted->connected = true;
+    accepted->peer = fd;
+
+    int accepted_fd = add(accepted);
+    point->connected = true;
+    point->peer = accepted_fd;
+
+    find(listener->second)->backlog.push_back(accepted_fd);
+    notify(listener->second);
+    notify(fd);
+
+    return 0;
+}
+
+int memory_transport::close(int fd) {
+    endpoint* point = find(fd);
+    if (point == nullptr) {
+        return -1;
+    }
+
+    switch (point->kind) {
+        case endpoint::STREAM:
+            if (point->peer != -1) {
+                find(point->peer)->peer = -1;
+                notify(point->peer);
+            }
+            break;
+        case endpoint::LISTENER:
+            listeners.erase(point->port);
+            // refuse the connections that were not accepted
+            for (int waiting : point->backlog) {
+                close(waiting);
+            }
+            break;
+        case endpoint::DATAGRAM:
+            if (point->port && datagram_ports[point->port] == fd) {
+                datagram_ports.erase(point->port);
+            }
+            break;
+        default:
+            break;
+    }
+
+    // the ready lists skip the closed descriptors
+    delete point;
+    endpoints[fd - FIRST_FD] = nullptr;
+    return 0;
+}
+
+int memory_transport::set_option(int fd, int /* level */, int /* name */,
+                                    const void* /* value */, socklen_t /* size */) {
+    // nothing to tune
+    return find(fd) ? 0 : -1;
+}
+
+int memory_transport::get_option(int fd, int /* level */, int /* name */, void* /* value */,
+                                    socklen_t* /* size */) {
+    if (find(fd) == nullptr) {
+        return -1;
+    }
+
+    errno = ENOPROTOOPT;
+    return -1;
+}
+
+int memory_transport::set_nonblocking(int fd) {
+    // nothing ever blocks
+    return find(fd) ? 0 : -1;
+}
+
+ssize_t memory_transport::recv(int fd, void* buffer, size_t size) {
+    endpoint* point = find(fd);
+    if (point == nullptr) {
+        return -1;
+    }
+
+    if (point->kind != endpoint::STREAM || !point->connected) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    size_t available = point->received.size() - point->read_pos;
+    if (available == 0) {
+        if (point->peer == -1) {
+            // EOF
+            return 0;
+        }
+
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t read_size = min(size, available);
+    memcpy(buffer, point->received.data() + point->read_pos, read_size);
+    point->read_pos += read_size;
+
+    if (point->read_pos == point->received.size()) {
+        // keeps the capacity for the next sends
+        point->received.clear();
+        point->read_pos = 0;
+    }
+
+    if (point->peer != -1) {
+        // the other end may be able to send again
+        notify(point->peer);
+    }
+
+    return read_size;
+}
+
+ssize_t memory_transport::send(int fd, const void* data, size_t size, int /* flags */) {
+    endpoint* point = find(fd);
+    if (point == nullptr) {
+        return -1;
+    }
+
+    if (point->kind != endpoint::STREAM || !point->connected) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (point->peer == -1) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    endpoint* peer = find(point->peer);
+    size_t queued = peer->received.size() - peer->read_pos;
+    if (queued >= buffer_size) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (peer->read_pos > peer->received.size() / 2) {
+        // the reader is slow; drop what it read
+        peer->received.erase(0, peer->read_pos);
+        peer->read_pos = 0;
+    }
+
+    size_t sent = min(size, buffer_size - queued);
+    peer->received.append((const char*)data, sent);
+    notify(point->peer);
+
+    return sent;
+}
+
+ssize_t memory_transport::recv_from(int fd, void* buffer, size_t size, sockaddr_in* source) {
+    endpoint* point = find(fd);
+    if (point == nullptr) {
+        return -1;
+    }
+
+    if (point->kind != endpoint::DATAGRAM || point->datagrams.empty()) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // like the kernel, the rest of a longer datagram is lost
+    const string& datagram = point->datagrams.front();
+    size_t read_size = min(size, datagram.size());
+    memcpy(buffer, datagram.data(), read_size);
+    point->datagrams.pop_front();
+
+    if (source) {
+        memset(source, 0, sizeof(*source));
+        source->sin_family = AF_INET;
+        source->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+
+    return read_size;
+}
+
+ssize_t memory_transport::send_to(int fd, const iovec* parts, int count,
+                                    const sockaddr_in& destination) {
+    if (find(fd) == nullptr) {
+        return -1;
+    }
+
+    size_t size = 0;
+    for (int i = 0; i < count; i++) {
+        size += parts[i].iov_len;
+    }
+
+    auto target = datagram_ports.find(ntohs(destination.sin_port));
+    if (target == datagram_ports.end()) {
+        unrouted_datagrams++;
+        return size;
+    }
+
+    string datagram;
+    datagram.reserve(size);
+    for (int i = 0; i < count; i++) {
+        datagram.append((const char*)parts[i].iov_base, parts[i].iov_len);
+    }
+
+    find(target->second)->datagrams.push_back(move(datagram));
+    notify(target->second);
+
+    return size;
+}
+
+bool memory_transport::inject(uint16_t port, const char* data, size_t size) {
+    auto target = datagram_ports.find(port);
+    if (target == datagram_ports.end()) {
+        return false;
+    }
+
+    find(target->second)->datagrams.emplace_back(data, size);
+    notify(target->second);
+    return true;
+}
+
+int memory_transport::create_poller() {
+    endpoint* point = new endpoint();
+    point->kind = endpoint::POLLER;
+    return add(point);
+}
+
+int memory_transport::control(int pollfd, int op, int fd, epoll_event* event) {
+    if (find(pollfd) == nullptr) {
+        return -1;
+    }
+
+    endpoint* point = find(fd);
+    if (point == nullptr) {
+        // a descriptor of the process; never ready here
+        return fd >= 0 && fd < FIRST_FD ? 0 : -1;
+    }
+
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            if (point->pollfd != -1) {
+                errno = EEXIST;
+                return -1;
+            }
+            point->pollfd = pollfd;
+            break;
+        case EPOLL_CTL_MOD:
+        case EPOLL_CTL_DEL:
+            if (point->pollfd != pollfd) {
+                errno = ENOENT;
+                return -1;
+            }
+
+            if (op == EPOLL_CTL_DEL) {
+                // its entry in the ready list is skipped
+                point->pollfd = -1;
+                point->queued = false;
+                return 0;
+            }
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    point->events = event->events;
+    point->data = event->data;
+    notify(fd);
+    return 0;
+}
+
+int memory_transport::wait(int pollfd, epoll_event* events, int max_events,
+                            int /* timeout_ms */) {
+    endpoint* poller = find(pollfd);
+    if (poller == nullptr) {
+        return -1;
+    }
+
+    int count = 0;
+
+    // each entry is looked at once; those still ready go to the back
+    for (size_t entries = poller->ready.size(); entries > 0 && count < max_events; entries--) {
+        int fd = poller->ready.front();
+        poller->ready.pop_front();
+
+        endpoint* point = fd - FIRST_FD < (int)endpoints.size()
+                            ? endpoints[fd - FIRST_FD] : nullptr;
+        if (point == nullptr || point->pollfd != pollfd || !point->queued) {
+            // closed or no longer watched since it was queued
+            continue;
+        }
+
+        point->queued = false;
+        uint32_t ready = ready_events(*point) & (point->events | EPOLLERR | EPOLLHUP);
+        if (ready == 0) {
+            continue;
+        }
+
+        events[count].events = ready;
+        events[count].data = point->data;
+        count++;
+
+        // level triggered: reported again until it is handled
+        poller->ready.push_back(fd);
+        point->queued = true;
+    }
+
+    if (count == 0) {
+        empty_waits++;
+    }
+
+    return count;
+}
+
+int memory_transport::wait_ns(int pollfd, epoll_event* events, int max_events,
+                                uint64_t /* timeout_ns */) {
+    return wait(pollfd, events, max_events, 0);
+}
@@ -0,0 +1,123 @@
+#ifndef _MEMORY_TRANSPORT_HPP
+#define _MEMORY_TRANSPORT_HPP
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "transport.hpp"
+
+// sockets and epoll emulated in memory, for measuring the event loop
+// without the kernel (see bench_pipeline): a stream connects at once to
+// the listener bound to the same port (any address) and what it sends is
+// appended to the receive buffer of the other end; datagrams sent to a
+// port bound here are queued for its socket, the others are only counted.
+// Every call returns at once (the timeouts of wait() are ignored) and the
+// receive buffer of a stream takes at most buffer_size bytes, so the
+// senders still see EAGAIN and wait for EPOLLOUT. The readiness is level
+// triggered, as with epoll. Not thread safe.
+class memory_transport : public transport {
+public:
+    explicit memory_transport(size_t buffer_size = 4 * 1024 * 1024);
+    ~memory_transport();
+
+    int socket(int type) override;
+    int bind(int fd, const sockaddr_in& addr) override;
+    int listen(int fd, int backlog) override;
+    int accept(int fd, sockaddr_in* addr) override;
+    int connect(int fd, const sockaddr_in& addr) override;
+    int close(int fd) override;
+
+    int set_option(int fd, int level, int name, const void* value, socklen_t size) override;
+    int get_option(int fd, int level, int name, void* value, socklen_t* size) override;
+    int set_nonblocking(int fd) override;
+
+    ssize_t recv(int fd, void* buffer, size_t size) override;
+    ssize_t send(int fd, const void* data, size_t size, int flags) override;
+
+    ssize_t recv_from(int fd, void* buffer, size_t size, sockaddr_in* source) override;
+    ssize_t send_to(int fd, const iovec* parts, int count,
+                    const sockaddr_in& destination) override;
+
+    // the descriptors of the process (e.g. STDIN) may be watched as well;
+    // they are never reported
+    int create_poller() override;
+    int control(int pollfd, int op, int fd, epoll_event* event) override;
+    int wait(int pollfd, epoll_event* events, int max_events, int timeout_ms) override;
+    int wait_ns(int pollfd, epoll_event* events, int max_events, uint64_t timeout_ns) override;
+
+    // queue a datagram for the socket bound to the port, as if a publisher
+    // sent it; returns false if no socket is bound there
+    bool inject(uint16_t port, const char* data, size_t size);
+
+    // the calls to wait() that found nothing to report; the loop that made
+    // them has handled everything so far
+    uint64_t get_empty_waits() const { return empty_waits; }
+
+    // datagrams sent to ports that are not bound here (e.g. multicast)
+    uint64_t get_unrouted_datagrams() const { return unrouted_datagrams; }
+private:
+    // above the descriptors of the process, so that both can be watched
+    static constexpr int FIRST_FD = 1 << 20;
+
+    struct endpoint {
+        enum {
+            STREAM,
+            LISTENER,
+            DATAGRAM,
+            POLLER
+        } kind;
+
+        uint16_t port;
+
+        // stream: the other end (-1 before connect, and once it is closed)
+        int peer;
+        bool connected;
+        // stream: bytes received and not read yet, from read_pos
+        std::string received;
+        size_t read_pos;
+
+        // listener: the streams waiting to be accepted
+        std::deque<int> backlog;
+
+        // datagram socket: the datagrams waiting to be read
+        std::deque<std::string> datagrams;
+
+        // the poller watching it (-1 if none), and what it watches
+        int pollfd;
+        uint32_t events;
+        epoll_data_t data;
+        // set while it is in the ready list of the poller
+        bool queued;
+
+        // poller: the watched descriptors that may be ready
+        std::deque<int> ready;
+
+        endpoint() : kind(STREAM), port(0), peer(-1), connected(false), read_pos(0),
+                        pollfd(-1), events(0), data{}, queued(false) {}
+    };
+
+    size_t buffer_size;
+
+    // by fd - FIRST_FD; nullptr once closed (the descriptors are not reused)
+    std::vector<endpoint*> endpoints;
+
+    std::map<uint16_t, int> listeners;
+    std::map<uint16_t, int> datagram_ports;
+
+    uint64_t empty_waits;
+    uint64_t unrouted_datagrams;
+
+    // nullptr (and errno set to EBADF) if it is not one of ours
+    endpoint* find(int fd) const;
+    int add(endpoint* point);
+
+    // the events the endpoint would report to a poller watching everything
+    uint32_t ready_events(const endpoint& point) const;
+
+    // put the descriptor in the ready list of its poller if it is ready
+    void notify(int fd);
+};
+
+#endif  // _MEMORY_TRANSPORT_HPP
@@ -0,0 +1,278 @@
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "persistence.hpp"
+
+using namespace std;
+
+static const char SNAPSHOT_MAGIC[] = "TCPSNAP1";
+
+// little helpers for the binary records
+static void append_u16(string& out, uint16_t value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void append_u32(string& out, uint32_t value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void append_field(string& out, const string& field) {
+    uint16_t size = field.size() < UINT16_MAX ? field.size() : UINT16_MAX;
+    append_u16(out, size);
+    out.append(field.data(), size);
+}
+
+// reads fields from a mapped file, checking its bounds
+struct record_reader {
+    const char* iter;
+    const char* end;
+
+    template <typename T>
+    bool read(T& value) {
+        if (end - iter < (ptrdiff_t)sizeof(T)) {
+            return false;
+        }
+
+        memcpy(&value, iter, sizeof(T));
+        iter += sizeof(T);
+        return true;
+    }
+
+    bool read_field(string& field) {
+        uint16_t size;
+        if (!read(size) || end - iter < size) {
+            return false;
+        }
+
+        field.assign(iter, size);
+        iter += size;
+        return true;
+    }
+};
+
+subscription_store::subscription_store(const string& path)
+    : path(path), journal_path(path + ".journal"), journal_fd(-1) {}
+
+subscription_store::~subscription_store() {
+    flush();
+
+    if (journal_fd != -1) {
+        close(journal_fd);
+    }
+}
+
+void subscription_store::open_journal(bool truncate) {
+    if (journal_fd != -1) {
+        close(journal_fd);
+    }
+
+    journal_fd = open(journal_path.data(),
+                        O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0644);
+    DIE(journal_fd == -1, "Cannot open the subscriptions journal");
+}
+
+size_t subscription_store::load(topics_tree& topics) {
+    size_t loaded = load_snapshot(topics);
+
+    struct stat info;
+    bool has_journal = stat(journal_path.data(), &info) == 0 && info.st_size > 0;
+
+    if (has_journal) {
+        loaded += load_journal(topics);
+
+        // fold the journal into a new snapshot, so the next start is a bulk load
+        write_snapshot(topics);
+    } else {
+        open_journal(true);
+    }
+
+    return loaded;
+}
+
+size_t subscription_store::load_snapshot(topics_tree& topics) {
+    int fd = open(path.data(), O_RDONLY);
+    if (fd == -1) {
+        // no snapshot yet
+        return 0;
+    }
+
+    struct stat info;
+    DIE(fstat(fd, &info) == -1, "Cannot read the snapshot size");
+
+    if (info.st_size < (off_t)(sizeof(SNAPSHOT_MAGIC) - 1 + sizeof(uint64_t))) {
+        close(fd);
+        return 0;
+    }
+
+    const char* data = (const char*)mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    DIE(data == MAP_FAILED, "Cannot map the snapshot");
+    close(fd);
+
+    madvise((void*)data, info.st_size, MADV_SEQUENTIAL);
+
+    size_t loaded = 0;
+    record_reader reader{data, data + info.st_size};
+
+    if (memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1) == 0) {
+        reader.iter += sizeof(SNAPSHOT_MAGIC) - 1;
+
+        uint64_t patterns = 0;
+        reader.read(patterns);
+
+        string pattern, ID, options_text;
+        subscribers_map subscribers;
+
+        for (uint64_t i = 0; i < patterns; i++) {
+            uint32_t count;
+            if (!reader.read_field(pattern) || !reader.read(count)) {
+                break;
+            }
+
+            // the subscribers were written in order; append them at the end
+            subscribers.clear();
+            for (uint32_t j = 0; j < count; j++) {
+                subscription_options options;
+                if (!reader.read_field(ID) || !reader.read_field(options_text)) {
+                    break;
+                }
+
+                subscription_options::parse(options_text.data(), options);
+                subscribers.emplace_hint(subscribers.end(), ID, options);
+            }
+
+            topics.subscribe_many(pattern.data(), subscribers);
+            loaded += subscribers.size();
+        }
+    }
+
+    munmap((void*)data, info.st_size);
+    return loaded;
+}
+
+size_t subscription_store::load_journal(topics_tree& topics) {
+    int fd = open(journal_path.data(), O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+
+    struct stat info;
+    DIE(fstat(fd, &info) == -1, "Cannot read the journal size");
+
+    if (info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    const char* data = (const char*)mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    DIE(data == MAP_FAILED, "Cannot map the journal");
+    close(fd);
+
+    size_t loaded = 0;
+    record_reader reader{data, data + info.st_size};
+
+    string ID, pattern, options_text;
+    char change;
+
+    // a torn last record (crash while writing) is ignored
+    while (reader.read(change)
+            && reader.read_field(ID)
+            && reader.read_field(pattern)
+            && reader.read_field(options_text)) {
+
+        if (change == '+') {
+            subscription_options options;
+            subscription_options::parse(options_text.data(), options);
+            topics.subscribe(ID, pattern.data(), options);
+            loaded++;
+        } else {
+            topics.unsubscribe(ID, pattern.data());
+        }
+    }
+
+    munmap((void*)data, info.st_size);
+    return loaded;
+}
+
+void subscription_store::write_snapshot(const topics_tree& topics) {
+    constexpr size_t WRITE_CHUNK = 1024 * 1024;
+
+    string temporary_path = path + ".tmp";
+    int fd = open(temporary_path.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    DIE(fd == -1, "Cannot create the snapshot");
+
+    string buffer(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+    buffer.append(sizeof(uint64_t), '\0');  // the number of patterns, set at the end
+
+    uint64_t patterns = 0;
+
+    auto write_buffer = [fd, &buffer]() {
+        DIE(write(fd, buffer.data(), buffer.size()) != (ssize_t)buffer.size(),
+            "Cannot write the snapshot");
+        buffer.clear();
+    };
+
+    topics.for_each_pattern([&](const string& pattern, const subscribers_map& subscribers) {
+        append_field(buffer, pattern);
+        append_u32(buffer, subscribers.size());
+
+        for (auto& subscriber : subscribers) {
+            append_field(buffer, subscriber.first);
+            append_field(buffer, subscriber.second.to_string());
+        }
+
+        patterns++;
+        if (buffer.size() > WRITE_CHUNK) {
+            write_buffer();
+        }
+    });
+
+    write_buffer();
+
+    DIE(pwrite(fd, &patterns, sizeof(patterns), sizeof(SNAPSHOT_MAGIC) - 1) != sizeof(patterns),
+        "Cannot write the snapshot");
+    DIE(fdatasync(fd) == -1 || close(fd) == -1, "Cannot write the snapshot");
+    DIE(rename(temporary_path.data(), path.data()) == -1, "Cannot replace the snapshot");
+
+    // everything is in the snapshot now
+    journal_buffer.clear();
+    open_journal(true);
+}
+
+void subscription_store::record_subscribe(const string& ID, const string& topic,
+                                            const subscription_options& options) {
+    journal_buffer.push_back('+');
+    append_field(journal_buffer, ID);
+    append_field(journal_buffer, topic);
+    append_field(journal_buffer, options.to_string());
+
+    if (journal_buffer.size() > MAX_JOURNAL_BUFFER) {
+        flush();
+    }
+}
+
+void subscription_store::record_unsubscribe(const string& ID, const string& topic) {
+    journal_buffer.push_back('-');
+    append_field(journal_buffer, ID);
+    append_field(journal_buffer, topic);
+    append_field(journal_buffer, string());
+
+    if (journal_buffer.size() > MAX_JOURNAL_BUFFER) {
+        flush();
+    }
+}
+
+void subscription_store::flush() {
+    if (journal_buffer.empty() || journal_fd == -1) {
+        return;
+    }
+
+    DIE(write(journal_fd, journal_buffer.data(), journal_buffer.size())
+            != (ssize_t)journal_buffer.size(),
+        "Cannot write the subscriptions journal");
+    journal_buffer.clear();
+}
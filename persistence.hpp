@@ -0,0 +1,52 @@
+#ifndef _PERSISTENCE_HPP
+#define _PERSISTENCE_HPP
+
+#include <string>
+#include <stdint.h>
+
+#include "topics.hpp"
+
+// keeps the subscriptions of the server on disk: a snapshot of the whole
+// table (<path>) plus a journal of the changes made since (<path>.journal)
+//
+// snapshot: "TCPSNAP1", the number of patterns (u64), then for each pattern:
+//  u16 pattern size, pattern, u32 number of subscribers, and for each
+//  subscriber: u16 ID size, ID, u16 options size, options
+// journal: one record per change: '+' or '-', u16 ID size, ID, u16 pattern
+//  size, pattern, u16 options size, options
+class subscription_store {
+public:
+    explicit subscription_store(const std::string& path);
+    ~subscription_store();
+
+    // add the snapshot and the journal to the (empty) tree, then fold the
+    // journal into a new snapshot; returns the number of subscriptions loaded
+    size_t load(topics_tree& topics);
+
+    // replace the snapshot with the current content of the tree and empty
+    // the journal
+    void write_snapshot(const topics_tree& topics);
+
+    void record_subscribe(const std::string& ID, const std::string& topic,
+                            const subscription_options& options);
+    void record_unsubscribe(const std::string& ID, const std::string& topic);
+
+    // write the buffered journal records
+    void flush();
+private:
+    static constexpr size_t MAX_JOURNAL_BUFFER = 64 * 1024;
+
+    std::string path;
+    std::string journal_path;
+    int journal_fd;
+
+    std::string journal_buffer;
+
+    void open_journal(bool truncate);
+
+    // each returns the number of subscriptions read
+    size_t load_snapshot(topics_tree& topics);
+    size_t load_journal(topics_tree& topics);
+};
+
+#endif  // _PERSISTENCE_HPP
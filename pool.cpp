@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "pool.hpp"
+
+using namespace std;
+
+bool slab_pool::use_hugepages = false;
+
+slab_pool::slab_pool(const char* name, size_t object_size)
+    : name(name), slab_size(0), free_list(nullptr), slabs(0), in_use(0), peak(0) {
+
+    // every free object must hold the free list link; keep them aligned
+    if (object_size < sizeof(free_object)) {
+        object_size = sizeof(free_object);
+    }
+
+    this->object_size = (object_size + alignof(max_align_t) - 1)
+                            & ~(alignof(max_align_t) - 1);
+}
+
+void slab_pool::grow() {
+    void* slab = MAP_FAILED;
+    size_t size = SLAB_SIZE;
+
+    if (use_hugepages) {
+        size = HUGE_SLAB_SIZE;
+        slab = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+
+    if (slab == MAP_FAILED) {
+        // no huge pages available; use the normal ones
+        size = use_hugepages ? HUGE_SLAB_SIZE : SLAB_SIZE;
+        slab = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (slab == MAP_FAILED) {
+        throw bad_alloc();
+    }
+
+    slab_size = size;
+    slabs++;
+
+    // link the objects of the slab, keeping the address order
+    for (size_t index = size / object_size; index > 0; index--) {
+        free_object* link = (free_object*)((char*)slab + (index - 1) * object_size);
+        link->next = free_list;
+        free_list = link;
+    }
+}
+
+void* slab_pool::allocate() {
+    if (free_list == nullptr) {
+        grow();
+    }
+
+    free_object* object = free_list;
+    free_list = object->next;
+
+    if (++in_use > peak) {
+        peak = in_use;
+    }
+
+    return object;
+}
+
+void slab_pool::deallocate(void* object) {
+    if (object == nullptr) {
+        return;
+    }
+
+    free_object* link = (free_object*)object;
+    link->next = free_list;
+    free_list = link;
+    in_use--;
+}
+
+void slab_pool::print_stats(ostream& out) const {
+    out << name
+        << ": object " << object_size
+        << "B in use " << in_use
+        << " peak " << peak
+        << " reserved " << get_reserved() / 1024 << "KB";
+}
+
+slab_pool& buffer_pools::pool(int index) {
+    static const char* names[CLASSES] = {
+        "buffers-32", "buffers-64", "buffers-128", "buffers-256",
+        "buffers-512", "buffers-1024", "buffers-2048"
+    };
+
+    // built on first use, so that static objects can allocate as well;
+    // kept when the thread exits, its buffers may still be in use
+    static thread_local slab_pool* pools[CLASSES];
+    if (pools[index] == nullptr) {
+        pools[index] = new slab_pool(names[index], MIN_CLASS_SIZE << index);
+    }
+
+    return *pools[index];
+}
+
+void* buffer_pools::allocate(size_t size) {
+    if (size > MAX_CLASS_SIZE) {
+        return ::operator new(size);
+    }
+
+    return pool(class_of(size)).allocate();
+}
+
+void buffer_pools::deallocate(void* buffer, size_t size) {
+    if (size > MAX_CLASS_SIZE) {
+        ::operator delete(buffer);
+        return;
+    }
+
+    pool(class_of(size)).deallocate(buffer);
+}
+
+void buffer_pools::print_stats(ostream& out) {
+    for (int index = 0; index < CLASSES; index++) {
+        pool(index).print_stats(out);
+        out << endl;
+    }
+}
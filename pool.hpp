@@ -0,0 +1,107 @@
+#ifndef _POOL_HPP
+#define _POOL_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ostream>
+#include <new>
+
+// allocator of fixed size objects; the memory is taken from the system in
+// large slabs (mmap) and is never returned, freed objects are kept in a
+// free list and reused; not thread safe (see buffer_pools)
+class slab_pool {
+public:
+    // back the slabs with huge pages when the system allows it
+    static bool use_hugepages;
+
+    slab_pool(const char* name, size_t object_size);
+
+    void* allocate();
+    void deallocate(void* object);
+
+    const char* get_name() const { return name; }
+    size_t get_object_size() const { return object_size; }
+
+    // number of objects given and not freed yet
+    size_t get_in_use() const { return in_use; }
+    size_t get_peak() const { return peak; }
+
+    // memory taken from the system
+    size_t get_reserved() const { return slabs * slab_size; }
+
+    void print_stats(std::ostream& out) const;
+private:
+    static constexpr size_t SLAB_SIZE = 64 * 1024;
+    static constexpr size_t HUGE_SLAB_SIZE = 2 * 1024 * 1024;
+
+    struct free_object {
+        free_object* next;
+    };
+
+    const char* name;
+    size_t object_size;
+    size_t slab_size;
+
+    free_object* free_list;
+    size_t slabs;
+    size_t in_use;
+    size_t peak;
+
+    // add a new slab to the free list
+    void grow();
+};
+
+// size classed pools for variable sized buffers (message frames, queues);
+// requests bigger than the largest class are given to operator new. Each
+// thread has its own pools (no locking); a buffer freed by another thread
+// joins the pools of that thread
+class buffer_pools {
+public:
+    static void* allocate(size_t size);
+    static void deallocate(void* buffer, size_t size);
+
+    static void print_stats(std::ostream& out);
+private:
+    static constexpr int CLASSES = 7;
+    static constexpr size_t MIN_CLASS_SIZE = 32;
+    static constexpr size_t MAX_CLASS_SIZE = MIN_CLASS_SIZE << (CLASSES - 1);
+
+    // index of the smallest class that fits the size
+    static int class_of(size_t size) {
+        int index = 0;
+        while ((MIN_CLASS_SIZE << index) < size) {
+            index++;
+        }
+
+        return index;
+    }
+
+    static slab_pool& pool(int index);
+};
+
+// STL allocator over buffer_pools
+template <typename T>
+struct pool_allocator {
+    typedef T value_type;
+
+    pool_allocator() noexcept {}
+
+    template <typename U>
+    pool_allocator(const pool_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        return (T*)buffer_pools::allocate(n * sizeof(T));
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        buffer_pools::deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U>&) const noexcept { return true; }
+
+    template <typename U>
+    bool operator!=(const pool_allocator<U>&) const noexcept { return false; }
+};
+
+#endif  // _POOL_HPP
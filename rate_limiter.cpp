@@ -0,0 +1,155 @@
+#include "rate_limiter.hpp"
+
+using namespace std;
+
+rate_limiter::rate_limiter()
+    : default_limits{0, 0}, table(MIN_CAPACITY), used(0),
+        last_sweep(0), total_dropped(0) {
+
+    for (auto& entry : table) {
+        entry.key = 0;
+    }
+}
+
+void rate_limiter::set_default_limits(const limits& limits) {
+    default_limits = limits;
+}
+
+void rate_limiter::set_source_limits(in_addr addr, uint16_t port, const limits& limits) {
+    source_limits[make_key(addr, port)] = limits;
+}
+
+rate_limiter::limits rate_limiter::limits_of(const sockaddr_in& source) const {
+    if (!source_limits.empty()) {
+        auto specific = source_limits.find(make_key(source.sin_addr, ntohs(source.sin_port)));
+        if (specific != source_limits.end()) {
+            return specific->second;
+        }
+
+        // limits for every port of the address
+        specific = source_limits.find(make_key(source.sin_addr, 0));
+        if (specific != source_limits.end()) {
+            return specific->second;
+        }
+    }
+
+    return default_limits;
+}
+
+rate_limiter::bucket& rate_limiter::find_or_insert(uint64_t key, const sockaddr_in& source,
+                                                    uint64_t now) {
+    size_t mask = table.size() - 1;
+    size_t index = hash(key) & mask;
+
+    while (table[index].key != 0) {
+        if (table[index].key == key) {
+            return table[index];
+        }
+
+        index = (index + 1) & mask;
+    }
+
+    // new source; keep the load factor under 1/2
+    if ((used + 1) * 2 > table.size()) {
+        rebuild(now, table.size() * 2);
+        return find_or_insert(key, source, now);
+    }
+
+    limits source_limits = limits_of(source);
+
+    bucket& entry = table[index];
+    entry.key = key;
+    entry.rate = source_limits.rate;
+    entry.burst = source_limits.burst;
+    entry.tokens = source_limits.burst;
+    entry.last_update = now;
+    entry.accepted = 0;
+    entry.dropped = 0;
+    used++;
+
+    return entry;
+}
+
+void rate_limiter::rebuild(uint64_t now, size_t capacity) {
+    vector<bucket> old_table(capacity);
+    old_table.swap(table);
+
+    for (auto& entry : table) {
+        entry.key = 0;
+    }
+
+    used = 0;
+    size_t mask = table.size() - 1;
+
+    for (auto& entry : old_table) {
+        if (entry.key == 0 || now - entry.last_update > IDLE_TIMEOUT) {
+            continue;
+        }
+
+        size_t index = hash(entry.key) & mask;
+        while (table[index].key != 0) {
+            index = (index + 1) & mask;
+        }
+
+        table[index] = entry;
+        used++;
+    }
+
+    last_sweep = now;
+}
+
+bool rate_limiter::allow(const sockaddr_in& source, uint64_t now) {
+    if (now - last_sweep > IDLE_TIMEOUT) {
+        // age out the idle sources, shrinking the table if most are gone
+        size_t capacity = table.size();
+        while (capacity > MIN_CAPACITY && used * 8 < capacity) {
+            capacity /= 2;
+        }
+
+        rebuild(now, capacity);
+    }
+
+    bucket& entry = find_or_insert(make_key(source.sin_addr, ntohs(source.sin_port)),
+                                    source, now);
+
+    if (entry.rate <= 0) {
+        // this source is not limited
+        entry.last_update = now;
+        entry.accepted++;
+        return true;
+    }
+
+    // refill the bucket for the time passed since the last datagram
+    entry.tokens += (now - entry.last_update) * entry.rate / 1e9;
+    if (entry.tokens > entry.burst) {
+        entry.tokens = entry.burst;
+    }
+    entry.last_update = now;
+
+    if (entry.tokens < 1) {
+        entry.dropped++;
+        total_dropped++;
+        return false;
+    }
+
+    entry.tokens--;
+    entry.accepted++;
+    return true;
+}
+
+void rate_limiter::print_stats(ostream& out) const {
+    out << "UDP sources: " << used << " tracked, " << total_dropped << " datagrams dropped" << endl;
+
+    for (auto& entry : table) {
+        if (entry.key == 0 || entry.dropped == 0) {
+            continue;
+        }
+
+        in_addr addr;
+        addr.s_addr = htonl((uint32_t)(entry.key >> 17));
+
+        out << "  " << inet_ntoa(addr) << ":" << (entry.key & 0x1ffff) - 1
+            << " accepted " << entry.accepted
+            << " dropped " << entry.dropped << endl;
+    }
+}
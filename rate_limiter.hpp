@@ -0,0 +1,84 @@
+#ifndef _RATE_LIMITER_HPP
+#define _RATE_LIMITER_HPP
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <ostream>
+
+#include <arpa/inet.h>
+
+// token buckets for every UDP source (address:port); a source may send
+// `burst` datagrams at once and `rate` datagrams per second on average
+class rate_limiter {
+public:
+    struct limits {
+        double rate;
+        double burst;
+    };
+
+    // sources that are quiet for this long are forgotten
+    static constexpr uint64_t IDLE_TIMEOUT = 60 * 1000000000ull;
+
+    rate_limiter();
+
+    // a rate of 0 disables the limiter (the default)
+    void set_default_limits(const limits& default_limits);
+
+    // specific limits for an address; port 0 means any port of the address
+    void set_source_limits(in_addr addr, uint16_t port, const limits& source_limits);
+
+    bool enabled() const { return default_limits.rate > 0 || !source_limits.empty(); }
+
+    // consume a token of the source; returns false if the datagram must be dropped
+    bool allow(const sockaddr_in& source, uint64_t now);
+
+    uint64_t get_dropped() const { return total_dropped; }
+
+    // print the tracked sources that had datagrams dropped
+    void print_stats(std::ostream& out) const;
+private:
+    static constexpr size_t MIN_CAPACITY = 64;
+
+    struct bucket {
+        uint64_t key;           // 0 for a free slot
+        double tokens;
+        double rate;
+        double burst;
+        uint64_t last_update;
+        uint64_t accepted;
+        uint64_t dropped;
+    };
+
+    limits default_limits;
+    std::map<uint64_t, limits> source_limits;
+
+    // open addressing table, linear probing
+    std::vector<bucket> table;
+    size_t used;
+
+    uint64_t last_sweep;
+    uint64_t total_dropped;
+
+    static uint64_t make_key(in_addr addr, uint16_t port) {
+        // the port is stored + 1 so that no real source has the key 0
+        return ((uint64_t)ntohl(addr.s_addr) << 17) | ((uint64_t)port + 1);
+    }
+
+    static size_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        return key;
+    }
+
+    bucket& find_or_insert(uint64_t key, const sockaddr_in& source, uint64_t now);
+
+    // rebuild the table without the idle sources, growing it if needed
+    void rebuild(uint64_t now, size_t capacity);
+
+    // limits of a new source
+    limits limits_of(const sockaddr_in& source) const;
+};
+
+#endif  // _RATE_LIMITER_HPP
@@ -0,0 +1,521 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/unistd.h>
+
+#include "utils.h"
+#include "filter.hpp"
+#include "relay.hpp"
+
+using namespace std;
+
+relay::relay(const relay_config& config)
+    : config(config), upstream(nullptr), reconnect_time(0), closed(false),
+        upstream_messages(0), delivered_frames(0), filtered_messages(0),
+        conflated_messages(0), message_sequence(0) {
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    DIE(listenfd == -1, "Cannot create TCP listener");
+
+    int sockopt = 1;
+    DIE(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt)) == -1,
+        "Cannot make the socket reuse the given address");
+
+    // inherited by the accepted sockets
+    DIE(setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &sockopt, sizeof(sockopt)) == -1,
+        "disable of Naggle's algorithm failed");
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    DIE(bind(listenfd, (const sockaddr *) &addr, sizeof(addr)) < 0, "Cannot realise bind");
+    DIE(listen(listenfd, SOMAXCONN) < 0, "Cannot listen for TCP connections");
+
+    loop.watch_fd(listenfd, [this]() { add_connections(); });
+
+    loop.watch_fd(STDIN_FILENO, [this]() {
+        // several commands may already be buffered by cin
+        do {
+            string command;
+            if (!getline(cin, command)) {
+                // no more input; stop monitoring it
+                DIE(epoll_ctl(loop.get_epollfd(), EPOLL_CTL_DEL, STDIN_FILENO, NULL) == -1,
+                    "Removing STDIN from epoll failed");
+                break;
+            }
+
+            manage_command(command);
+        } while (cin.rdbuf()->in_avail() > 0);
+    });
+
+    connect_upstream();
+}
+
+relay::~relay() {
+    for (auto conn : connections) {
+        delete conn;
+    }
+
+    for (auto conn : removed) {
+        delete conn;
+    }
+
+    delete upstream;
+
+    if (listenfd != -1) {
+        DIE(close(listenfd) == -1, "Cannot close the TCP listener");
+    }
+}
+
+void relay::run() {
+    while (true) {
+        int timeout = -1;
+        if (upstream == nullptr && !closed) {
+            uint64_t now = now_ns();
+            timeout = reconnect_time > now ? (reconnect_time - now) / 1000000 + 1 : 0;
+        }
+
+        loop.poll(timeout);
+        flush();
+
+        for (auto conn : removed) {
+            delete conn;
+        }
+        removed.clear();
+
+        if (upstream && !upstream->is_open()) {
+            // the loop has released its connection already
+            delete upstream;
+            upstream = nullptr;
+
+            if (!closed) {
+                cout << "Lost the server; connecting again." << endl;
+                reconnect_time = now_ns() + RECONNECT_DELAY;
+            }
+        }
+
+        if (closed) {
+            if (connections.empty() && upstream == nullptr) {
+                return;
+            }
+        } else if (upstream == nullptr && now_ns() >= reconnect_time) {
+            connect_upstream();
+        }
+    }
+}
+
+void relay::connect_upstream() {
+    upstream = new subscriber(loop, config.ID);
+    upstream->set_topic_aliases(config.upstream_aliases);
+    if (config.upstream_compression) {
+        upstream->set_compression(deflate_codec::NAME);
+    }
+
+    upstream->on_message([this](const message_view& message) {
+        manage_message(message);
+    });
+
+    upstream->on_connect([this](bool accepted) {
+        if (accepted) {
+            cout << "Connected to the server as " << config.ID << "." << endl;
+        } else {
+            cout << "The server refused the ID " << config.ID << "." << endl;
+        }
+    });
+
+    if (!upstream->connect(config.upstream)) {
+        delete upstream;
+        upstream = nullptr;
+        reconnect_time = now_ns() + RECONNECT_DELAY;
+        return;
+    }
+
+    // what the local subscribers want, in (at most) two batches
+    vector<string> patterns[2];
+    for (auto& pattern : upstream_patterns) {
+        patterns[pattern.second].push_back(pattern.first);
+    }
+
+    if (!patterns[false].empty()) {
+        upstream->subscribe(patterns[false]);
+    }
+    if (!patterns[true].empty()) {
+        upstream->subscribe(patterns[true], "ts");
+    }
+}
+
+void relay::manage_message(const message_view& message) {
+    upstream_messages++;
+
+    string topic(message.topic);
+    subscribers_map* IDs = topics.get_subscribers(topic.data());
+
+    string info_message(1, (char)INFO);
+    info_message.append(message.text.data(), message.text.size());
+
+    // the payload, for the filters
+    typed_payload payload;
+    payload.type = message.type;
+    payload.number = 0;
+    if (message.type == PAYLOAD_STRING) {
+        payload.text = message.value;
+    } else if (message.type != PAYLOAD_UNKNOWN) {
+        payload.number = message.as_float();
+    }
+
+    message_sequence++;
+
+    // the time the server received the datagram, if it was asked for
+    uint64_t recv_time = message.server_recv_time ? message.server_recv_time : realtime_ns();
+
+    // frames with timestamps, built only if some subscriber wants them
+    string timed_message[2];
+
+    for (auto& ID : *IDs) {
+        auto client = clients.find(ID.first);
+        if (client == clients.end()) {
+            continue;
+        }
+
+        const subscription_options& options = ID.second;
+        if (options.filter && !options.filter->matches(payload, message_sequence)) {
+            filtered_messages++;
+            continue;
+        }
+
+        if (options.timestamps == subscription_options::TIMESTAMPS_NONE) {
+            deliver(client->second, info_message, topic, options, -1);
+        } else {
+            bool with_send_time = options.timestamps == subscription_options::TIMESTAMPS_RECV_SEND;
+            string& timed = timed_message[with_send_time];
+
+            if (timed.empty()) {
+                timed = make_timed_info(info_message, recv_time, with_send_time);
+            }
+
+            deliver(client->second, timed, topic, options,
+                    with_send_time ? SEND_STAMP_OFFSET : -1);
+        }
+    }
+    delete IDs;
+}
+
+void relay::deliver(connection* conn, const string& frame, const string& topic,
+                    const subscription_options& options, int stamp_offset) {
+    if (conn->state != connection::STATE_ACTIVE) {
+        return;
+    }
+
+    if (options.conflate) {
+        if (conn->queue_conflated_message(topic, frame, options.priority, stamp_offset,
+                                            topic.size())) {
+            // the old frame was waiting for the socket; so does the new one
+            conflated_messages++;
+            return;
+        }
+    } else {
+        conn->queue_send_message(frame, options.priority, stamp_offset, topic.size());
+    }
+
+    delivered_frames++;
+
+    if (conn->unflushed_bytes == 0) {
+        unflushed.push_back(conn);
+    }
+    conn->unflushed_bytes += frame.size() + 1;
+}
+
+void relay::flush() {
+    // the frames of every message received in the dispatch leave together
+    vector<connection*> pending;
+    pending.swap(unflushed);
+
+    for (auto conn : pending) {
+        conn->unflushed_bytes = 0;
+        conn->send_messages();
+
+        if (conn->state == connection::STATE_CONNECTION_BROKEN
+            || conn->state == connection::STATE_DISCONNECTED) {
+            remove_connection(conn);
+        }
+    }
+}
+
+void relay::add_connections() {
+    while (true) {
+        sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+
+        int connectionfd = accept4(listenfd, (sockaddr *) &addr, &len, SOCK_NONBLOCK);
+        if (connectionfd == -1) {
+            if (errno == EAGAIN) {
+                return;
+            }
+
+            // the connection was aborted before being accepted
+            DIE(errno != ECONNABORTED && errno != EPROTO && errno != EINTR, "accept failed");
+            continue;
+        }
+
+        connection* conn = new connection(loop.get_epollfd(), connectionfd, addr, true);
+        connections.insert(conn);
+        loop.watch_connection(conn, [this, conn](const epoll_event& event) {
+            manage_connection(conn, event);
+        });
+    }
+}
+
+void relay::manage_connection(connection* conn, const epoll_event& event) {
+    if (event.events & EPOLLIN) {
+        conn->recv_message();
+
+        if (conn->state == connection::STATE_CONNECTION_BROKEN) {
+            // Connection closed unexpectedly
+            remove_connection(conn);
+            return;
+        }
+
+        while (!conn->recv_messages.empty()) {
+            string request = conn->recv_messages.front();
+            conn->recv_messages.pop();
+
+            if (!manage_request(conn, request)) {
+                remove_connection(conn);
+                return;
+            }
+        }
+    }
+
+    if (event.events & EPOLLOUT) {
+        conn->send_messages();
+
+        if (conn->state == connection::STATE_CONNECTION_BROKEN
+            || conn->state == connection::STATE_DISCONNECTED) {
+            remove_connection(conn);
+        }
+    }
+}
+
+bool relay::manage_request(connection* conn, const string& request) {
+    if (request.empty()) {
+        return true;
+    }
+
+    if (conn->state == connection::STATE_CONNECTING) {
+        if (request[0] == ID) {
+            return add_client(conn, string(request.data() + 1));
+        } else {
+            // Client did not send its ID as a first message; close this connection
+            return false;
+        }
+    }
+
+    if (conn->state != connection::STATE_ACTIVE) {
+        // refused or leaving
+        return true;
+    }
+
+    switch (request[0]) {
+        case SUBSCRIBE:
+            {
+                string topic;
+                subscription_options options;
+
+                if (subscription_options::parse_request(request.data() + 1, topic, options)) {
+                    topics.subscribe(conn->ID, topic.data(), options);
+                    client_patterns[conn->ID].insert(topic);
+                    request_upstream(topic,
+                        options.timestamps != subscription_options::TIMESTAMPS_NONE);
+
+                    conn->push_send_message(string((char)SUBSCRIBE + string("0") + topic));
+                } else {
+                    conn->push_send_message(string((char)SUBSCRIBE + string("1") + topic));
+                }
+            }
+            break;
+        case UNSUBSCRIBE:
+            {
+                string topic(request, 1);
+
+                if (topics.unsubscribe(conn->ID, topic.data())) {
+                    release_upstream(topic);
+                }
+                client_patterns[conn->ID].erase(topic);
+
+                conn->push_send_message(string((char)UNSUBSCRIBE + string("0") + topic));
+            }
+            break;
+        case HEARTBEAT:
+            // the relay does not check its clients
+            break;
+        case EXIT:
+            return false;
+        default:
+            // Wrong request type
+            break;
+    }
+
+    return conn->state != connection::STATE_CONNECTION_BROKEN;
+}
+
+bool relay::add_client(connection* conn, const string& handshake) {
+    // parse "<ID>[ <option>]..."; of the options, only the aliases are
+    // offered (the clients go on without the others)
+    istringstream handshake_stream(handshake);
+    string ID, option;
+    bool wants_aliases = false;
+
+    handshake_stream >> ID;
+    while (handshake_stream >> option) {
+        if (option == "alias") {
+            wants_aliases = true;
+        }
+    }
+
+    if (ID.empty() || clients.count(ID)) {
+        // closed once the answer is sent
+        conn->state = connection::STATE_INVALID;
+        conn->push_send_message(string((char)message_info::ID + string("NO")));
+
+        return conn->state != connection::STATE_DISCONNECTED
+                && conn->state != connection::STATE_CONNECTION_BROKEN;
+    }
+
+    conn->ID = ID;
+    conn->state = connection::STATE_ACTIVE;
+    clients[ID] = conn;
+
+    string response = string((char)message_info::ID + string("OK"));
+    if (wants_aliases) {
+        conn->enable_topic_aliases();
+        response += " alias";
+    }
+
+    cout << "New client " << ID << " connected from " << inet_ntoa(conn->addr.sin_addr)
+        << ":" << ntohs(conn->addr.sin_port) << "." << endl;
+
+    conn->push_send_message(response);
+    return conn->state != connection::STATE_CONNECTION_BROKEN;
+}
+
+void relay::request_upstream(const string& pattern, bool timestamps) {
+    auto asked = upstream_patterns.find(pattern);
+    if (asked != upstream_patterns.end() && (asked->second || !timestamps)) {
+        return;
+    }
+
+    // a pattern asked without timestamps is asked again with them (the
+    // server replaces the options); it keeps them until nobody wants it
+    upstream_patterns[pattern] = timestamps;
+
+    // otherwise, it is asked when the session starts again
+    if (upstream && upstream->is_open()) {
+        upstream->subscribe(pattern, timestamps ? "ts" : "");
+    }
+}
+
+void relay::release_upstream(const string& pattern) {
+    upstream_patterns.erase(pattern);
+
+    if (upstream && upstream->is_open()) {
+        upstream->unsubscribe(pattern);
+    }
+}
+
+void relay::remove_connection(connection* conn) {
+    if (connections.erase(conn) == 0) {
+        return;
+    }
+
+    loop.unwatch_connection(conn);
+
+    if (conn->unflushed_bytes) {
+        unflushed.erase(find(unflushed.begin(), unflushed.end(), conn));
+    }
+
+    auto client = clients.find(conn->ID);
+    if (client != clients.end() && client->second == conn) {
+        for (auto& pattern : client_patterns[conn->ID]) {
+            if (topics.unsubscribe(conn->ID, pattern.data())) {
+                release_upstream(pattern);
+            }
+        }
+
+        client_patterns.erase(conn->ID);
+        clients.erase(client);
+
+        cout << "Client " << conn->ID << " disconnected." << endl;
+    }
+
+    // later events of this dispatch may still point to it
+    removed.push_back(conn);
+}
+
+void relay::manage_command(const string& command) {
+    if (command == "exit") {
+        shutdown();
+    } else if (command == "stats") {
+        print_stats();
+    }
+}
+
+void relay::print_stats() {
+    size_t subscriptions = 0;
+    for (auto& patterns : client_patterns) {
+        subscriptions += patterns.second.size();
+    }
+
+    cout << "Server: " << (upstream && upstream->is_open() ? "connected" : "disconnected")
+        << endl;
+    cout << "Clients: " << clients.size() << endl;
+    cout << "Patterns subscribed upstream: " << upstream_patterns.size() << " (for "
+        << subscriptions << " local subscriptions)" << endl;
+
+    cout << "Messages from the server: " << upstream_messages
+        << ", frames queued for the clients: " << delivered_frames;
+    if (upstream_messages) {
+        cout << " (" << fixed << setprecision(3) << (double)delivered_frames / upstream_messages
+            << " per message)" << defaultfloat;
+    }
+    cout << endl;
+
+    cout << "Messages dropped by filters: " << filtered_messages << endl;
+    cout << "Messages replaced by newer ones (conflation): " << conflated_messages << endl;
+}
+
+void relay::shutdown() {
+    if (closed) {
+        return;
+    }
+    closed = true;
+
+    // no new clients
+    DIE(epoll_ctl(loop.get_epollfd(), EPOLL_CTL_DEL, listenfd, NULL) == -1,
+        "Removing the TCP listener from epoll failed");
+    DIE(close(listenfd) == -1, "Cannot close the TCP listener");
+    listenfd = -1;
+
+    if (upstream) {
+        upstream->close();
+    }
+
+    vector<connection*> current(connections.begin(), connections.end());
+    for (auto conn : current) {
+        // removed once EXIT is sent
+        conn->state = connection::STATE_INVALID;
+        conn->push_send_message(string(1, (char)EXIT), PRIORITY_LOW);
+
+        if (conn->state == connection::STATE_CONNECTION_BROKEN
+            || conn->state == connection::STATE_DISCONNECTED) {
+            remove_connection(conn);
+        }
+    }
+}
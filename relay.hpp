@@ -0,0 +1,114 @@
+#ifndef _RELAY_HPP
+#define _RELAY_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "connection.hpp"
+#include "subscriber.hpp"
+#include "topics.hpp"
+
+// settings of the relay, given in the command line
+struct relay_config {
+    // port of the local subscribers
+    uint16_t port;
+
+    // the server, and the ID of the relay's session to it
+    sockaddr_in upstream;
+    std::string ID;
+
+    // ask the server for topic aliases and compression on the upstream
+    // session
+    bool upstream_aliases;
+    bool upstream_compression;
+
+    relay_config() : port(0), upstream_aliases(false), upstream_compression(false) {}
+};
+
+// a subscriber host's single session to the server: the local processes
+// connect to the relay as they would to the server, the relay subscribes
+// upstream to the union of their patterns (each pattern once) and hands
+// every message it receives to the local subscribers it matches, with
+// their own subscription options (filters, priorities, timestamps,
+// conflation) applied here
+class relay {
+public:
+    relay(const relay_config& config);
+    ~relay();
+
+    void run();
+private:
+    // how long the relay waits before connecting again to the server
+    static constexpr uint64_t RECONNECT_DELAY = 1000000000;
+
+    subscriber_loop loop;
+    relay_config config;
+
+    // the session to the server (nullptr while it is down)
+    subscriber* upstream;
+    // when to connect again (0 while connected)
+    uint64_t reconnect_time;
+
+    // the patterns asked upstream, and whether they were asked with
+    // timestamps (some local subscriber wanted them)
+    std::map<std::string, bool> upstream_patterns;
+
+    int listenfd;
+    bool closed;
+
+    // the local subscribers, by ID once their handshake is done
+    std::set<connection*> connections;
+    std::map<std::string, connection*> clients;
+    topics_tree topics;
+    // the patterns of every client, unsubscribed when it leaves
+    std::map<std::string, std::set<std::string>> client_patterns;
+
+    // connections with frames queued since the last flush, and those
+    // removed during the current dispatch (deleted after it)
+    std::vector<connection*> unflushed;
+    std::vector<connection*> removed;
+
+    // statistics
+    uint64_t upstream_messages;
+    uint64_t delivered_frames;
+    uint64_t filtered_messages;
+    uint64_t conflated_messages;
+    uint64_t message_sequence;
+
+    void connect_upstream();
+
+    // a message from the server, for the local subscribers
+    void manage_message(const message_view& message);
+
+    void add_connections();
+    void manage_connection(connection* conn, const epoll_event& event);
+
+    // returns false if the connection should be removed
+    bool manage_request(connection* conn, const std::string& request);
+    bool add_client(connection* conn, const std::string& handshake);
+
+    // the first local subscriber of a pattern subscribes the relay to it
+    void request_upstream(const std::string& pattern, bool timestamps);
+    void release_upstream(const std::string& pattern);
+
+    // queue a frame for a local subscriber; it is sent by flush()
+    void deliver(connection* conn, const std::string& frame, const std::string& topic,
+                    const subscription_options& options, int stamp_offset);
+
+    // send the frames queued during the last dispatch
+    void flush();
+
+    void remove_connection(connection* conn);
+
+    void manage_command(const std::string& command);
+    void print_stats();
+
+    // sends EXIT to the local subscribers and closes the upstream session
+    void shutdown();
+};
+
+#endif  // _RELAY_HPP
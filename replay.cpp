@@ -0,0 +1,139 @@
+// Sends the datagrams of a capture (server --capture=FILE) to a server,
+// at the original pacing, at a scaled speed or as fast as possible. Every
+// source of the capture gets its own socket, so the per-source limits of
+// the server see the same publishers.
+//
+// usage: ./replay <FILE> <IP_SERVER> <PORT_SERVER> [--speed=X | --max] [--loop=N]
+#include <iostream>
+#include <string>
+#include <map>
+#include <string.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+#include "histogram.hpp"
+#include "capture.hpp"
+
+using namespace std;
+
+// wait until the given time (now_ns clock): sleep while it is far away,
+// then spin, so that the datagrams leave close to their time
+static void wait_until(uint64_t target) {
+    constexpr uint64_t SPIN = 100000;
+
+    uint64_t now = now_ns();
+    if (now + SPIN < target) {
+        uint64_t sleep = target - now - SPIN;
+        timespec pause = {(time_t)(sleep / 1000000000), (long)(sleep % 1000000000)};
+        nanosleep(&pause, nullptr);
+    }
+
+    while (now_ns() < target) {
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "usage: " << argv[0] << " <FILE> <IP_SERVER> <PORT_SERVER>"
+            << " [--speed=X | --max] [--loop=N]\n";
+        return 1;
+    }
+
+    double speed = 1;
+    bool as_fast_as_possible = false;
+    int loops = 1;
+
+    for (int i = 4; i < argc; i++) {
+        if (strncmp(argv[i], "--speed=", sizeof("--speed=") - 1) == 0) {
+            speed = atof(argv[i] + sizeof("--speed=") - 1);
+            DIE(speed <= 0, "The speed must be positive");
+        } else if (strcmp(argv[i], "--max") == 0) {
+            as_fast_as_possible = true;
+        } else if (strncmp(argv[i], "--loop=", sizeof("--loop=") - 1) == 0) {
+            loops = atoi(argv[i] + sizeof("--loop=") - 1);
+        } else {
+            cerr << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[3]));
+    DIE(inet_aton(argv[2], &server_addr.sin_addr) == 0, "Invalid server address");
+
+    capture_reader reader(argv[1]);
+
+    // one socket for each captured source (address:port)
+    map<uint64_t, int> sockets;
+
+    // how late the datagrams left, compared to their (scaled) time
+    latency_histogram lateness;
+    uint64_t datagrams = 0;
+    uint64_t bytes = 0;
+
+    uint64_t start = now_ns();
+    uint64_t loop_start = start;
+
+    for (int loop = 0; loop < loops; loop++) {
+        reader.rewind();
+
+        captured_datagram datagram;
+        uint64_t first_time = 0;
+        uint64_t last_target = loop_start;
+        bool first = true;
+
+        while (reader.next(datagram)) {
+            if (first) {
+                first_time = datagram.time;
+                first = false;
+            }
+
+            uint64_t key = (uint64_t)datagram.source.sin_addr.s_addr << 16 | datagram.source.sin_port;
+            auto socket_iter = sockets.find(key);
+            if (socket_iter == sockets.end()) {
+                int fd = socket(AF_INET, SOCK_DGRAM, 0);
+                DIE(fd == -1, "Cannot create a UDP socket");
+                socket_iter = sockets.emplace(key, fd).first;
+            }
+
+            if (!as_fast_as_possible) {
+                last_target = loop_start + (uint64_t)((datagram.time - first_time) / speed);
+                wait_until(last_target);
+                lateness.add(now_ns() - last_target);
+            }
+
+            // the server may drop some of them (full socket buffer); we do
+            // not retry, as the original publishers would not have either
+            sendto(socket_iter->second, datagram.data, datagram.size, 0,
+                    (const sockaddr*) &server_addr, sizeof(server_addr));
+
+            datagrams++;
+            bytes += datagram.size;
+        }
+
+        loop_start = as_fast_as_possible ? now_ns() : last_target;
+    }
+
+    uint64_t elapsed = now_ns() - start;
+
+    cout << "datagrams: " << datagrams << " (" << bytes << " bytes) from "
+        << sockets.size() << " sources in " << elapsed / 1000000 << "ms, "
+        << (elapsed ? datagrams * 1000000000 / elapsed : 0) << " datagrams/s" << endl;
+
+    if (!as_fast_as_possible) {
+        cout << "lateness: ";
+        lateness.print(cout);
+        cout << endl;
+    }
+
+    for (auto& source : sockets) {
+        close(source.second);
+    }
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include <string.h>
+
+#include "retained.hpp"
+
+using namespace std;
+
+typed_payload retained_store::message::payload() const {
+    typed_payload result;
+    result.type = type;
+    result.number = number;
+
+    if (type == PAYLOAD_STRING) {
+        result.text = string_view(frame.data() + text_offset, frame.size() - text_offset);
+    }
+
+    return result;
+}
+
+retained_store::retained_store(size_t history, size_t max_bytes)
+    : history(history), max_bytes(max_bytes), bytes(0), evicted(0) {}
+
+void retained_store::retain(const string& topic, const string& info_frame,
+                            const typed_payload& payload, uint64_t recv_time,
+                            uint64_t sequence) {
+    auto inserted = entries.emplace(topic, entry());
+    entry& retained = inserted.first->second;
+
+    if (inserted.second) {
+        retained.next = 0;
+        retained.ring.reserve(history);
+        retained.lru = lru.insert(lru.end(), inserted.first);
+        bytes += topic.size() + TOPIC_OVERHEAD;
+    } else {
+        lru.splice(lru.end(), lru, retained.lru);
+    }
+
+    if (retained.ring.size() < history) {
+        retained.ring.emplace_back();
+    } else {
+        bytes -= cost(retained.ring[retained.next]);
+    }
+
+    // an overwritten slot keeps its buffer when the new frame fits in it
+    message& slot = retained.ring[retained.next];
+    slot.frame.assign(info_frame.data(), info_frame.size());
+    slot.recv_time = recv_time;
+    slot.sequence = sequence;
+    slot.type = payload.type;
+    slot.number = payload.number;
+    // the value of a STRING is the end of the frame
+    slot.text_offset = payload.type == PAYLOAD_STRING
+                        ? info_frame.size() - payload.text.size() : 0;
+
+    bytes += cost(slot);
+    retained.next = (retained.next + 1) % history;
+
+    if (bytes > max_bytes) {
+        evict();
+    }
+}
+
+void retained_store::evict() {
+    // the topic just updated stays
+    while (bytes > max_bytes && lru.size() > 1) {
+        auto oldest = lru.front();
+
+        bytes -= oldest->first.size() + TOPIC_OVERHEAD;
+        for (auto& retained : oldest->second.ring) {
+            bytes -= cost(retained);
+        }
+
+        lru.pop_front();
+        entries.erase(oldest);
+        evicted++;
+    }
+}
+
+void retained_store::visit(const string& topic, const entry& retained,
+                            const message_visitor& visitor) const {
+    // once the ring is full, the oldest message is the next to overwrite
+    size_t size = retained.ring.size();
+    size_t first = size < history ? 0 : retained.next;
+
+    for (size_t i = 0; i < size; i++) {
+        visitor(topic, retained.ring[(first + i) % size]);
+    }
+}
+
+void retained_store::for_each_match(const string& pattern,
+                                    const message_visitor& visitor) const {
+    // the levels before the first wildcard
+    size_t prefix_size = 0;
+    bool wildcard = false;
+
+    for (size_t level = 0; level <= pattern.size() && !wildcard; ) {
+        size_t end = pattern.find('/', level);
+        if (end == string::npos) {
+            end = pattern.size();
+        }
+
+        string_view name(pattern.data() + level, end - level);
+        if (name == "+" || name == "*") {
+            wildcard = true;
+        } else {
+            prefix_size = min(end + 1, pattern.size());
+            level = end + 1;
+        }
+    }
+
+    if (!wildcard) {
+        auto found = entries.find(pattern);
+        if (found != entries.end()) {
+            visit(found->first, found->second, visitor);
+        }
+        return;
+    }
+
+    string_view prefix(pattern.data(), prefix_size);
+    for (auto iter = entries.lower_bound(string(prefix));
+            iter != entries.end() && iter->first.compare(0, prefix.size(), prefix) == 0;
+            ++iter) {
+
+        if (topic_matches(pattern.data(), iter->first.data())) {
+            visit(iter->first, iter->second, visitor);
+        }
+    }
+}
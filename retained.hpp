@@ -0,0 +1,92 @@
+#ifndef _RETAINED_HPP
+#define _RETAINED_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <functional>
+
+#include "pool.hpp"
+#include "filter.hpp"
+
+// the last INFO frames of every concrete topic (a ring of `history` frames
+// per topic), sent to the clients that subscribe later; the frames live in
+// the buffer pools and the total size is capped: past max_bytes the topics
+// updated least recently are dropped
+class retained_store {
+public:
+    typedef std::basic_string<char, std::char_traits<char>, pool_allocator<char>> frame_buffer;
+
+    struct message {
+        // INFO frame, as sent to the subscribers without timestamps
+        frame_buffer frame;
+        uint64_t recv_time;
+        payload_type type;
+        double number;
+        // offset of the STRING value in the frame
+        uint16_t text_offset;
+        // its number in the multicast stream of the topic (0 if it was not
+        // multicast)
+        uint64_t sequence;
+
+        // the payload, for the filters of the subscriptions
+        typed_payload payload() const;
+    };
+
+    retained_store(size_t history, size_t max_bytes);
+
+    // keep the frame as the newest message of the topic
+    void retain(const std::string& topic, const std::string& info_frame,
+                const typed_payload& payload, uint64_t recv_time, uint64_t sequence = 0);
+
+    typedef std::function<void(const std::string&, const message&)> message_visitor;
+
+    // call the visitor for the retained messages of every topic matching
+    // the pattern ("+" and "*" as in topics_tree), oldest first
+    void for_each_match(const std::string& pattern, const message_visitor& visitor) const;
+
+    size_t get_topics() const { return entries.size(); }
+    size_t get_bytes() const { return bytes; }
+    size_t get_max_bytes() const { return max_bytes; }
+    uint64_t get_evicted() const { return evicted; }
+private:
+    // estimated cost of a topic besides its name and frames (map and list
+    // nodes, the ring)
+    static constexpr size_t TOPIC_OVERHEAD = 160;
+
+    struct entry;
+    typedef std::map<std::string, entry> entries_map;
+
+    struct entry {
+        // ring of at most `history` messages; next is the slot to overwrite
+        std::vector<message> ring;
+        size_t next;
+        // position in the least recently updated order
+        std::list<entries_map::iterator>::iterator lru;
+    };
+
+    size_t history;
+    size_t max_bytes;
+    size_t bytes;
+    uint64_t evicted;
+
+    // sorted, so the topics sharing the literal prefix of a pattern are
+    // found with a range scan
+    entries_map entries;
+    // least recently updated first
+    std::list<entries_map::iterator> lru;
+
+    static size_t cost(const message& retained) {
+        return sizeof(message) + retained.frame.capacity();
+    }
+
+    void visit(const std::string& topic, const entry& retained,
+                const message_visitor& visitor) const;
+
+    // drop the least recently updated topics until the store fits its cap
+    void evict();
+};
+
+#endif  // _RETAINED_HPP
@@ -3,12 +3,12 @@
 #include <string.h>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
-#include <fcntl.h>
 
 #include "utils.h"
 #include "server.hpp"
@@ -16,12 +16,12 @@
 using namespace std;
 
 int server::create_binded_listenfd(int type, uint16_t port) {
-    int listenfd = socket(AF_INET, type, 0);
+    int listenfd = io->socket(type);
     int sockopt;
 
     // make this socket reuse the address (so that both TCP and UDP sockets can
     // bind to the same socket)
-    DIE(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt)) == -1,
+    DIE(io->set_option(listenfd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt)) == -1,
             "Cannot make the socket reuse the given address");
     DIE(listenfd == -1, "Cannot create TCP listener");
 
@@ -31,46 +31,160 @@ int server::create_binded_listenfd(int type, uint16_t port) {
     addr.sin_addr.s_addr = INADDR_ANY; // get server's IP address
 
     // set the listening socket as non-blocking
-    int socket_flags = fcntl(listenfd, F_GETFL);
-    DIE(socket_flags == -1
-            || fcntl(listenfd, F_SETFL, socket_flags | O_NONBLOCK) < 0,
-        "Cannot set listening fd as non-blocking");
+    DIE(io->set_nonblocking(listenfd) == -1, "Cannot set listening fd as non-blocking");
 
-    DIE(bind(listenfd, (const sockaddr *) &addr, sizeof(addr)) < 0,
+    DIE(io->bind(listenfd, addr) < 0,
             "Cannot realise bind\n");
 
     return listenfd;
 }
 
-server::server(uint16_t port) : stdin_epoll_info(STDIN_FILENO), closed(false) {
+server::server(const server_config& config)
+    : io(transport::get()), stdin_epoll_info(STDIN_FILENO), closed(false), accept_budget(config.accept_budget),
+        accepted_connections(0), accept_pauses(0), timestamps_requested(false),
+        message_sequence(0), filtered_messages(0), conflated_messages(0),
+        profiler(config.profile > 0 ? new hot_topics() : nullptr),
+        profile_sampling(max(config.profile, 1)), profile_countdown(1),
+        profile_random(random_device()()), store(nullptr),
+        capture(config.capture_path.empty() ? nullptr : new capture_writer(config.capture_path)),
+        retained(config.retain > 0 ? new retained_store(config.retain, config.retain_bytes) : nullptr),
+        multicast_fd(-1), multicast_group(config.multicast_group),
+        multicast_min(config.multicast_min), multicast_messages(0), multicast_saved_frames(0),
+        multicast_errors(0), multicast_recovery_requests(0), multicast_recovered(0),
+        multicast_unrecovered(0),
+        resume_grace(config.resume_grace < 0 ? -1 : config.resume_grace * 1000000000ll),
+        token_generator(random_device()()), timers(TIMER_TICK, now_ns()), loop_time(now_ns()),
+        heartbeat_interval(config.heartbeat * 1000000000ull),
+        idle_timeout(config.idle_timeout * 1000000000ull),
+        shm_ring_size(config.shm_ring_size), shm_fallbacks(0),
+        compress_level(config.compress_level), compress_min_batch(config.compress_min_batch),
+        coalesce_window(config.coalesce < 0 ? -1 : config.coalesce * 1000ll),
+        coalesce_bytes(config.coalesce_bytes),
+        node_name(config.node_name.empty() ? "node-" + to_string(config.port) : config.node_name),
+        forwarded_datagrams(0), peer_datagrams(0) {
+    uint16_t port = config.port;
+
+    if (!config.snapshot_path.empty()) {
+        // restore the subscriptions of the previous run
+        uint64_t load_start = now_ns();
+        store = new subscription_store(config.snapshot_path);
+        size_t loaded = store->load(topics);
+
+        cout << "Loaded " << loaded << " subscriptions in "
+            << (now_ns() - load_start) / 1000000 << "ms." << endl;
+
+        if (resume_grace >= 0) {
+            // the restored clients are not connected; they get the grace period
+            topics.for_each_pattern([this](const string& pattern, const subscribers_map& subscribers) {
+                for (auto& subscriber : subscribers) {
+                    sessions[subscriber.first].patterns.insert(pattern);
+                }
+            });
+
+            for (auto& restored : sessions) {
+                suspend_session(restored.first);
+            }
+        }
+    }
+
+    udp_limiter.set_default_limits(config.udp_limits);
+    for (auto& source : config.udp_sources) {
+        udp_limiter.set_source_limits(source.addr, source.port, source.limits);
+    }
+
+    slab_pool::use_hugepages = config.hugepages;
+
+    if (config.cpu >= 0) {
+        DIE(!pin_to_cpu(config.cpu), "Cannot pin the server to the given CPU");
+    }
+
+    if (config.busy_poll >= 0) {
+        poller.enable(config.busy_poll * 1000ull);
+    }
+
+    connection::pack_frames = coalesce_window >= 0;
+    connection::scheduling = config.scheduling;
+    for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+        connection::class_weights[priority] = config.class_weights[priority];
+    }
+
     // create epoll
-    epollfd = epoll_create1(0);
+    epollfd = io->create_poller();
     DIE(epollfd == -1, "Cannot realise epoll");
 
     // add STDIN to epoll
     epoll_event event;
     event.events = EPOLLIN;
     event.data.ptr = &stdin_epoll_info;
-    DIE(epoll_ctl(epollfd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1,
+    DIE(io->control(epollfd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1,
         "Adding STDIN to epoll failed");
 
     // create TCP listener
     tcp_listen_fd = create_binded_listenfd(SOCK_STREAM, port);
-    DIE(listen(tcp_listen_fd, 10) == -1, "listen failed");
+
+    // inherited by the accepted sockets
+    int sockopt = 1;
+    DIE(io->set_option(tcp_listen_fd, IPPROTO_TCP, TCP_NODELAY, &sockopt, sizeof(sockopt)) == -1,
+        "Cannot disable Nagle's algorithm on the listener");
+
+    if (config.defer_accept > 0) {
+        // a connection is reported once its ID can be read
+        DIE(io->set_option(tcp_listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept,
+                            sizeof(config.defer_accept)) == -1,
+            "Cannot set TCP_DEFER_ACCEPT on the listener");
+    }
+
+    DIE(io->listen(tcp_listen_fd, config.listen_backlog) == -1, "listen failed");
+    accept_resume.callback = [this]() { watch_listener(true); };
 
     tcp_listener_epoll_info = new epoll_event_info<connection>(tcp_listen_fd);
     event.data.ptr = tcp_listener_epoll_info;
 
-    DIE(epoll_ctl(epollfd, EPOLL_CTL_ADD, tcp_listen_fd, &event) == -1,
+    DIE(io->control(epollfd, EPOLL_CTL_ADD, tcp_listen_fd, &event) == -1,
         "Adding TCP listenfd to epoll failed");
 
     // create UDP listener
     udp_listen_fd = create_binded_listenfd(SOCK_DGRAM, port);
     udp_listener_epoll_info = new epoll_event_info<connection>(udp_listen_fd);
 
+    if (poller.is_enabled()) {
+        set_socket_busy_poll(udp_listen_fd, SOCKET_BUSY_POLL);
+    }
+
     event.data.ptr = udp_listener_epoll_info;
-    DIE(epoll_ctl(epollfd, EPOLL_CTL_ADD, udp_listen_fd, &event) == -1,
+    DIE(io->control(epollfd, EPOLL_CTL_ADD, udp_listen_fd, &event) == -1,
         "Adding UDP listenfd to epoll failed");
+
+    if (multicast_group.sin_port) {
+        // never blocks the loop; a datagram the kernel drops is a gap that
+        // the subscribers recover
+        multicast_fd = io->socket(SOCK_DGRAM | SOCK_NONBLOCK);
+        DIE(multicast_fd == -1, "Cannot create the multicast socket");
+
+        DIE(io->set_option(multicast_fd, IPPROTO_IP, IP_MULTICAST_IF, &config.multicast_if,
+                            sizeof(config.multicast_if)) == -1,
+            "Cannot select the multicast interface");
+
+        // the subscribers on this host receive the group as well
+        unsigned char loop = 1;
+        DIE(io->set_option(multicast_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                            sizeof(loop)) == -1,
+            "Cannot enable the multicast loopback");
+    }
+
+    // link to the other nodes; they may not be up yet, the links are retried
+    for (auto& addr : config.peers) {
+        peer_links.emplace_back();
+        peer_link* link = &peer_links.back();
+
+        link->addr = addr;
+        link->outgoing = true;
+        link->conn = nullptr;
+        link->established = false;
+        link->retry.callback = [this, link]() { connect_peer(link); };
+
+        connect_peer(link);
+    }
 }
 
 server::~server() {
@@ -83,91 +197,264 @@ server::~server() {
         delete iter;
     }
 
+    for (auto& peer : peer_connections) {
+        delete peer.first;
+    }
+
+    for (auto& link : peer_links) {
+        timers.cancel(&link.retry);
+    }
+    timers.cancel(&accept_resume);
+
+    delete profiler;
+    delete capture;
+    delete retained;
+
+    if (multicast_fd != -1) {
+        DIE(io->close(multicast_fd) == -1, "Cannot close the multicast socket");
+    }
+
+    if (store) {
+        // the next start loads everything in bulk
+        store->write_snapshot(topics);
+        delete store;
+    }
+
     delete tcp_listener_epoll_info;
     delete udp_listener_epoll_info;
 
     // close TCP and UDP listeners
-    DIE(close(tcp_listen_fd) == -1 || close(udp_listen_fd) == -1,
+    DIE(io->close(tcp_listen_fd) == -1 || io->close(udp_listen_fd) == -1,
         "Cannot close TCP\\UDP listening file descriptor");
 
     // close epoll
-    DIE(close(epollfd) == -1, "Cannot close epolfd");
+    DIE(io->close(epollfd) == -1, "Cannot close epolfd");
 }
 
 void server::run() {
-    while (true) {
-        epoll_event event;
-        DIE(epoll_wait(epollfd, &event, 1, -1) == -1, "Waiting failed");
-
-        epoll_event_info<connection>* info = (epoll_event_info<connection> *)event.data.ptr;
-
-        switch (info->info_type) {
-            case epoll_event_info<connection>::FD:
-                if (info->info.fd == STDIN_FILENO) {
-                    // check if exit is required
-                    char exit_message[sizeof("exit")];
-                    cin.getline(exit_message, sizeof(exit_message));
-
-                    if (strcmp(exit_message, "exit") == 0)
-                        if (shutdown())
-                            return;
-                } else if (info->info.fd == tcp_listen_fd)
-                    add_clients();
-                else if (info->info.fd == udp_listen_fd)
-                    manage_UDP_message();
-                else
-                    DIE(true, "There shouldn't be any waiting fd's \
-                        in epoll other than TCP and UDP listeners.");
-                break;
-            case epoll_event_info<connection>::PTR:
-                if (!manage_connection(info->info.data, event)) {
-                    remove_connection(info->info.data);
-                }
-                break;
-            default:
-                DIE(true, "Wrong type of connection here");
+    while (!run_once()) {
+    }
+}
+
+bool server::run_once() {
+    epoll_event event;
+    int timeout = poller.timeout(timers.next_timeout(loop_time), loop_time);
+    int events;
+
+    if (coalesce_window > 0 && !unflushed.empty()) {
+        // the windows are shorter than the millisecond of epoll_wait
+        uint64_t now = now_ns();
+        uint64_t wait = timeout >= 0 ? timeout * 1000000ull : UINT64_MAX;
+        for (auto conn : unflushed) {
+            wait = min<uint64_t>(wait, conn->flush_deadline > now ? conn->flush_deadline - now : 0);
         }
 
-        if (closed && clients.empty() && refused_clients.empty()) {
-            return;
+        events = io->wait_ns(epollfd, &event, 1, wait);
+    } else {
+        events = io->wait(epollfd, &event, 1, timeout);
+    }
+    DIE(events == -1 && errno != EINTR, "Waiting failed");
+
+    loop_time = now_ns();
+    poller.record(events, loop_time);
+    timers.advance(loop_time);
+
+    if (events <= 0) {
+        flush_connections();
+
+        if (store) {
+            store->flush();
         }
+
+        if (capture) {
+            capture->flush();
+        }
+
+        return false;
+    }
+
+    epoll_event_info<connection>* info = (epoll_event_info<connection> *)event.data.ptr;
+
+    switch (info->info_type) {
+        case epoll_event_info<connection>::FD:
+            if (info->info.fd == STDIN_FILENO) {
+                // several commands may already be buffered by cin
+                do {
+                    string command;
+                    if (!getline(cin, command)) {
+                        // no more input; stop monitoring it
+                        DIE(io->control(epollfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL) == -1,
+                            "Removing STDIN from epoll failed");
+                        break;
+                    }
+
+                    if (manage_command(command))
+                        return true;
+                } while (cin.rdbuf()->in_avail() > 0);
+            } else if (info->info.fd == tcp_listen_fd)
+                add_clients();
+            else if (info->info.fd == udp_listen_fd)
+                manage_UDP_message();
+            else
+                DIE(true, "There shouldn't be any waiting fd's \
+                    in epoll other than TCP and UDP listeners.");
+            break;
+        case epoll_event_info<connection>::PTR:
+            if (!manage_connection(info->info.data, event)) {
+                remove_connection(info->info.data);
+            }
+            break;
+        default:
+            DIE(true, "Wrong type of connection here");
+    }
+
+    flush_connections();
+
+    if (store) {
+        store->flush();
+    }
+
+    if (capture) {
+        capture->flush();
     }
+
+    return closed && clients.empty() && refused_clients.empty() && peer_connections.empty();
 }
 
-bool server::add_client(connection* conn, const string& ID) {
-    // right now, connection should only send the validation;
-    // it shouldn't receive data
-    conn->set_monitor(EPOLLOUT);
+bool server::add_client(connection* conn, const string& handshake) {
+    // parse "<ID>[ <option>]..."
+    istringstream handshake_stream(handshake);
+    string ID, option, token;
+    bool wants_resume = false;
+    bool wants_ring = false;
+    bool wants_aliases = false;
+    bool wants_multicast = false;
+    bool is_peer = false;
+    string codec_name;
+
+    handshake_stream >> ID;
+    while (handshake_stream >> option) {
+        if (option == "resume") {
+            wants_resume = true;
+        } else if (option.compare(0, 6, "token=") == 0) {
+            wants_resume = true;
+            token = option.substr(6);
+        } else if (option == "shm") {
+            wants_ring = true;
+        } else if (option == "alias") {
+            wants_aliases = true;
+        } else if (option == "mcast") {
+            wants_multicast = true;
+        } else if (option.compare(0, 2, "z=") == 0) {
+            codec_name = option.substr(2);
+        } else if (option == "peer") {
+            is_peer = true;
+        }
+    }
+
+    if (is_peer) {
+        return add_peer(conn, ID);
+    }
 
-    if (clients.find(ID) == clients.end()) {
+    auto existing = clients.find(ID);
+    if (existing != clients.end()) {
+        auto old_session = sessions.find(ID);
+
+        if (!token.empty() && old_session != sessions.end()
+            && old_session->second.token == token) {
+            // the client reconnected before we noticed that its old
+            // connection died; the new connection takes over the session
+            remove_connection(existing->second);
+            existing = clients.end();
+        }
+    }
+
+    if (existing == clients.end()) {
         conn->ID = ID;
 
-        cout << "New client "
-            << ID
-            << " connected from "
-            << inet_ntoa(conn->addr.sin_addr)
-            << ":"
-            << ntohs(conn->addr.sin_port)
-            << "."
-            << endl;
+        logger.log(async_logger::CLIENT_CONNECTED, ID, &conn->addr);
+
+        // resume the session if the client is still remembered
+        auto iter = sessions.find(ID);
+        bool resumed = iter != sessions.end();
+        if (resumed) {
+            timers.cancel(&iter->second.expiration);
+        }
+
+        // a session is kept only if the client may come back for it (with
+        // its token) or if it has to expire (its subscriptions are tracked)
+        bool keeps_session = wants_resume || resume_grace >= 0;
+        if (!keeps_session && resumed) {
+            sessions.erase(iter);
+        }
+
+        string response = string((char)message_info::ID + string("OK"));
+        if (wants_resume) {
+            session& client_session = resumed ? iter->second : sessions[ID];
+            if (client_session.token.empty()) {
+                char new_token[17];
+                snprintf(new_token, sizeof(new_token), "%016llx",
+                            (unsigned long long)token_generator());
+                client_session.token = new_token;
+            }
+
+            response += " token=" + client_session.token;
+            if (resumed) {
+                response += " resumed";
+            }
+        }
+
+        // the ring is offered only to subscribers on this host
+        bool local = (ntohl(conn->addr.sin_addr.s_addr) >> 24) == 127;
+        if (wants_ring && local && shm_ring_size) {
+            conn->ring = shm_ring::create(shm_ring_size);
+            if (conn->ring) {
+                response += " shm=" + conn->ring->get_name();
+            }
+        }
+
+        // the frames of the ring keep their topics (the aliases are
+        // applied when a frame leaves through the socket)
+        if (wants_aliases && conn->ring == nullptr) {
+            conn->enable_topic_aliases();
+            response += " alias";
+        }
+
+        // its "mcast" subscriptions are then served by the group
+        if (wants_multicast && multicast_fd != -1) {
+            conn->multicast = true;
+            response += " mcast=" + string(inet_ntoa(multicast_group.sin_addr)) + ":"
+                        + to_string(ntohs(multicast_group.sin_port));
+        }
+
+        stream_codec* codec = nullptr;
+        if (compress_level > 0 && !codec_name.empty()) {
+            codec = stream_codec::create(codec_name, compress_level);
+            if (codec) {
+                response += " z=" + codec_name;
+            }
+        }
 
         conn->state = connection::STATE_ACTIVE;
         clients[conn->ID] = conn;
-        conn->push_send_message(string((char)message_info::ID + string("OK")));
+        conn->push_send_message(response);
+
+        if (codec) {
+            // the reply itself is not compressed
+            conn->enable_compression(codec, compress_min_batch);
+        }
         if (conn->state == connection::STATE_CONNECTION_BROKEN) {
             // Connection closed unexpectedly
-            remove_connection(conn);
             return false;
         }
     } else {
-        cout << "Client " << ID << " already connected." << endl;
+        logger.log(async_logger::CLIENT_REFUSED, ID);
         refused_clients.push_back(conn);
 
-        conn->set_monitor(EPOLLOUT);
+        // the write interest is armed only if the reply does not fit
         conn->push_send_message(string((char)message_info::ID + string("NO")));
         if (conn->state == connection::STATE_DISCONNECTED
             || conn->state == connection::STATE_CONNECTION_BROKEN) {
-            remove_connection(conn);
             return false;
         }
     }
@@ -175,174 +462,743 @@ bool server::add_client(connection* conn, const string& ID) {
     return true;
 }
 
+void server::deliver(connection* conn, const string& frame, const string& topic,
+                        priority_class priority, int stamp_offset, bool conflate) {
+    if (conn->ring) {
+        if (conn->ring->write(frame.data(), frame.size(), stamp_offset)) {
+            if (conn->ring->consume_wakeup()) {
+                // the subscriber sleeps in epoll; ring the doorbell
+                conn->push_send_message(string(1, (char)SHM_RING));
+            }
+
+            return;
+        }
+
+        // the subscriber does not keep up; it drains the ring before
+        // reading the socket, so the order of the frames is kept
+        delete conn->ring;
+        conn->ring = nullptr;
+        shm_fallbacks++;
+    }
+
+    if (conflate) {
+        if (conn->queue_conflated_message(topic, frame, priority, stamp_offset, topic.size())) {
+            // the old frame was waiting for the socket; so does the new one
+            conflated_messages++;
+            return;
+        }
+    } else {
+        conn->queue_send_message(frame, priority, stamp_offset, topic.size());
+    }
+
+    if (coalesce_window < 0) {
+        conn->send_messages();
+        return;
+    }
+
+    conn->unflushed_bytes += frame.size() + 1;
+
+    if (conn->flush_deadline == 0) {
+        conn->flush_deadline = loop_time + max<int64_t>(coalesce_window, 1);
+        unflushed.push_back(conn);
+    }
+
+    if (conn->unflushed_bytes >= coalesce_bytes) {
+        // enough for full segments; the rest of the batch starts over
+        conn->unflushed_bytes = 0;
+        conn->send_messages();
+    }
+}
+
+void server::flush_connections() {
+    if (unflushed.empty()) {
+        return;
+    }
+
+    uint64_t now = coalesce_window > 0 ? now_ns() : UINT64_MAX;
+    vector<connection*> broken;
+    size_t waiting = 0;
+
+    for (auto conn : unflushed) {
+        if (conn->flush_deadline > now) {
+            unflushed[waiting++] = conn;
+            continue;
+        }
+
+        conn->flush_deadline = 0;
+        conn->unflushed_bytes = 0;
+        conn->send_messages();
+
+        if (conn->state == connection::STATE_CONNECTION_BROKEN) {
+            broken.push_back(conn);
+        }
+    }
+
+    unflushed.resize(waiting);
+
+    for (auto conn : broken) {
+        remove_connection(conn);
+    }
+}
+
+void server::suspend_session(const string& ID) {
+    if (resume_grace < 0) {
+        // the subscriptions are kept forever
+        return;
+    }
+
+    auto iter = sessions.find(ID);
+    if (iter == sessions.end()) {
+        return;
+    }
+
+    wheel_timer& expiration = iter->second.expiration;
+    expiration.callback = [this, ID]() { expire_session(ID); };
+    timers.schedule(&expiration, loop_time + resume_grace);
+}
+
+void server::expire_session(const string& ID) {
+    auto iter = sessions.find(ID);
+    if (iter == sessions.end()) {
+        return;
+    }
+
+    for (auto& pattern : iter->second.patterns) {
+        if (topics.unsubscribe(ID, pattern.data())) {
+            interest_changed(pattern, false);
+        }
+
+        if (store) {
+            store->record_unsubscribe(ID, pattern);
+        }
+    }
+
+    sessions.erase(iter);
+}
+
+void server::check_idle(connection* conn) {
+    uint64_t idle = loop_time - conn->last_activity;
+
+    if (idle_timeout && idle >= idle_timeout) {
+        // dead peer; stop queueing messages for it
+        remove_connection(conn);
+        return;
+    }
+
+    uint64_t next_check;
+
+    if (heartbeat_interval && idle >= heartbeat_interval) {
+        conn->push_send_message(string(1, (char)HEARTBEAT));
+        if (conn->state == connection::STATE_CONNECTION_BROKEN) {
+            remove_connection(conn);
+            return;
+        }
+
+        next_check = loop_time + heartbeat_interval;
+    } else {
+        next_check = conn->last_activity + (heartbeat_interval ? heartbeat_interval : idle_timeout);
+    }
+
+    if (idle_timeout) {
+        next_check = min(next_check, conn->last_activity + idle_timeout);
+    }
+
+    timers.schedule(&conn->idle_timer, next_check);
+}
+
 void server::add_clients() {
-    sockaddr_in addr;
-    socklen_t len = sizeof(addr);
-    int connectionfd;
+    for (int accepted = 0; accepted < accept_budget; accepted++) {
+        sockaddr_in addr;
+        int connectionfd = io->accept(tcp_listen_fd, &addr);
+        if (connectionfd == -1) {
+            if (errno == EAGAIN) {
+                return;
+            }
+
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // the listener would stay ready and spin the loop; the
+                // connections wait in the backlog meanwhile
+                accept_pauses++;
+                watch_listener(false);
+                timers.schedule(&accept_resume, loop_time + ACCEPT_PAUSE);
+                return;
+            }
+
+            // the connection was aborted before being accepted
+            DIE(errno != ECONNABORTED && errno != EPROTO && errno != EINTR, "accept failed");
+            continue;
+        }
+
+        accepted_connections++;
+
+        if (poller.is_enabled()) {
+            set_socket_busy_poll(connectionfd, SOCKET_BUSY_POLL);
+        }
 
-    while ((connectionfd = accept(tcp_listen_fd, (sockaddr *) &addr, &len)) != -1) {
         // create new connection
-        connection* conn = new connection(epollfd, connectionfd, addr);
+        connection* conn = new connection(epollfd, connectionfd, addr, true);
 
-        // read the ID of connection
-        manage_receive(conn);
+        conn->last_activity = loop_time;
+        if (heartbeat_interval || idle_timeout) {
+            conn->idle_timer.callback = [this, conn]() { check_idle(conn); };
+            check_idle(conn);
+        }
+
+        // read the ID of connection (usually there already, with
+        // TCP_DEFER_ACCEPT)
+        if (!manage_receive(conn)) {
+            remove_connection(conn);
+        }
     }
+}
+
+void server::watch_listener(bool enabled) {
+    epoll_event event;
+    event.events = enabled ? (uint32_t)EPOLLIN : 0u;
+    event.data.ptr = tcp_listener_epoll_info;
 
-    // accept should have returned -1 if and only if EAGAIN had been set
-    DIE(errno != EAGAIN, "accept failed");
+    DIE(io->control(epollfd, EPOLL_CTL_MOD, tcp_listen_fd, &event) == -1,
+        "Modifying the TCP listener in epoll failed");
+}
+
+void server::connect_peer(peer_link* link) {
+    if (closed) {
+        return;
+    }
+
+    int fd = io->socket(SOCK_STREAM | SOCK_NONBLOCK);
+    DIE(fd == -1, "Cannot create a peer socket");
+
+    if (io->connect(fd, link->addr) == -1 && errno != EINPROGRESS) {
+        io->close(fd);
+        timers.schedule(&link->retry, loop_time + PEER_RETRY);
+        return;
+    }
+
+    // the handshake leaves as soon as the connection is established; a
+    // failed connect breaks the connection, which schedules the retry
+    connection* conn = new connection(epollfd, fd, link->addr);
+    link->conn = conn;
+    peer_connections[conn] = link;
+
+    conn->last_activity = loop_time;
+    if (heartbeat_interval || idle_timeout) {
+        conn->idle_timer.callback = [this, conn]() { check_idle(conn); };
+        check_idle(conn);
+    }
+
+    conn->queue_send_message(string(1, (char)ID) + node_name + " peer");
+    conn->set_monitor(EPOLLIN | EPOLLOUT);
+}
+
+bool server::add_peer(connection* conn, const string& node) {
+    if (node.empty() || node == node_name || peers_by_node.count(node)) {
+        // a second link between two nodes would deliver everything twice
+        logger.log(async_logger::CLIENT_REFUSED, node);
+        refused_clients.push_back(conn);
+
+        conn->push_send_message(string((char)message_info::ID + string("NO")));
+        if (conn->state == connection::STATE_CONNECTION_BROKEN) {
+            return false;
+        }
+
+        return true;
+    }
+
+    peer_links.emplace_back();
+    peer_link* link = &peer_links.back();
+
+    link->addr = conn->addr;
+    link->outgoing = false;
+    link->conn = conn;
+    link->node = node;
+    peer_connections[conn] = link;
+
+    conn->state = connection::STATE_ACTIVE;
+    conn->queue_send_message(string((char)message_info::ID + string("OK node=")) + node_name);
+    peer_established(link);
+
+    conn->send_messages();
+    if (conn->state == connection::STATE_CONNECTION_BROKEN) {
+        return false;
+    }
+
+    return true;
+}
+
+void server::peer_established(peer_link* link) {
+    link->established = true;
+    peers_by_node[link->node] = link;
+
+    logger.log(async_logger::PEER_CONNECTED, link->node, &link->conn->addr);
+
+    // everything our subscribers want, the suspended sessions included
+    connection* conn = link->conn;
+    topics.for_each_pattern([conn](const string& pattern, const subscribers_map&) {
+        conn->queue_send_message(string(1, (char)PEER_INTEREST) + '+' + pattern);
+    });
+}
+
+bool server::manage_peer_request(peer_link* link, const string& request) {
+    connection* conn = link->conn;
+
+    switch (request[0]) {
+        case ID:
+            {
+                // the answer to our handshake: "0OK node=<name>" or "0NO"
+                size_t node_pos = request.find(" node=");
+                if (!link->outgoing || link->established
+                    || request.compare(1, 2, "OK") != 0 || node_pos == string::npos) {
+                    return false;
+                }
+
+                link->node = request.substr(node_pos + 6);
+                if (link->node == node_name || peers_by_node.count(link->node)) {
+                    // linked already through another address
+                    return false;
+                }
+
+                conn->state = connection::STATE_ACTIVE;
+                peer_established(link);
+                conn->send_messages();
+            }
+            break;
+        case PEER_INTEREST:
+            if (link->established && request.size() > 2) {
+                string pattern(request, 2);
+
+                if (request[1] == '+') {
+                    if (link->interest.insert(pattern).second) {
+                        peer_interest.subscribe(link->node, pattern.data());
+                    }
+                } else if (link->interest.erase(pattern)) {
+                    peer_interest.unsubscribe(link->node, pattern.data());
+                }
+            }
+            break;
+        case PEER_FORWARD:
+            if (link->established) {
+                string datagram;
+                datagram.reserve(request.size() - 1);
+
+                for (size_t i = 1; i < request.size(); i++) {
+                    if (request[i] == PEER_ESCAPE && i + 1 < request.size()) {
+                        datagram.push_back(request[++i] ^ 0x20);
+                    } else {
+                        datagram.push_back(request[i]);
+                    }
+                }
+
+                peer_datagrams++;
+                publish(datagram.data(), datagram.size(),
+                        timestamps_requested ? realtime_ns() : 0, true);
+            }
+            break;
+        case HEARTBEAT:
+            // only the side that opened the link answers, or the two nodes
+            // would keep answering each other
+            if (link->outgoing) {
+                conn->push_send_message(string(1, (char)HEARTBEAT));
+            }
+            break;
+        case EXIT:
+            return false;
+        default:
+            break;
+    }
+
+    return conn->state != connection::STATE_CONNECTION_BROKEN;
+}
+
+void server::interest_changed(const string& pattern, bool added) {
+    if (peers_by_node.empty()) {
+        return;
+    }
+
+    string frame = string(1, (char)PEER_INTEREST) + (added ? '+' : '-') + pattern;
+
+    // a broken link is noticed (and removed) by its own epoll event
+    for (auto& peer : peers_by_node) {
+        peer.second->conn->push_send_message(frame);
+    }
+}
+
+void server::forward_to_peers(const string& topic, const char* datagram, size_t size) {
+    constexpr char FRAME_END = 0x3;
+
+    subscribers_map* nodes = peer_interest.get_subscribers(topic.data());
+
+    if (!nodes->empty()) {
+        // the datagram is binary; escape the bytes that end the frames
+        string frame(1, (char)PEER_FORWARD);
+        frame.reserve(size + size / 8 + 1);
+
+        for (size_t i = 0; i < size; i++) {
+            if (datagram[i] == FRAME_END || datagram[i] == PEER_ESCAPE) {
+                frame.push_back(PEER_ESCAPE);
+                frame.push_back(datagram[i] ^ 0x20);
+            } else {
+                frame.push_back(datagram[i]);
+            }
+        }
+
+        for (auto& node : *nodes) {
+            auto link = peers_by_node.find(node.first);
+            if (link != peers_by_node.end()) {
+                link->second->conn->push_send_message(frame, PRIORITY_NORMAL);
+                forwarded_datagrams++;
+            }
+        }
+    }
+
+    delete nodes;
 }
 
 void server::manage_UDP_message() {
     char buff[MAX_UDP_PACKAGE_SIZE];
+    bool limited = udp_limiter.enabled();
+    bool want_source = limited || capture;
 
     while (true) {
-        ssize_t read_size = recvfrom(udp_listen_fd,
+        sockaddr_in source;
+
+        ssize_t read_size = io->recv_from(udp_listen_fd,
                                 buff,
                                 MAX_UDP_PACKAGE_SIZE,
-                                0,
-                                nullptr,
-                                nullptr);
+                                want_source ? &source : nullptr);
 
         if (read_size <= 0) {
             return;
         }
 
-        // parse the message, in order to see if it has finished
-        string message(buff, read_size);
+        if (capture) {
+            // everything, including what the limiter drops next
+            capture->record(now_ns(), source, buff, read_size);
+        }
 
-        if (message.size() < 51) {
-            // ignore incompatible packages
+        if (limited && !udp_limiter.allow(source, now_ns())) {
+            // the publisher exceeded its rate; drop before any parsing
             continue;
         }
 
-        string payload_message;
+        publish(buff, read_size, timestamps_requested ? realtime_ns() : 0, false);
+    }
+}
 
-        switch (message[50]) {
-            case 0: // INT
-                {
-                    if (message.size() < 56) {
-                        // the message is not complete; drop it
-                        continue;
-                    }
+void server::publish(const char* datagram, size_t size, uint64_t recv_time, bool from_peer) {
+    // parse the message, in order to see if it has finished
+    string message(datagram, size);
 
-                    if (message[51] > 1) {
-                        // message is corrupted; drop it
-                        continue;
-                    }
+    if (message.size() < 51) {
+        // ignore incompatible packages
+        return;
+    }
 
-                    uint32_t* int_p = (uint32_t*)(message.data() + 52);
-                    uint32_t int_message = htonl(*int_p);
-                    
-                    payload_message.append(" - INT - ");
-                    if (message[51] && int_message != 0) {
-                        payload_message.append("-");
-                    }
-                    payload_message.append(to_string(int_message));
+    string payload_message;
+    typed_payload payload;
+    payload.type = (payload_type)message[50];
+
+    switch (message[50]) {
+        case 0: // INT
+            {
+                if (message.size() < 56) {
+                    // the message is not complete; drop it
+                    return;
                 }
 
-                break;
-        
-            case 1: // SHORT REAL
-                {
-                    if (message.size() < 53) {
-                        // the message is not complete; drop it
-                        continue;
-                    }
+                if (message[51] > 1) {
+                    // message is corrupted; drop it
+                    return;
+                }
 
-                    uint16_t* int_p = (uint16_t*)(message.data() + 51);
-                    uint16_t int_message = htons(*int_p);
-                    
-                    payload_message.append(" - SHORT_REAL - ");
+                uint32_t* int_p = (uint32_t*)(message.data() + 52);
+                uint32_t int_message = htonl(*int_p);
+                
+                payload_message.append(" - INT - ");
+                if (message[51] && int_message != 0) {
+                    payload_message.append("-");
+                }
+                payload_message.append(to_string(int_message));
 
-                    stringstream ss;
-                    ss << fixed << setprecision(2) << (float)int_message / 100;
-                    string result;
-                    ss >> result;
+                payload.number = message[51] ? -(double)int_message : int_message;
+            }
 
-                    payload_message.append(result);
+            break;
+    
+        case 1: // SHORT REAL
+            {
+                if (message.size() < 53) {
+                    // the message is not complete; drop it
+                    return;
                 }
 
-                break;
+                uint16_t* int_p = (uint16_t*)(message.data() + 51);
+                uint16_t int_message = htons(*int_p);
+                
+                payload_message.append(" - SHORT_REAL - ");
 
-            case 2: // FLOAT
-                {
-                    if (message.size() < 57) {
-                        // the message is not complete; drop it
-                        continue;
-                    }
+                stringstream ss;
+                ss << fixed << setprecision(2) << (float)int_message / 100;
+                string result;
+                ss >> result;
 
-                    if (message[51] > 1) {
-                        // message is corrupted; drop it
-                        continue;
-                    }
-
-                    uint32_t* int_p = (uint32_t*)(message.data() + 52);
-                    uint32_t module = htonl(*int_p);
+                payload_message.append(result);
 
-                    uint8_t exp = *(uint8_t*)(message.data() + 56);
+                payload.number = (double)int_message / 100;
+            }
 
-                    payload_message.append(" - FLOAT - ");
-                    if (message[51]) {
-                        payload_message.append("-");
-                    }
+            break;
 
-                    double result = module;
-                    while (exp--) {
-                        result /= 10;
-                    }
+        case 2: // FLOAT
+            {
+                if (message.size() < 57) {
+                    // the message is not complete; drop it
+                    return;
+                }
 
-                    payload_message.append(to_string(result));
+                if (message[51] > 1) {
+                    // message is corrupted; drop it
+                    return;
                 }
 
-                break;
+                uint32_t* int_p = (uint32_t*)(message.data() + 52);
+                uint32_t module = htonl(*int_p);
 
-            case 3: // STRING
-                payload_message.append(" - STRING - ");
-                for (int iter = 51;
-                        iter < MAX_UDP_PACKAGE_SIZE && message[iter];
-                        iter++) {
+                uint8_t exp = *(uint8_t*)(message.data() + 56);
 
-                    payload_message += message[iter];
+                payload_message.append(" - FLOAT - ");
+                if (message[51]) {
+                    payload_message.append("-");
                 }
-                break;
 
-            default:
-                // no valid data type; drop the package
-                continue;
-        }
+                double result = module;
+                while (exp--) {
+                    result /= 10;
+                }
 
-        // parse the topic
-        int i;
-        for (i = 0; i < 50; i++) {
-            if (message[i] == '\0') {
-                break;
+                payload_message.append(to_string(result));
+
+                payload.number = message[51] ? -result : result;
+            }
+
+            break;
+
+        case 3: // STRING
+            payload_message.append(" - STRING - ");
+            for (int iter = 51;
+                    iter < MAX_UDP_PACKAGE_SIZE && message[iter];
+                    iter++) {
+
+                payload_message += message[iter];
             }
+            break;
+
+        default:
+            // no valid data type; drop the package
+            return;
+    }
+
+    // parse the topic
+    int i;
+    for (i = 0; i < 50; i++) {
+        if (message[i] == '\0') {
+            break;
         }
-        string topic(message, 0, i);
+    }
+    string topic(message, 0, i);
 
-        set<string>* IDs = topics.get_subscribers(topic.data());
-        // send this message to all subscribers
+    if (!from_peer && !peers_by_node.empty()) {
+        // peers do not forward what they receive from us, so we are the
+        // only node sending it to them
+        forward_to_peers(topic, datagram, size);
+    }
+
+    bool profiled = profiler && --profile_countdown == 0;
+    if (profiled) {
+        // the next one is 1 to 2 * sampling - 1 datagrams away
+        profile_countdown = 1 + profile_random() % (2 * profile_sampling - 1);
+        matched_patterns.clear();
+    }
+
+    uint64_t match_start = profiled ? now_ns() : 0;
+    subscribers_map* IDs = topics.get_subscribers(topic.data(),
+                                                    profiled ? &matched_patterns : nullptr);
+    uint64_t match_time = profiled ? now_ns() - match_start : 0;
+
+    string info_message((char)INFO + topic + payload_message);
+
+    if (payload.type == PAYLOAD_STRING) {
+        payload.text = string_view(payload_message).substr(sizeof(" - STRING - ") - 1);
+    }
+
+    message_sequence++;
+
+    // sent once to the group if enough subscriptions can take it from there
+    uint64_t multicast_sequence = 0;
+    if (multicast_fd != -1) {
+        size_t multicast_subscribers = 0;
         for (auto& ID : *IDs) {
-            auto conn = clients.find(ID);
-            if (conn != clients.end()) {
-                conn->second->push_send_message(string((char)INFO + topic + payload_message));
-                if (conn->second->state == connection::STATE_CONNECTION_BROKEN) {
-                    // Connection closed unexpectedly
-                    remove_connection(conn->second);
+            multicast_subscribers += ID.second.multicast;
+        }
+
+        if (multicast_subscribers >= multicast_min) {
+            multicast_sequence = send_multicast(topic, info_message);
+        }
+    }
+
+    if (retained) {
+        // the new subscribers may want the time even if nobody did so far
+        retained->retain(topic, info_message, payload, recv_time ? recv_time : realtime_ns(),
+                            multicast_sequence);
+    }
+
+    // frames with timestamps, built only if some subscriber wants them
+    string timed_message[2];
+    uint64_t fanout_bytes = 0;
+
+    // send this message to all subscribers
+    for (auto& ID : *IDs) {
+        auto conn = clients.find(ID.first);
+        if (conn != clients.end()) {
+            if (multicast_sequence && ID.second.multicast && conn->second->multicast) {
+                multicast_saved_frames++;
+                continue;
+            }
+
+            if (ID.second.filter && !ID.second.filter->matches(payload, message_sequence)) {
+                filtered_messages++;
+                continue;
+            }
+
+            auto timestamps = ID.second.timestamps;
+
+            if (timestamps == subscription_options::TIMESTAMPS_NONE) {
+                deliver(conn->second, info_message, topic, ID.second.priority, -1,
+                        ID.second.conflate);
+                fanout_bytes += info_message.size() + 1;
+            } else {
+                bool with_send_time = timestamps == subscription_options::TIMESTAMPS_RECV_SEND;
+                string& timed = timed_message[with_send_time];
+
+                if (timed.empty()) {
+                    timed = make_timed_info(info_message, recv_time, with_send_time);
                 }
+
+                deliver(conn->second, timed, topic, ID.second.priority,
+                        with_send_time ? SEND_STAMP_OFFSET : -1, ID.second.conflate);
+                fanout_bytes += timed.size() + 1;
+            }
+
+            if (conn->second->state == connection::STATE_CONNECTION_BROKEN) {
+                // Connection closed unexpectedly
+                remove_connection(conn->second);
             }
         }
-        delete IDs;
     }
+    delete IDs;
+
+    if (profiled) {
+        profiler->record(topic.data(), topic.size(), match_time, matched_patterns,
+                            info_message.size() + 1, fanout_bytes, profile_sampling);
+    }
+}
+
+uint64_t server::send_multicast(const string& topic, const string& info_message) {
+    uint64_t sequence = ++multicast_sequences[topic];
+
+    char header[24];
+    int header_size = snprintf(header, sizeof(header), "%llu ", (unsigned long long)sequence);
+
+    iovec parts[2];
+    parts[0].iov_base = header;
+    parts[0].iov_len = header_size;
+    parts[1].iov_base = (void*)(info_message.data() + 1);
+    parts[1].iov_len = info_message.size() - 1;
+
+    if (io->send_to(multicast_fd, parts, 2, multicast_group) == -1) {
+        // the subscribers see the gap
+        multicast_errors++;
+    }
+
+    multicast_messages++;
+    return sequence;
+}
+
+void server::recover_multicast(connection* conn, const string& request) {
+    unsigned long long first, last;
+    int topic_pos = 0;
+
+    if (sscanf(request.data(), "%llu %llu %n", &first, &last, &topic_pos) != 2
+        || topic_pos == 0 || first > last) {
+        return;
+    }
+
+    multicast_recovery_requests++;
+
+    // what the store no longer has (--retain is required with --multicast,
+    // but a gap may be longer than what it keeps) is lost for good
+    if (retained == nullptr) {
+        multicast_unrecovered += last - first + 1;
+        return;
+    }
+
+    string topic(request, topic_pos);
+    string frame;
+    uint64_t recovered = 0;
+
+    retained->for_each_match(topic, [&](const string& name, const retained_store::message& message) {
+        if (name != topic || message.sequence < first || message.sequence > last) {
+            return;
+        }
+
+        frame.assign(message.frame.data(), message.frame.size());
+        deliver(conn, frame, name, PRIORITY_NORMAL);
+        recovered++;
+    });
+
+    multicast_recovered += recovered;
+    multicast_unrecovered += last - first + 1 - recovered;
+}
+
+void server::send_retained(connection* conn, const string& pattern,
+                            const subscription_options& options) {
+    bool with_send_time = options.timestamps == subscription_options::TIMESTAMPS_RECV_SEND;
+    string frame;
+
+    retained->for_each_match(pattern, [&](const string& topic, const retained_store::message& message) {
+        if (conn->state == connection::STATE_CONNECTION_BROKEN) {
+            return;
+        }
+
+        // a sequence of its own, the filters cache their last result
+        if (options.filter && !options.filter->matches(message.payload(), ++message_sequence)) {
+            filtered_messages++;
+            return;
+        }
+
+        frame.assign(message.frame.data(), message.frame.size());
+        if (options.timestamps != subscription_options::TIMESTAMPS_NONE) {
+            frame = make_timed_info(frame, message.recv_time, with_send_time);
+        }
+
+        deliver(conn, frame, topic, options.priority,
+                with_send_time ? SEND_STAMP_OFFSET : -1, options.conflate);
+    });
 }
 
 bool server::manage_client_request(connection* conn, const string& request) {
+    if (!peer_connections.empty()) {
+        auto peer = peer_connections.find(conn);
+        if (peer != peer_connections.end()) {
+            return manage_peer_request(peer->second, request);
+        }
+    }
+
     if (conn->state == connection::STATE_CONNECTING) {
         if (request[0] == ID) {
             return add_client(conn, string(request.data() + 1));
         } else {
             // Client did not send its ID as a first message; close this connection
-            remove_connection(conn);
             return false;
         }
     }
@@ -352,23 +1208,78 @@ bool server::manage_client_request(connection* conn, const string& request) {
             // Connection sent ID more than once; ignore this
             break;
         case SUBSCRIBE: // subscribe
-            topics.subscribe(conn->ID, request.data() + 1);
-            conn->push_send_message(string((char)SUBSCRIBE + string("0") + string(request.data() + 1)));
+            {
+                string topic;
+                subscription_options options;
+
+                if (subscription_options::parse_request(request.data() + 1, topic, options)) {
+                    if (topics.subscribe(conn->ID, topic.data(), options)) {
+                        interest_changed(topic, true);
+                    }
+                    if (resume_grace >= 0) {
+                        sessions[conn->ID].patterns.insert(topic);
+                    }
+
+                    if (store) {
+                        store->record_subscribe(conn->ID, topic, options);
+                    }
+                    if (options.timestamps != subscription_options::TIMESTAMPS_NONE) {
+                        timestamps_requested = true;
+                    }
+
+                    conn->push_send_message(string((char)SUBSCRIBE + string("0") + topic));
+
+                    if (retained) {
+                        send_retained(conn, topic, options);
+                    }
+                } else {
+                    conn->push_send_message(string((char)SUBSCRIBE + string("1") + topic));
+                }
+            }
+
             if (conn->state == connection::STATE_CONNECTION_BROKEN) {
                 // Connection closed unexpectedly
-                remove_connection(conn);
                 return false;
             }
             break;
         case UNSUBSCRIBE: // unsubscribe
-            topics.unsubscribe(conn->ID, request.data() + 1);
+            if (topics.unsubscribe(conn->ID, request.data() + 1)) {
+                interest_changed(request.data() + 1, false);
+            }
+            if (resume_grace >= 0) {
+                sessions[conn->ID].patterns.erase(request.data() + 1);
+            }
+
+            if (store) {
+                store->record_unsubscribe(conn->ID, request.data() + 1);
+            }
             conn->push_send_message(string((char)UNSUBSCRIBE + string("0") + (request.data() + 1)));
             if (conn->state == connection::STATE_CONNECTION_BROKEN) {
                 // Connection closed unexpectedly
-                remove_connection(conn);
                 return false;
             }
             break;
+        case HEARTBEAT:
+            // the client is alive; the activity is already recorded
+            break;
+        case MULTICAST_RECOVER:
+            recover_multicast(conn, request.substr(1));
+            if (conn->state == connection::STATE_CONNECTION_BROKEN) {
+                // Connection closed unexpectedly
+                return false;
+            }
+            break;
+        case SHM_RING:
+            if (conn->ring) {
+                if (request.compare(1, string::npos, "ok") == 0) {
+                    // mapped on both sides; nobody else needs the name
+                    conn->ring->unlink();
+                } else {
+                    delete conn->ring;
+                    conn->ring = nullptr;
+                }
+            }
+            break;
         case EXIT:
             return false;
             break;
@@ -382,6 +1293,7 @@ bool server::manage_client_request(connection* conn, const string& request) {
 
 bool server::manage_receive(connection* conn) {
     conn->recv_message();
+    conn->last_activity = loop_time;
 
     if (conn->state == connection::STATE_CONNECTION_BROKEN) {
         // Connection closed unexpectedly
@@ -406,13 +1318,11 @@ bool server::manage_send(connection* conn) {
     switch (conn->state) {
         case connection::STATE_INVALID:
             // rejection response has been sent; close this
-            remove_connection(conn);
             return false;
             break;
 
         case connection::STATE_CONNECTION_BROKEN:
             // Connection closed unexpectedly
-            remove_connection(conn);
             return false;
             break;
 
@@ -424,21 +1334,63 @@ bool server::manage_send(connection* conn) {
 }
 
 void server::remove_connection(connection* conn) {
+    timers.cancel(&conn->idle_timer);
+
+    if (conn->flush_deadline) {
+        unflushed.erase(find(unflushed.begin(), unflushed.end(), conn));
+    }
+
+    if (!peer_connections.empty()) {
+        auto peer = peer_connections.find(conn);
+        if (peer != peer_connections.end()) {
+            peer_link* link = peer->second;
+            peer_connections.erase(peer);
+
+            if (link->established) {
+                logger.log(async_logger::PEER_DISCONNECTED, link->node);
+                peers_by_node.erase(link->node);
+
+                // nothing is forwarded to it until it tells us its interest again
+                for (auto& pattern : link->interest) {
+                    peer_interest.unsubscribe(link->node, pattern.data());
+                }
+            }
+
+            delete conn;
+
+            if (link->outgoing) {
+                link->conn = nullptr;
+                link->established = false;
+                link->interest.clear();
+
+                if (!closed) {
+                    timers.schedule(&link->retry, loop_time + PEER_RETRY);
+                }
+            } else {
+                peer_links.remove_if([link](const peer_link& other) { return &other == link; });
+            }
+
+            return;
+        }
+    }
+
     if (conn->ID.empty()) {
         refused_clients.remove(conn);
     } else {
-        cout << "Client " << conn->ID << " disconnected." << endl;
+        logger.log(async_logger::CLIENT_DISCONNECTED, conn->ID);
         clients.erase(conn->ID);
+        suspend_session(conn->ID);
     }
 
     delete conn;
 }
 
 bool server::shutdown() {
+    closed = true;
+
     for (auto conn = clients.begin(); conn != clients.end();) {
         conn->second->state = connection::STATE_INVALID;
-        conn->second->set_monitor(EPOLLOUT);
-        conn->second->push_send_message(string(string("") + (char)message_info::EXIT));
+        conn->second->push_send_message(string(string("") + (char)message_info::EXIT), PRIORITY_LOW);
         if (conn->second->state == connection::STATE_CONNECTION_BROKEN
             || conn->second->state == connection::STATE_DISCONNECTED) {
 
@@ -450,5 +1402,143 @@ bool server::shutdown() {
         }
     }
 
-    return clients.empty() && refused_clients.empty();
+    for (auto peer = peer_connections.begin(); peer != peer_connections.end();) {
+        connection* c = peer->first;
+        peer++;
+
+        c->state = connection::STATE_INVALID;
+        c->push_send_message(string(1, (char)EXIT), PRIORITY_LOW);
+        if (c->state == connection::STATE_CONNECTION_BROKEN
+            || c->state == connection::STATE_DISCONNECTED) {
+            remove_connection(c);
+        }
+    }
+
+    return clients.empty() && refused_clients.empty() && peer_connections.empty();
+}
+
+bool server::manage_command(const string& command) {
+    if (command == "exit") {
+        return shutdown();
+    }
+
+    if (command == "stats") {
+        print_stats();
+    } else if (command == "hot") {
+        if (profiler) {
+            if (profile_sampling > 1) {
+                cout << "(estimated from one datagram in " << profile_sampling << ")" << endl;
+            }
+            profiler->print(cout);
+        } else {
+            cout << "Topic profiling is disabled (start the server with --profile)" << endl;
+        }
+    } else if (command == "snapshot") {
+        if (store) {
+            store->write_snapshot(topics);
+        }
+    } else if (command == "hot reset") {
+        if (profiler) {
+            profiler->reset();
+        }
+    }
+
+    return false;
+}
+
+void server::print_stats() {
+    static const char* class_names[PRIORITY_CLASSES] = {"high", "normal", "low"};
+
+    cout << "Clients: " << clients.size() << endl;
+    cout << "Accepted connections: " << accepted_connections << " (accepting paused "
+        << accept_pauses << " times for lack of descriptors)" << endl;
+    cout << "Dropped log records: " << logger.get_dropped() << endl;
+
+    for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+        cout << "Queue latency (" << class_names[priority] << "): ";
+        connection::queue_latency[priority].print(cout);
+        cout << endl;
+    }
+
+    cout << "Messages dropped by filters: " << filtered_messages << endl;
+    cout << "Messages replaced by newer ones (conflation): " << conflated_messages << endl;
+
+    if (retained) {
+        cout << "Retained: " << retained->get_topics() << " topics in "
+            << retained->get_bytes() << " of " << retained->get_max_bytes()
+            << " bytes (" << retained->get_evicted() << " topics evicted)" << endl;
+    }
+
+    uint64_t frames = 0, segments = 0;
+    for (auto& client : clients) {
+        frames += client.second->frames_sent;
+        segments += client.second->get_data_segments();
+    }
+    if (multicast_fd != -1) {
+        cout << "Multicast: " << multicast_messages << " messages sent to "
+            << inet_ntoa(multicast_group.sin_addr) << ":" << ntohs(multicast_group.sin_port)
+            << " in place of " << multicast_saved_frames << " frames (" << multicast_errors
+            << " send errors); " << multicast_recovered << " messages sent again for "
+            << multicast_recovery_requests << " gaps (" << multicast_unrecovered
+            << " no longer retained)" << endl;
+    }
+
+    if (connection::alias_saved_bytes) {
+        cout << "Bytes saved by the topic aliases: " << connection::alias_saved_bytes << endl;
+    }
+
+    if (connection::compression_input_bytes) {
+        cout << "Compression: " << connection::compression_input_bytes << " bytes of frames sent as "
+            << connection::compression_output_bytes << " (" << fixed << setprecision(3)
+            << (double)connection::compression_output_bytes / connection::compression_input_bytes
+            << "), " << defaultfloat << connection::compression_time / 1000000 << "ms compressing"
+            << endl;
+    }
+
+    cout << "System calls: " << connection::send_calls << " send, " << connection::recv_calls
+        << " recv, " << connection::epoll_ctl_calls << " epoll_ctl";
+    if (connection::total_frames_sent) {
+        double frames_sent = connection::total_frames_sent;
+        cout << " (" << fixed << setprecision(3) << connection::send_calls / frames_sent
+            << " send and " << connection::epoll_ctl_calls / frames_sent
+            << " epoll_ctl per sent frame)" << defaultfloat;
+    }
+    cout << endl;
+
+    cout << "Frames sent to the connected clients: " << frames << " in " << segments
+        << " segments";
+    if (frames) {
+        cout << " (" << fixed << setprecision(3) << (double)segments / frames
+            << " per frame)" << defaultfloat;
+    }
+    cout << endl;
+
+    udp_limiter.print_stats(cout);
+
+    size_t rings = 0;
+    for (auto& client : clients) {
+        rings += client.second->ring != nullptr;
+    }
+    if (capture) {
+        cout << "Capture: " << capture->get_datagrams() << " datagrams ("
+            << capture->get_bytes() << " bytes)" << endl;
+    }
+
+    if (poller.is_enabled()) {
+        cout << "Busy polling: " << poller.get_empty_polls() << " empty polls, "
+            << poller.get_sleeps() << " sleeps" << endl;
+    }
+
+    if (!peer_links.empty()) {
+        cout << "Peers: " << peers_by_node.size() << " of " << peer_links.size()
+            << " linked (" << forwarded_datagrams << " datagrams forwarded, "
+            << peer_datagrams << " received)" << endl;
+    }
+
+    cout << "Shared memory rings: " << rings << " (" << shm_fallbacks
+        << " fell back to TCP)" << endl;
+
+    connection::get_pool().print_stats(cout);
+    cout << endl;
+    buffer_pools::print_stats(cout);
 }
@@ -3,6 +3,10 @@
 
 #include <list>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <random>
+#include <vector>
 #include <string>
 #include <iostream>
 
@@ -10,16 +14,147 @@
 
 #include "connection.hpp"
 #include "topics.hpp"
+#include "rate_limiter.hpp"
+#include "hot_topics.hpp"
+#include "logger.hpp"
+#include "persistence.hpp"
+#include "timer_wheel.hpp"
+#include "busy_poll.hpp"
+#include "capture.hpp"
+#include "retained.hpp"
+#include "transport.hpp"
+
+// settings of the server, given in the command line
+struct server_config {
+    uint16_t port;
+
+    // scheduling of the per-class sending queues of every connection
+    connection::scheduling_policy scheduling;
+    int class_weights[PRIORITY_CLASSES];
+
+    // back the connection and buffer pools with huge pages
+    bool hugepages;
+
+    // token buckets of the UDP publishers (a rate of 0 means no limit)
+    rate_limiter::limits udp_limits;
+
+    struct udp_source {
+        in_addr addr;
+        uint16_t port;  // 0 for any port
+        rate_limiter::limits limits;
+    };
+    std::vector<udp_source> udp_sources;
+
+    // track the topics and patterns that cost the most ('hot' command),
+    // on one datagram in `profile` (on average); 0 disables it
+    int profile;
+
+    // file keeping the subscriptions between runs (none if empty)
+    std::string snapshot_path;
+
+    // seconds for which the subscriptions of a disconnected client are kept;
+    // -1 keeps them forever
+    int resume_grace;
+
+    // seconds of silence after which a connection gets a heartbeat, and
+    // after which it is closed (0 disables each)
+    int heartbeat;
+    int idle_timeout;
+
+    // size of the shared memory ring offered to local subscribers that
+    // ask for one (0 disables them)
+    size_t shm_ring_size;
+
+    // low latency mode: microseconds for which the loop keeps polling
+    // after an event before it blocks again (0 never blocks, -1 disables
+    // busy polling), and the CPU the loop is pinned to (-1 for none)
+    int busy_poll;
+    int cpu;
+
+    // record every received datagram to this file (none if empty)
+    std::string capture_path;
+
+    // coalescing: the INFO frames of a connection are sent together at the
+    // end of the loop iteration, or COALESCE microseconds after the first
+    // one (-1 sends every frame right away), or once they reach
+    // coalesce_bytes
+    int coalesce;
+    size_t coalesce_bytes;
+
+    // name of this node for its peers ("node-<port>" if empty), and the
+    // servers to link to; the datagrams published on any node reach the
+    // subscribers of every node
+    std::string node_name;
+    std::vector<sockaddr_in> peers;
+
+    // retained messages: the last `retain` messages of every topic are sent
+    // to the clients that subscribe to it later (0 disables them), keeping
+    // at most retain_bytes of them
+    int retain;
+    size_t retain_bytes;
+
+    // compression offered to the clients that ask for it in the handshake
+    // (" z=deflate"): the zlib level (0 disables it) and the smallest batch
+    // of frames that is compressed
+    int compress_level;
+    size_t compress_min_batch;
+
+    // accepting: the length of the queue of established connections
+    // waiting for accept, the connections accepted in one loop iteration,
+    // and the seconds for which the kernel holds a connection until its
+    // first data (the ID) arrives (TCP_DEFER_ACCEPT; 0 disables it)
+    int listen_backlog;
+    int accept_budget;
+    int defer_accept;
+
+    // multicast egress: a message matching at least multicast_min "mcast"
+    // subscriptions is sent once to the group (port 0 disables it), from
+    // the interface with the address multicast_if (any by default), and
+    // not to the connections that receive the group
+    sockaddr_in multicast_group;
+    in_addr multicast_if;
+    int multicast_min;
+
+    server_config(uint16_t port = 0)
+        : port(port), scheduling(connection::SCHEDULE_STRICT),
+            class_weights{4, 2, 1}, hugepages(false), udp_limits{0, 0},
+            profile(0), resume_grace(-1), heartbeat(0), idle_timeout(0),
+            shm_ring_size(1024 * 1024), busy_poll(-1), cpu(-1), coalesce(-1),
+            coalesce_bytes(16 * 1024), retain(0), retain_bytes(64 * 1024 * 1024),
+            compress_level(0), compress_min_batch(256), listen_backlog(4096),
+            accept_budget(256), defer_accept(2), multicast_group{}, multicast_if{INADDR_ANY},
+            multicast_min(64) {}
+};
 
 class server {
 public:
-    server(uint16_t port);
+    server(const server_config& config);
     ~server();
 
     void run();
+
+    // one iteration of run(): wait for an event (or the next timer), handle
+    // it and flush; returns true once the server stops; lets a benchmark
+    // drive the loop over an in-memory transport
+    bool run_once();
 private:
     static constexpr int MAX_UDP_PACKAGE_SIZE = 50 + 1 + 1500;
 
+    // resolution of the timers (ns)
+    static constexpr uint64_t TIMER_TICK = 1000000;
+
+    // SO_BUSY_POLL of the sockets in busy polling mode (us)
+    static constexpr int SOCKET_BUSY_POLL = 50;
+
+    // how long accepting stops when the server runs out of descriptors
+    static constexpr uint64_t ACCEPT_PAUSE = 100000000;
+
+    // the connection events are written by a background thread
+    async_logger logger;
+
+    // the sockets, through the installed transport
+    transport* io;
+
     bool closed;
     int epollfd;
     int tcp_listen_fd;
@@ -29,6 +164,14 @@ private:
     epoll_event_info<connection>* tcp_listener_epoll_info;
     epoll_event_info<connection>* udp_listener_epoll_info;
 
+    // connections accepted per loop iteration
+    int accept_budget;
+    uint64_t accepted_connections;
+    // times accepting stopped for lack of descriptors or memory
+    uint64_t accept_pauses;
+    // watches the listener again after a pause
+    wheel_timer accept_resume;
+
     // store them as well to close connections when the server shuts down
     std::list<connection*> refused_clients;
 
@@ -36,14 +179,203 @@ private:
 
     topics_tree topics;
 
-    // assign the given ID to a connection that is not active yet
-    // if the ID has already been used, the connection is refused
-    // and a rejection is sent
-    bool add_client(connection* conn, const std::string& ID);
+    // per publisher limits of the UDP datagrams
+    rate_limiter udp_limiter;
+
+    // set by the first subscription asking for timestamps; until then, the
+    // datagrams are not timestamped at all
+    bool timestamps_requested;
+
+    // numbers the datagrams, for the cached results of the filters
+    uint64_t message_sequence;
+    // messages not sent to a subscriber because of its filter
+    uint64_t filtered_messages;
+    // queued messages replaced by a newer one of the same topic
+    uint64_t conflated_messages;
+
+    // fan-out profiler; nullptr when profiling is disabled
+    hot_topics* profiler;
+    topics_tree::matched_patterns matched_patterns;
+    // the profiled datagrams are drawn at random (a fixed period could
+    // follow the cycle of a publisher), one in profile_sampling on average;
+    // each counts for profile_sampling datagrams
+    uint32_t profile_sampling;
+    uint32_t profile_countdown;
+    std::minstd_rand profile_random;
+
+    // snapshot and journal of the subscriptions; nullptr when disabled
+    subscription_store* store;
+
+    // recording of the UDP traffic; nullptr when disabled
+    capture_writer* capture;
+
+    // last messages of the topics; nullptr when disabled
+    retained_store* retained;
+
+    // multicast egress; -1 when disabled
+    int multicast_fd;
+    sockaddr_in multicast_group;
+    size_t multicast_min;
+    // the last sequence number of every topic sent to the group
+    std::unordered_map<std::string, uint64_t> multicast_sequences;
+    uint64_t multicast_messages;
+    // frames the connections did not get because the group had them
+    uint64_t multicast_saved_frames;
+    uint64_t multicast_errors;
+    // lost multicast messages asked again, and those sent back
+    uint64_t multicast_recovery_requests;
+    uint64_t multicast_recovered;
+    // asked again but no longer retained
+    uint64_t multicast_unrecovered;
+
+    // what a client keeps between connections
+    struct session {
+        // lets a new connection take over the session while the old one
+        // still looks connected (dead peer)
+        std::string token;
+        // tracked only when the sessions expire
+        std::set<std::string> patterns;
+        // drops the subscriptions; scheduled while disconnected
+        wheel_timer expiration;
+    };
 
-    // add as many clients as possible from the TCP listening port
+    std::map<std::string, session> sessions;
+
+    // ns; -1 if the sessions never expire
+    int64_t resume_grace;
+    std::mt19937_64 token_generator;
+
+    // deadlines of the sessions and of the idle connections
+    timer_wheel timers;
+    // taken once after every epoll_wait
+    uint64_t loop_time;
+
+    // spin-then-sleep policy of the loop (disabled by default)
+    busy_poller poller;
+
+    // ns; 0 if disabled
+    uint64_t heartbeat_interval;
+    uint64_t idle_timeout;
+
+    size_t shm_ring_size;
+    // rings abandoned because their subscriber did not keep up
+    uint64_t shm_fallbacks;
+
+    int compress_level;
+    size_t compress_min_batch;
+
+    // -1 if disabled; ns
+    int64_t coalesce_window;
+    size_t coalesce_bytes;
+    // connections with queued frames that were not sent yet
+    std::vector<connection*> unflushed;
+
+    // send the queued frames whose window ended (all of them when the window
+    // is 0); called at the end of every loop iteration
+    void flush_connections();
+
+    // a link with another server; each side tells the other the patterns
+    // of its subscribers ("8+<pattern>", "8-<pattern>") and forwards it the
+    // matching datagrams ("9<datagram>", escaped)
+    struct peer_link {
+        sockaddr_in addr;
+        // we connect (and reconnect) to the peer; false if it connected to us
+        bool outgoing;
+        // nullptr while an outgoing link waits to reconnect
+        connection* conn;
+        // the name of the other node, once the handshake is done
+        std::string node;
+        bool established;
+        // patterns of the peer, to drop them when the link goes down
+        std::set<std::string> interest;
+        wheel_timer retry;
+    };
+
+    std::string node_name;
+    std::list<peer_link> peer_links;
+    std::map<connection*, peer_link*> peer_connections;
+    std::map<std::string, peer_link*> peers_by_node;
+
+    // what the peers subscribed to; the subscribers are node names
+    topics_tree peer_interest;
+
+    uint64_t forwarded_datagrams;
+    uint64_t peer_datagrams;
+
+    // delay before an outgoing link is opened again (ns)
+    static constexpr uint64_t PEER_RETRY = 1000000000;
+
+    // escapes the datagrams in the forward frames
+    static constexpr char PEER_ESCAPE = 0x10;
+
+    // open the connection of an outgoing link and send the handshake
+    void connect_peer(peer_link* link);
+
+    // accept a peer connecting to us ("0<node> peer"); false if refused
+    bool add_peer(connection* conn, const std::string& node);
+
+    // the handshake is done: log it and send our interest
+    void peer_established(peer_link* link);
+
+    // returns false if the link must be closed
+    bool manage_peer_request(peer_link* link, const std::string& request);
+
+    // tell the established peers that a pattern got its first subscriber
+    // or lost its last one
+    void interest_changed(const std::string& pattern, bool added);
+
+    // send the datagram to the peers with matching subscribers
+    void forward_to_peers(const std::string& topic, const char* datagram, size_t size);
+
+    // parse a datagram and send it to the matching subscribers; those from
+    // peers are not forwarded again, so the nodes must be fully linked
+    void publish(const char* datagram, size_t size, uint64_t recv_time, bool from_peer);
+
+    // send an INFO frame of the given topic, through the shared memory ring
+    // of the connection if it has one; when the ring is full, the connection
+    // goes back to TCP; with conflate, the frame replaces the queued one of
+    // the same topic that was not sent yet
+    void deliver(connection* conn, const std::string& frame, const std::string& topic,
+                    priority_class priority, int stamp_offset = -1, bool conflate = false);
+
+    // send the INFO frame to the multicast group as "<sequence> <info>"
+    // (without its type byte); returns its sequence number in the topic
+    uint64_t send_multicast(const std::string& topic, const std::string& info_message);
+
+    // send again over TCP the retained messages of a topic that the client
+    // lost from the multicast group ("<first> <last> <topic>")
+    void recover_multicast(connection* conn, const std::string& request);
+
+    // send the retained messages of the topics matching a new subscription,
+    // as publish() would have sent them
+    void send_retained(connection* conn, const std::string& pattern,
+                        const subscription_options& options);
+
+    // start the grace period of a disconnected client
+    void suspend_session(const std::string& ID);
+
+    // drop the subscriptions of a session whose grace period ended
+    void expire_session(const std::string& ID);
+
+    // called by the idle timer of a connection: send a heartbeat or close
+    // the connection if it has been silent for too long; the activity is
+    // only recorded on receive, the deadline is recomputed here
+    void check_idle(connection* conn);
+
+    // assign the ID from the handshake ("<ID>[ resume][ token=<token>][ shm]") to a
+    // connection that is not active yet; if the ID is used by another
+    // connection, the connection is refused and a rejection is sent, unless
+    // it presents the session's token (then it replaces the old connection);
+    // returns false if the connection broke
+    bool add_client(connection* conn, const std::string& handshake);
+
+    // accept the waiting connections, at most accept_budget of them (the
+    // listener stays ready for the next iteration)
     void add_clients();
 
+    // stop (or resume) watching the listener
+    void watch_listener(bool enabled);
+
     void remove_connection(connection* conn);
 
     // read as many UDP messages as possible, and send the information given
@@ -55,7 +387,7 @@ private:
     bool manage_receive(connection* conn);
 
     // send as many messages as possible
-    // returns if the connection is still valid; otherwise it will be removed here
+    // returns if the connection is still valid; otherwise it should be removed
     bool manage_send(connection* conn);
 
     // manage the event from epoll
@@ -73,12 +405,19 @@ private:
         return true;
     }
 
+    // returns false if the connection should be removed
     bool manage_client_request(connection* conn, const std::string& request);
 
+    // execute a command from STDIN; returns true if the server must stop
+    bool manage_command(const std::string& command);
+
+    // print the statistics of the server to STDOUT
+    void print_stats();
+
     // starts shutdown; marks all connection as invalid and sends the EXIT message
     bool shutdown();
 
-    static int create_binded_listenfd(int type, uint16_t port);
+    int create_binded_listenfd(int type, uint16_t port);
 };
 
 #endif  // _SERVER_TCP_UDP_HPP
@@ -0,0 +1,154 @@
+#include <new>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "shm_ring.hpp"
+#include "connection.hpp"
+
+using namespace std;
+
+constexpr char shm_ring::MAGIC[8];
+
+// the frames start on the page after the header
+static constexpr size_t HEADER_SIZE = 4096;
+
+shm_ring::shm_ring(const string& name, bool owner, void* mapping, size_t mapping_size)
+    : name(name), owner(owner), linked(owner), header((ring_header*)mapping),
+        data((char*)mapping + HEADER_SIZE), capacity(mapping_size - HEADER_SIZE),
+        mapping_size(mapping_size) {}
+
+shm_ring::~shm_ring() {
+    unlink();
+    munmap(header, mapping_size);
+}
+
+shm_ring* shm_ring::create(size_t capacity) {
+    static uint64_t rings = 0;
+
+    // unique on the host, and hard to guess
+    uint64_t seed = now_ns();
+    string name = "/tcpsub-" + to_string(getpid()) + "-" + to_string(rings++) + "-"
+                    + to_string(hash_bytes(&seed, sizeof(seed), realtime_ns()));
+
+    int fd = shm_open(name.data(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    size_t mapping_size = HEADER_SIZE + capacity;
+    void* mapping = MAP_FAILED;
+
+    if (ftruncate(fd, mapping_size) == 0) {
+        mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        shm_unlink(name.data());
+        return nullptr;
+    }
+
+    ring_header* header = new (mapping) ring_header;
+    memcpy(header->magic, MAGIC, sizeof(MAGIC));
+    header->capacity = capacity;
+    header->head.store(0, memory_order_relaxed);
+    header->tail.store(0, memory_order_relaxed);
+    // the consumer has not mapped it yet; the first frame wakes it up
+    header->waiting.store(1, memory_order_release);
+
+    return new shm_ring(name, true, mapping, mapping_size);
+}
+
+shm_ring* shm_ring::attach(const string& name) {
+    int fd = shm_open(name.data(), O_RDWR, 0);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat info;
+    void* mapping = MAP_FAILED;
+
+    if (fstat(fd, &info) == 0 && info.st_size > (off_t)HEADER_SIZE) {
+        mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        return nullptr;
+    }
+
+    ring_header* header = (ring_header*)mapping;
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+        || header->capacity != info.st_size - HEADER_SIZE) {
+        munmap(mapping, info.st_size);
+        return nullptr;
+    }
+
+    return new shm_ring(name, false, mapping, info.st_size);
+}
+
+void shm_ring::unlink() {
+    if (linked) {
+        shm_unlink(name.data());
+        linked = false;
+    }
+}
+
+bool shm_ring::write(const char* frame, size_t size, int stamp_offset) {
+    uint64_t head = header->head.load(memory_order_relaxed);
+    uint64_t tail = header->tail.load(memory_order_acquire);
+
+    // the tail is written by the consumer; past the head (or too far
+    // behind it), the room left would be wrong
+    if (head - tail > capacity) {
+        return false;
+    }
+
+    size_t position = head & (capacity - 1);
+    size_t needed = record_size(size);
+    size_t contiguous = capacity - position;
+
+    // a frame never wraps; skip the end of the buffer if it does not fit
+    size_t skipped = contiguous < needed ? contiguous : 0;
+
+    if (size >= WRAP_MARKER || capacity - (head - tail) < skipped + needed) {
+        return false;
+    }
+
+    if (skipped) {
+        *(uint32_t*)(data + position) = WRAP_MARKER;
+        head += skipped;
+        position = 0;
+    }
+
+    char* record = data + position;
+    *(uint32_t*)record = size;
+    memcpy(record + sizeof(uint32_t), frame, size);
+
+    if (stamp_offset >= 0) {
+        char stamp[TIMESTAMP_DIGITS + 1];
+        snprintf(stamp, sizeof(stamp), "%0*llu", TIMESTAMP_DIGITS,
+                    (unsigned long long)realtime_ns());
+        memcpy(record + sizeof(uint32_t) + stamp_offset, stamp, TIMESTAMP_DIGITS);
+    }
+
+    // seq_cst, so that the store is ordered before the load of `waiting`
+    header->head.store(head + needed, memory_order_seq_cst);
+    return true;
+}
+
+bool shm_ring::prepare_wait() {
+    header->waiting.store(1, memory_order_seq_cst);
+
+    if (header->head.load(memory_order_seq_cst) != header->tail.load(memory_order_relaxed)) {
+        header->waiting.store(0, memory_order_relaxed);
+        return false;
+    }
+
+    return true;
+}
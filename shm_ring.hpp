@@ -0,0 +1,117 @@
+#ifndef _SHM_RING_HPP
+#define _SHM_RING_HPP
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <atomic>
+
+// single producer, single consumer ring of frames in a shared memory object;
+// the server (producer) creates it and hands its name to a subscriber on the
+// same host (consumer), that reads the frames without any syscall
+//
+// each frame is stored as a u32 size followed by the frame, padded to 8
+// bytes; a size of WRAP_MARKER means that the rest of the buffer is unused
+//
+// wake up: before sleeping, the consumer raises `waiting`; the producer that
+// finds it raised after a write clears it and wakes the consumer through
+// another channel (the TCP connection)
+class shm_ring {
+public:
+    // create a new ring of the given capacity (power of two); returns
+    // nullptr if the shared memory cannot be created
+    static shm_ring* create(size_t capacity);
+
+    // map the ring created by the producer; returns nullptr on failure
+    static shm_ring* attach(const std::string& name);
+
+    ~shm_ring();
+
+    const std::string& get_name() const { return name; }
+
+    // remove the name of the shared memory object (the mappings stay valid);
+    // done once the consumer has mapped it
+    void unlink();
+
+    // producer: append a frame; returns false if there is not enough room,
+    // or if the ring is broken (the consumer moved its tail outside of the
+    // written frames); if stamp_offset is not -1, the wall clock time is
+    // written there
+    bool write(const char* frame, size_t size, int stamp_offset = -1);
+
+    // producer: true if the consumer went to sleep and must be woken up
+    bool consume_wakeup() {
+        return header->waiting.load(std::memory_order_seq_cst)
+                && header->waiting.exchange(0, std::memory_order_seq_cst);
+    }
+
+    // consumer: call the callback for every available frame; the view is
+    // valid only during the call; returns the number of frames
+    template <typename callback_type>
+    size_t read(const callback_type& callback);
+
+    // consumer: announce that we are going to sleep; returns false (and
+    // stays awake) if frames arrived in the meantime
+    bool prepare_wait();
+
+    // room taken by a frame; a ring smaller than the record of a frame
+    // can never hold it
+    static size_t record_size(size_t frame_size) {
+        return (sizeof(uint32_t) + frame_size + 7) & ~(size_t)7;
+    }
+private:
+    static constexpr char MAGIC[8] = {'T', 'C', 'P', 'R', 'I', 'N', 'G', '1'};
+    static constexpr uint32_t WRAP_MARKER = UINT32_MAX;
+
+    struct ring_header {
+        char magic[8];
+        uint64_t capacity;
+
+        // written only by the producer and by the consumer, respectively
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) std::atomic<uint32_t> waiting;
+    };
+
+    std::string name;
+    bool owner;
+    bool linked;
+
+    ring_header* header;
+    char* data;
+    size_t capacity;
+    size_t mapping_size;
+
+    shm_ring(const std::string& name, bool owner, void* mapping, size_t mapping_size);
+};
+
+template <typename callback_type>
+size_t shm_ring::read(const callback_type& callback) {
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    size_t frames = 0;
+
+    while (tail != head) {
+        size_t position = tail & (capacity - 1);
+        uint32_t size = *(const uint32_t*)(data + position);
+
+        if (size == WRAP_MARKER) {
+            tail += capacity - position;
+        } else {
+            callback(std::string_view(data + position + sizeof(uint32_t), size));
+            tail += record_size(size);
+            frames++;
+        }
+
+        // give the room back as soon as possible
+        header->tail.store(tail, std::memory_order_release);
+
+        if (tail == head) {
+            head = header->head.load(std::memory_order_acquire);
+        }
+    }
+
+    return frames;
+}
+
+#endif  // _SHM_RING_HPP
@@ -0,0 +1,813 @@
+#include <charconv>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/unistd.h>
+#include <netinet/in.h>
+
+#include "utils.h"
+#include "subscriber.hpp"
+
+using namespace std;
+
+long long message_view::as_int() const {
+    long long result = 0;
+    from_chars(value.data(), value.data() + value.size(), result);
+    return result;
+}
+
+double message_view::as_float() const {
+    double result = 0;
+    from_chars(value.data(), value.data() + value.size(), result);
+    return result;
+}
+
+bool message_view::parse(string_view frame, message_view& result) {
+    static const struct {
+        string_view name;
+        payload_type type;
+    } types[] = {
+        {"INT", PAYLOAD_INT},
+        {"SHORT_REAL", PAYLOAD_SHORT_REAL},
+        {"FLOAT", PAYLOAD_FLOAT},
+        {"STRING", PAYLOAD_STRING}
+    };
+
+    constexpr string_view SEPARATOR = " - ";
+
+    result.text = frame;
+    result.server_recv_time = 0;
+    result.server_send_time = 0;
+
+    // the topic ends at the first separator that is followed by a type name
+    for (size_t pos = frame.find(SEPARATOR);
+            pos != string_view::npos;
+            pos = frame.find(SEPARATOR, pos + 1)) {
+
+        string_view rest = frame.substr(pos + SEPARATOR.size());
+
+        for (auto& type : types) {
+            if (rest.size() >= type.name.size() + SEPARATOR.size()
+                && rest.compare(0, type.name.size(), type.name) == 0
+                && rest.compare(type.name.size(), SEPARATOR.size(), SEPARATOR) == 0) {
+
+                result.topic = frame.substr(0, pos);
+                result.type = type.type;
+                result.value = rest.substr(type.name.size() + SEPARATOR.size());
+                return true;
+            }
+        }
+    }
+
+    result.topic = frame;
+    result.type = PAYLOAD_UNKNOWN;
+    result.value = string_view();
+    return false;
+}
+
+bool message_view::parse_timed(string_view frame, message_view& result) {
+    uint64_t recv_time = 0;
+    uint64_t send_time = 0;
+
+    // "<recv>[,<send>] <info>"
+    size_t info_pos = frame.find(' ');
+    if (info_pos == string_view::npos) {
+        return parse(string_view(), result);
+    }
+
+    const char* end = frame.data() + info_pos;
+    auto parsed = from_chars(frame.data(), end, recv_time);
+    if (parsed.ptr != end && *parsed.ptr == ',') {
+        from_chars(parsed.ptr + 1, end, send_time);
+    }
+
+    bool valid = parse(frame.substr(info_pos + 1), result);
+    result.server_recv_time = recv_time;
+    result.server_send_time = send_time;
+    return valid;
+}
+
+subscriber_loop::subscriber_loop() : stopped(false) {
+    epollfd = epoll_create1(0);
+    DIE(epollfd == -1, "Cannot create epoll");
+}
+
+subscriber_loop::~subscriber_loop() {
+    for (auto old : retired) {
+        delete old;
+    }
+
+    for (auto info : watched_infos) {
+        delete info;
+    }
+
+    DIE(close(epollfd) == -1, "Cannot close epollfd");
+}
+
+void subscriber_loop::watch_fd(int fd, const function<void()>& handler) {
+    auto info = new epoll_event_info<connection>(fd);
+    watched_infos.push_back(info);
+    watched_fds[fd] = handler;
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = info;
+    DIE(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == -1,
+        "Adding fd to epoll failed");
+}
+
+void subscriber_loop::unwatch_fd(int fd) {
+    // the event info stays until the loop is released, since later events
+    // of the current poll may point to it
+    if (watched_fds.erase(fd)) {
+        DIE(epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr) == -1,
+            "Removing fd from epoll failed");
+    }
+}
+
+void subscriber_loop::watch_connection(connection* conn, const event_handler& handler) {
+    watched_connections[conn] = handler;
+}
+
+void subscriber_loop::unwatch_connection(connection* conn) {
+    watched_connections.erase(conn);
+}
+
+void subscriber_loop::set_busy_poll(uint64_t spin_ns) {
+    poller.enable(spin_ns);
+}
+
+int subscriber_loop::poll(int timeout_ms) {
+    epoll_event events[MAX_EVENTS];
+
+    int count = epoll_wait(epollfd, events, MAX_EVENTS,
+                            poller.timeout(timeout_ms, poller.is_enabled() ? now_ns() : 0));
+    DIE(count == -1 && errno != EINTR, "Waiting failed");
+
+    if (poller.is_enabled()) {
+        poller.record(count, now_ns());
+    }
+
+    for (int i = 0; i < count; i++) {
+        epoll_event_info<connection>* info = (epoll_event_info<connection> *)events[i].data.ptr;
+
+        switch (info->info_type) {
+            case epoll_event_info<connection>::FD:
+                {
+                    auto handler = watched_fds.find(info->info.fd);
+                    if (handler != watched_fds.end()) {
+                        handler->second();
+                    }
+                }
+                break;
+            case epoll_event_info<connection>::PTR:
+                {
+                    // the session may have been released by an earlier callback
+                    auto session = sessions.find(info->info.data);
+                    if (session != sessions.end()) {
+                        session->second->manage_connection(events[i]);
+                        break;
+                    }
+
+                    auto watched = watched_connections.find(info->info.data);
+                    if (watched != watched_connections.end()) {
+                        // the handler may unwatch the connection
+                        event_handler handler = watched->second;
+                        handler(events[i]);
+                    }
+                }
+                break;
+            default:
+                DIE(true, "Wrong type of connection here");
+        }
+    }
+
+    for (auto old : retired) {
+        delete old;
+    }
+    retired.clear();
+
+    // release the connections of the finished sessions
+    for (auto session = sessions.begin(); session != sessions.end();) {
+        subscriber* s = session->second;
+        session++;
+
+        if (s->finished) {
+            sessions.erase(s->conn);
+            delete s->conn;
+            s->conn = nullptr;
+        }
+    }
+
+    return count > 0 ? count : 0;
+}
+
+void subscriber_loop::run() {
+    stopped = false;
+
+    while (!stopped && !sessions.empty()) {
+        poll(-1);
+    }
+}
+
+subscriber::subscriber(subscriber_loop& loop, const string& ID)
+    : loop(loop), ID(ID), conn(nullptr), finished(false), closing(false),
+        resume(false), resumed(false), shared_memory(false), compressed(false),
+        topic_aliases(false), aliased(false), multicast(false), multicast_group{},
+        multicast_fd(-1), multicast_received(0), multicast_recovered(0),
+        multicast_dropped(0) {}
+
+subscriber::~subscriber() {
+    if (conn) {
+        loop.sessions.erase(conn);
+        delete conn;
+    }
+
+    if (multicast_fd != -1) {
+        loop.unwatch_fd(multicast_fd);
+        DIE(::close(multicast_fd) == -1, "Cannot close the multicast socket");
+    }
+}
+
+bool subscriber::connect(const char* ip, uint16_t port) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (inet_aton(ip, &addr.sin_addr) == 0) {
+        return false;
+    }
+
+    return connect(addr);
+}
+
+bool subscriber::connect(const sockaddr_in& addr) {
+    if (conn) {
+        return false;
+    }
+
+    int socketfd = socket(AF_INET, SOCK_STREAM, 0);
+    DIE(socketfd == -1, "Cannot create socket.");
+
+    if (::connect(socketfd, (const sockaddr*) &addr, sizeof(addr)) == -1) {
+        ::close(socketfd);
+        return false;
+    }
+
+    if (loop.poller.is_enabled()) {
+        set_socket_busy_poll(socketfd, subscriber_loop::SOCKET_BUSY_POLL);
+    }
+
+    conn = new connection(loop.get_epollfd(), socketfd, addr);
+    loop.sessions[conn] = this;
+    server_addr = addr;
+    finished = false;
+    closing = false;
+    resumed = false;
+
+    // send the ID
+    string handshake = (char)message_info::ID + ID;
+    if (resume) {
+        handshake += token.empty() ? " resume" : " token=" + token;
+    }
+
+    if (shared_memory) {
+        handshake += " shm";
+    }
+
+    if (topic_aliases) {
+        handshake += " alias";
+    }
+
+    if (!compression.empty()) {
+        handshake += " z=" + compression;
+    }
+
+    if (multicast) {
+        handshake += " mcast";
+    }
+
+    conn->push_send_message(handshake);
+    if (conn->state == connection::STATE_CONNECTION_BROKEN) {
+        // Connection closed unexpectedly
+        finish();
+        return false;
+    }
+
+    return true;
+}
+
+bool subscriber::reconnect() {
+    if (conn) {
+        if (!finished) {
+            return false;
+        }
+
+        // we may be inside a callback of the old connection; the loop
+        // releases it after the dispatch
+        loop.sessions.erase(conn);
+        loop.retired.push_back(conn);
+        conn = nullptr;
+    }
+
+    return connect(server_addr);
+}
+
+void subscriber::subscribe(const string& topic, const string& options) {
+    subscribe(vector<string>{topic}, options);
+}
+
+void subscriber::subscribe(const vector<string>& topics, const string& options) {
+    if (!is_open()) {
+        return;
+    }
+
+    // plain subscriptions take their messages from the group
+    string requested = options.empty() && multicast ? "mcast" : options;
+
+    for (auto& topic : topics) {
+        pending_subscribed.insert(topic);
+        subscription_options[topic] = requested;
+
+        if (requested.empty()) {
+            conn->queue_send_message((char)SUBSCRIBE + topic);
+        } else {
+            conn->queue_send_message((char)SUBSCRIBE + topic + ' ' + requested);
+        }
+    }
+
+    flush();
+    join_multicast();
+}
+
+void subscriber::unsubscribe(const string& topic) {
+    if (!is_open()) {
+        return;
+    }
+
+    pending_unsubscribed.insert(topic);
+    subscription_options.erase(topic);
+    conn->queue_send_message((char)UNSUBSCRIBE + topic);
+    flush();
+}
+
+void subscriber::close() {
+    if (!is_open() || closing) {
+        return;
+    }
+
+    // the connection turns into STATE_DISCONNECTED once EXIT is sent
+    closing = true;
+    conn->state = connection::STATE_INVALID;
+    conn->queue_send_message(string(1, (char)EXIT));
+    flush();
+}
+
+void subscriber::flush() {
+    conn->send_messages();
+
+    if (conn->state == connection::STATE_CONNECTION_BROKEN
+        || conn->state == connection::STATE_DISCONNECTED) {
+        finish();
+    }
+}
+
+void subscriber::finish() {
+    if (finished) {
+        return;
+    }
+
+    finished = true;
+    if (close_handler) {
+        close_handler();
+    }
+}
+
+void subscriber::manage_connection(const epoll_event& event) {
+    if (event.events & EPOLLIN) {
+        // a callback may replace the connection (reconnect)
+        connection* source = conn;
+
+        // the ring holds older frames than the socket (the server falls
+        // back to TCP only when the ring is full)
+        drain_ring();
+        if (conn != source) {
+            return;
+        }
+
+        source->recv_frames([this, source](string_view frame) {
+            if (!finished && conn == source) {
+                manage_frame(frame);
+            }
+        });
+
+        if (conn != source) {
+            return;
+        }
+
+        // sleep only once the server knows it has to wake us up
+        while (conn == source && !finished && conn->ring && !conn->ring->prepare_wait()) {
+            drain_ring();
+        }
+
+        if (conn != source) {
+            return;
+        }
+
+        if (conn->state == connection::STATE_CONNECTION_BROKEN) {
+            finish();
+            return;
+        }
+    }
+
+    if ((event.events & EPOLLOUT) && !finished) {
+        flush();
+    }
+}
+
+void subscriber::manage_handshake(string_view reply) {
+    // "OK[ token=<token>][ resumed]" or "NO"
+    bool accepted = reply.substr(0, 2) == "OK";
+
+    if (accepted) {
+        constexpr string_view TOKEN = " token=";
+
+        size_t token_pos = reply.find(TOKEN);
+        if (token_pos != string_view::npos) {
+            string_view value = reply.substr(token_pos + TOKEN.size());
+            token = string(value.substr(0, value.find(' ')));
+        }
+
+        resumed = reply.find(" resumed") != string_view::npos;
+
+        // the aliases of the previous connection are not valid any more
+        aliased = reply.find(" alias") != string_view::npos;
+        alias_topics.clear();
+
+        // the bytes after this reply are compressed
+        compressed = !compression.empty()
+                        && reply.find(" z=" + compression) != string_view::npos;
+        if (compressed) {
+            conn->enable_decompression(stream_codec::create(compression, 0));
+        }
+
+        constexpr string_view RING = " shm=";
+
+        size_t ring_pos = reply.find(RING);
+        if (ring_pos != string_view::npos) {
+            string_view ring_name = reply.substr(ring_pos + RING.size());
+            conn->ring = shm_ring::attach(string(ring_name.substr(0, ring_name.find(' '))));
+
+            // the server stays on TCP if we cannot map it
+            conn->queue_send_message(string(1, (char)SHM_RING) + (conn->ring ? "ok" : "no"));
+            flush();
+        }
+
+        // the sequences start again with every server
+        constexpr string_view GROUP = " mcast=";
+
+        multicast_sequences.clear();
+        size_t group_pos = reply.find(GROUP);
+        if (multicast && group_pos != string_view::npos) {
+            string_view group = reply.substr(group_pos + GROUP.size());
+            group = group.substr(0, group.find(' '));
+
+            size_t port_pos = group.find(':');
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+
+            if (port_pos != string_view::npos
+                && inet_aton(string(group.substr(0, port_pos)).data(), &addr.sin_addr) != 0) {
+                addr.sin_port = htons(atoi(string(group.substr(port_pos + 1)).data()));
+                multicast_group = addr;
+            }
+        }
+
+        restore_subscriptions();
+        join_multicast();
+    }
+
+    if (connect_handler) {
+        connect_handler(accepted);
+    }
+
+    if (!accepted) {
+        // ID is already used
+        finish();
+    }
+}
+
+bool subscriber::resolve_alias(message_view& message) {
+    uint32_t alias;
+    const char* end = message.topic.data() + message.topic.size();
+    auto parsed = from_chars(message.topic.data(), end, alias);
+
+    if (parsed.ec != errc() || parsed.ptr != end || alias >= alias_topics.size()) {
+        return false;
+    }
+
+    // the text starts with the alias
+    const string& topic = alias_topics[alias];
+    resolved_text.assign(topic);
+    resolved_text.append(message.text.substr(message.topic.size()));
+
+    message.topic = topic;
+    message.text = resolved_text;
+    return true;
+}
+
+void subscriber::join_multicast() {
+    if (multicast_fd != -1 || multicast_group.sin_port == 0 || !is_open()) {
+        return;
+    }
+
+    bool used = false;
+    for (auto& subscription : subscription_options) {
+        used = used || wants_multicast(subscription.first);
+    }
+
+    if (!used) {
+        return;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    DIE(fd == -1, "Cannot create the multicast socket");
+
+    // every subscriber of this host receives the group on the same port
+    int enable = 1;
+    DIE(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1,
+        "Cannot reuse the multicast port");
+    DIE(bind(fd, (const sockaddr*) &multicast_group, sizeof(multicast_group)) == -1,
+        "Cannot bind the multicast socket");
+
+    // join on the interface that reaches the server
+    sockaddr_in local;
+    socklen_t local_size = sizeof(local);
+    DIE(getsockname(conn->get_fd(), (sockaddr*) &local, &local_size) == -1,
+        "getsockname failed");
+
+    ip_mreq membership;
+    membership.imr_multiaddr = multicast_group.sin_addr;
+    membership.imr_interface = local.sin_addr;
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == -1) {
+        // the server keeps sending over the session what we do not ask
+        // again, so the messages of the group would be lost
+        DIE(true, "Cannot join the multicast group");
+    }
+
+    multicast_fd = fd;
+    loop.watch_fd(fd, [this]() {
+        recv_multicast();
+    });
+}
+
+bool subscriber::wants_multicast(const string& topic) const {
+    bool matched = false;
+
+    for (auto& subscription : subscription_options) {
+        if (!topic_matches(subscription.first.data(), topic.data())) {
+            continue;
+        }
+
+        // the server sends the topic to the group only if all of them agree
+        bool uses_group = false;
+        size_t start = 0;
+        const string& options = subscription.second;
+
+        while (start < options.size()) {
+            size_t end = options.find(' ', start);
+            if (end == string::npos) {
+                end = options.size();
+            }
+
+            uses_group = uses_group || options.compare(start, end - start, "mcast") == 0;
+            start = end + 1;
+        }
+
+        if (!uses_group) {
+            return false;
+        }
+
+        matched = true;
+    }
+
+    return matched;
+}
+
+void subscriber::recv_multicast() {
+    char buffer[MULTICAST_BUFFER_SIZE];
+
+    while (true) {
+        ssize_t size = recv(multicast_fd, buffer, sizeof(buffer), 0);
+        if (size == -1) {
+            DIE(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR,
+                "Receiving from the multicast group failed");
+            if (errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+
+        // "<sequence> <info>"
+        uint64_t sequence;
+        auto parsed = from_chars(buffer, buffer + size, sequence);
+        if (parsed.ec != errc() || parsed.ptr == buffer + size || *parsed.ptr != ' ') {
+            continue;
+        }
+
+        message_view message;
+        message_view::parse(string_view(parsed.ptr + 1, buffer + size - parsed.ptr - 1),
+                            message);
+
+        // the group carries every "mcast" topic of the server
+        string topic(message.topic);
+        if (finished || !wants_multicast(topic)) {
+            continue;
+        }
+
+        uint64_t& last = multicast_sequences[topic];
+        if (sequence <= last) {
+            multicast_dropped++;
+            continue;
+        }
+
+        if (last && sequence > last + 1) {
+            // the lost messages come back over the session, late; they
+            // are counted as they arrive
+            multicast_missing[topic] += sequence - last - 1;
+            conn->queue_send_message((char)MULTICAST_RECOVER + to_string(last + 1) + ' '
+                                        + to_string(sequence - 1) + ' ' + topic);
+            flush();
+        }
+        last = sequence;
+
+        multicast_received++;
+        if (message_handler) {
+            message_handler(message);
+        }
+    }
+}
+
+void subscriber::restore_subscriptions() {
+    // requests sent on the old connection may have been lost
+    vector<string> topics(pending_subscribed.begin(), pending_subscribed.end());
+
+    if (!resumed) {
+        topics.insert(topics.end(), subscribed.begin(), subscribed.end());
+        subscribed.clear();
+    }
+
+    for (auto& topic : pending_unsubscribed) {
+        conn->queue_send_message((char)UNSUBSCRIBE + topic);
+    }
+
+    for (auto& topic : topics) {
+        pending_subscribed.insert(topic);
+
+        const string& options = subscription_options[topic];
+        if (options.empty()) {
+            conn->queue_send_message((char)SUBSCRIBE + topic);
+        } else {
+            conn->queue_send_message((char)SUBSCRIBE + topic + ' ' + options);
+        }
+    }
+
+    if (!topics.empty() || !pending_unsubscribed.empty()) {
+        flush();
+    }
+}
+
+void subscriber::drain_ring() {
+    if (finished || !conn || !conn->ring) {
+        return;
+    }
+
+    connection* source = conn;
+
+    source->ring->read([this, source](string_view frame) {
+        if (!finished && conn == source) {
+            manage_frame(frame);
+        }
+    });
+}
+
+void subscriber::manage_frame(string_view frame) {
+    if (frame.empty()) {
+        return;
+    }
+
+    switch (frame[0]) {
+        case message_info::ID:
+            manage_handshake(frame.substr(1));
+            break;
+
+        case SUBSCRIBE:
+        case UNSUBSCRIBE:
+            {
+                if (frame.size() < 2) {
+                    break;
+                }
+
+                set<string>& pending = frame[0] == SUBSCRIBE
+                                        ? pending_subscribed
+                                        : pending_unsubscribed;
+
+                string topic(frame.substr(2));
+                auto pending_iterator = pending.find(topic);
+
+                if (pending_iterator == pending.end()) {
+                    // simply ignore it
+                    break;
+                }
+
+                pending.erase(pending_iterator);
+
+                bool success = frame[1] == '0';
+                if (success) {
+                    if (frame[0] == SUBSCRIBE) {
+                        subscribed.insert(topic);
+                    } else {
+                        subscribed.erase(topic);
+                    }
+                }
+
+                ack_callback& handler = frame[0] == SUBSCRIBE
+                                        ? subscribe_handler
+                                        : unsubscribe_handler;
+                if (handler) {
+                    handler(topic, success);
+                }
+            }
+            break;
+
+        case INFO:
+        case TIMED_INFO:
+            if (message_handler || !multicast_missing.empty()) {
+                message_view message;
+                if (frame[0] == INFO) {
+                    message_view::parse(frame.substr(1), message);
+                } else {
+                    message_view::parse_timed(frame.substr(1), message);
+                }
+
+                if (aliased && !resolve_alias(message)) {
+                    break;
+                }
+
+                // the topics of the group come over the session only when
+                // they were asked again
+                if (!multicast_missing.empty()) {
+                    auto missing = multicast_missing.find(string(message.topic));
+                    if (missing != multicast_missing.end()) {
+                        multicast_recovered++;
+                        if (--missing->second == 0) {
+                            multicast_missing.erase(missing);
+                        }
+                    }
+                }
+
+                if (message_handler) {
+                    message_handler(message);
+                }
+            }
+            break;
+
+        case TOPIC_ALIAS:
+            {
+                // "A<alias> <topic>"
+                uint32_t alias;
+                auto parsed = from_chars(frame.data() + 1, frame.data() + frame.size(), alias);
+                if (parsed.ec != errc() || parsed.ptr == frame.data() + frame.size()
+                    || *parsed.ptr != ' ') {
+                    break;
+                }
+
+                if (alias >= alias_topics.size()) {
+                    alias_topics.resize(alias + 1);
+                }
+                alias_topics[alias] = string(parsed.ptr + 1, frame.data() + frame.size());
+            }
+            break;
+
+        case SHM_RING:
+            // doorbell: new frames in the ring
+            drain_ring();
+            break;
+
+        case HEARTBEAT:
+            // the server checks that we are alive
+            conn->push_send_message(string(1, (char)HEARTBEAT));
+            break;
+
+        case EXIT:
+            // connection is closing nicely
+            finish();
+            break;
+
+        default:
+            // Wrong message type
+            break;
+    }
+}
@@ -0,0 +1,277 @@
+#ifndef _SUBSCRIBER_HPP
+#define _SUBSCRIBER_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <map>
+#include <functional>
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+
+#include "connection.hpp"
+#include "busy_poll.hpp"
+
+class subscriber;
+
+// a received INFO message; all the views point into the receive buffer and
+// are valid only during the message callback
+struct message_view {
+    std::string_view topic;
+    payload_type type;
+    std::string_view value;
+
+    // the whole frame, as printed by the subscriber binary
+    std::string_view text;
+
+    // wall clock times (ns) at which the server received the datagram and
+    // sent the frame; 0 unless the subscription asked for timestamps
+    uint64_t server_recv_time;
+    uint64_t server_send_time;
+
+    long long as_int() const;
+    double as_float() const;
+
+    // split an INFO frame (without its type byte) into topic and payload;
+    // returns false if the frame does not have the expected format
+    static bool parse(std::string_view frame, message_view& result);
+
+    // same for a TIMED_INFO frame (without its type byte)
+    static bool parse_timed(std::string_view frame, message_view& result);
+};
+
+// epoll loop shared by any number of subscriber sessions
+class subscriber_loop {
+public:
+    subscriber_loop();
+    ~subscriber_loop();
+
+    // call the handler each time the given fd becomes readable
+    void watch_fd(int fd, const std::function<void()>& handler);
+    void unwatch_fd(int fd);
+
+    // call the handler with the events of a connection that is not a
+    // session (made with get_epollfd(), e.g. the clients of a relay), until
+    // unwatch_connection(); the connection must outlive the current
+    // dispatch, since later events of the same poll may point to it
+    typedef std::function<void(const epoll_event&)> event_handler;
+    void watch_connection(connection* conn, const event_handler& handler);
+    void unwatch_connection(connection* conn);
+
+    // wait at most timeout_ms (-1 for no limit) and dispatch the events;
+    // returns the number of events (with busy polling, it may return 0
+    // before the timeout)
+    int poll(int timeout_ms);
+
+    // dispatch events until every session is closed or stop() is called
+    void run();
+
+    void stop() { stopped = true; }
+
+    // low latency mode: keep polling without blocking for spin_ns after
+    // each event (0 never blocks), and busy poll the sockets of the
+    // sessions connected afterwards (SO_BUSY_POLL); see pin_to_cpu() to
+    // pin the thread running the loop
+    void set_busy_poll(uint64_t spin_ns);
+
+    int get_epollfd() const { return epollfd; }
+private:
+    friend class subscriber;
+
+    static constexpr int MAX_EVENTS = 64;
+
+    static constexpr int SOCKET_BUSY_POLL = 50;
+
+    int epollfd;
+    bool stopped;
+
+    busy_poller poller;
+
+    std::map<connection*, subscriber*> sessions;
+    std::map<int, std::function<void()>> watched_fds;
+    std::map<connection*, event_handler> watched_connections;
+    std::vector<epoll_event_info<connection>*> watched_infos;
+
+    // connections replaced by a reconnect, released after the dispatch
+    std::vector<connection*> retired;
+};
+
+// one session to the server; every callback is invoked from the loop
+class subscriber {
+public:
+    typedef std::function<void(const message_view&)> message_callback;
+    typedef std::function<void(const std::string&, bool)> ack_callback;
+    typedef std::function<void(bool)> connect_callback;
+    typedef std::function<void()> close_callback;
+
+    subscriber(subscriber_loop& loop, const std::string& ID);
+    ~subscriber();
+
+    // open the TCP connection and send the ID; the result of the
+    // authentication is reported to the connect callback
+    bool connect(const sockaddr_in& addr);
+    bool connect(const char* ip, uint16_t port);
+
+    // open a new connection to the last address, once the session has
+    // ended (it may be called from the close callback); the subscriptions
+    // are requested again unless the server resumed the session
+    bool reconnect();
+
+    // ask the server to keep the subscriptions between connections; the
+    // token it returns lets a reconnect take over the session even while
+    // the server still sees the old connection
+    void set_resume(bool enabled) { resume = enabled; }
+
+    // ask for a shared memory ring (subscribers on the server's host only):
+    // the messages are then read from memory, without syscalls while they
+    // keep coming; the session stays on TCP if the server does not offer it
+    void set_shared_memory(bool enabled) { shared_memory = enabled; }
+
+    // ask the server to send numeric aliases in place of the topics after
+    // their first message (less bytes for short payloads); they are
+    // resolved before the message callback, so it always sees the topics
+    void set_topic_aliases(bool enabled) { topic_aliases = enabled; }
+
+    // ask the server to compress what it sends with the named codec (e.g.
+    // "deflate"; empty for none); worth it on slow links
+    void set_compression(const std::string& codec) { compression = codec; }
+    bool is_compressed() const { return compressed; }
+
+    // receive the messages of the server's multicast group (see server
+    // --multicast) for the subscriptions without options, which are then
+    // made with "mcast"; the lost ones are asked again over the session
+    void set_multicast(bool enabled) { multicast = enabled; }
+    bool uses_multicast() const { return multicast_fd != -1; }
+
+    // messages taken from the group, those asked again after a gap and
+    // received over the session, and the duplicate or late datagrams dropped
+    uint64_t get_multicast_received() const { return multicast_received; }
+    uint64_t get_multicast_recovered() const { return multicast_recovered; }
+    uint64_t get_multicast_dropped() const { return multicast_dropped; }
+
+    // request subscribing to one or many topics; all the requests are
+    // sent in a single batch; the options are the space separated
+    // subscription options (e.g. "prio=high")
+    void subscribe(const std::string& topic, const std::string& options = "");
+    void subscribe(const std::vector<std::string>& topics,
+                    const std::string& options = "");
+
+    void unsubscribe(const std::string& topic);
+
+    // send EXIT and close the session once it has been transmitted
+    void close();
+
+    void on_message(const message_callback& callback) { message_handler = callback; }
+    void on_subscribe(const ack_callback& callback) { subscribe_handler = callback; }
+    void on_unsubscribe(const ack_callback& callback) { unsubscribe_handler = callback; }
+    void on_connect(const connect_callback& callback) { connect_handler = callback; }
+    void on_close(const close_callback& callback) { close_handler = callback; }
+
+    bool is_open() const { return conn != nullptr && !finished; }
+    const std::string& get_ID() const { return ID; }
+    const std::set<std::string>& get_subscriptions() const { return subscribed; }
+
+    // whether the server kept the subscriptions of the previous connection
+    bool is_resumed() const { return resumed; }
+    const std::string& get_token() const { return token; }
+
+    bool uses_shared_memory() const { return conn != nullptr && conn->ring != nullptr; }
+private:
+    friend class subscriber_loop;
+
+    // larger than any INFO frame of the server
+    static constexpr int MULTICAST_BUFFER_SIZE = 4096;
+
+    subscriber_loop& loop;
+    std::string ID;
+    connection* conn;
+
+    // set once the session has ended (by any of the parts)
+    bool finished;
+    // set after close(); the session ends when EXIT has been sent
+    bool closing;
+
+    sockaddr_in server_addr;
+
+    bool resume;
+    bool resumed;
+    bool shared_memory;
+    std::string token;
+
+    // the codec asked for, and whether the server accepted it
+    std::string compression;
+    bool compressed;
+
+    // asked for aliases, and the server accepted them on this connection
+    bool topic_aliases;
+    bool aliased;
+    // the topic of each alias announced on this connection
+    std::vector<std::string> alias_topics;
+    // the text of the last message whose alias was resolved
+    std::string resolved_text;
+
+    // asked for multicast, the group given by the server (port 0 until
+    // then), and the socket that joined it
+    bool multicast;
+    sockaddr_in multicast_group;
+    int multicast_fd;
+    // the last sequence received from the group for each topic
+    std::map<std::string, uint64_t> multicast_sequences;
+    // messages of the group asked again and not received yet, by topic
+    std::map<std::string, uint64_t> multicast_missing;
+
+    uint64_t multicast_received;
+    uint64_t multicast_recovered;
+    uint64_t multicast_dropped;
+
+    // the options each topic was (last) requested with
+    std::map<std::string, std::string> subscription_options;
+
+    std::set<std::string> pending_subscribed;
+    std::set<std::string> pending_unsubscribed;
+    std::set<std::string> subscribed;
+
+    message_callback message_handler;
+    ack_callback subscribe_handler;
+    ack_callback unsubscribe_handler;
+    connect_callback connect_handler;
+    close_callback close_handler;
+
+    // manage the event from epoll
+    void manage_connection(const epoll_event& event);
+
+    void manage_frame(std::string_view frame);
+
+    // handle the reply to the ID
+    void manage_handshake(std::string_view reply);
+
+    // replace the alias of a message by its topic; returns false if the
+    // alias was not announced
+    bool resolve_alias(message_view& message);
+
+    // join the group once the server gave it and a subscription uses it
+    void join_multicast();
+
+    // handle the datagrams of the group
+    void recv_multicast();
+
+    // true if the message of the group is for this session: every
+    // subscription matching the topic was made with "mcast"
+    bool wants_multicast(const std::string& topic) const;
+
+    // send again the subscriptions the server does not know about
+    void restore_subscriptions();
+
+    // handle the frames from the shared memory ring
+    void drain_ring();
+
+    // send the queued frames and check the state of the connection
+    void flush();
+
+    // mark the session as finished and notify the owner
+    void finish();
+};
+
+#endif  // _SUBSCRIBER_HPP
@@ -0,0 +1,152 @@
+#include <limits.h>
+
+#include "timer_wheel.hpp"
+
+using namespace std;
+
+timer_wheel::timer_wheel(uint64_t tick_ns, uint64_t now)
+    : tick_ns(tick_ns), current(now / tick_ns), count(0) {
+    for (int level = 0; level < LEVELS; level++) {
+        for (int slot = 0; slot < SLOTS; slot++) {
+            slots[level][slot].prev = &slots[level][slot];
+            slots[level][slot].next = &slots[level][slot];
+        }
+    }
+}
+
+void timer_wheel::schedule(wheel_timer* timer, uint64_t deadline) {
+    if (timer->scheduled()) {
+        cancel(timer);
+    }
+
+    timer->expires = deadline / tick_ns;
+    if (timer->expires <= current) {
+        timer->expires = current + 1;
+    }
+
+    place(timer);
+    count++;
+}
+
+void timer_wheel::cancel(wheel_timer* timer) {
+    if (!timer->scheduled()) {
+        return;
+    }
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = nullptr;
+    timer->next = nullptr;
+    count--;
+}
+
+void timer_wheel::place(wheel_timer* timer) {
+    uint64_t delta = timer->expires - current;
+    uint64_t expires = timer->expires;
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ull << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+
+    if (delta >= (1ull << (SLOT_BITS * LEVELS))) {
+        // too far; wait in the last slot of the last level
+        expires = current + (1ull << (SLOT_BITS * LEVELS)) - 1;
+    }
+
+    wheel_timer& head = slots[level][(expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+
+    timer->prev = head.prev;
+    timer->next = &head;
+    head.prev->next = timer;
+    head.prev = timer;
+}
+
+void timer_wheel::cascade(int level, int slot) {
+    wheel_timer& head = slots[level][slot];
+
+    while (head.next != &head) {
+        wheel_timer* timer = head.next;
+
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        place(timer);
+    }
+}
+
+void timer_wheel::advance(uint64_t now) {
+    uint64_t target = now / tick_ns;
+
+    while (current < target) {
+        if (count == 0) {
+            // nothing to fire on the way
+            current = target;
+            break;
+        }
+
+        if (target - current > SLOTS) {
+            // long sleep; skip the ticks on which nothing happens
+            uint64_t next = next_event();
+            if (next > current + 1) {
+                current = min(target, next - 1);
+                continue;
+            }
+        }
+
+        current++;
+
+        // at the start of a block of a level, move its timers down
+        for (int level = 1; level < LEVELS; level++) {
+            if (current & ((1ull << (SLOT_BITS * level)) - 1)) {
+                break;
+            }
+
+            cascade(level, (current >> (SLOT_BITS * level)) & (SLOTS - 1));
+        }
+
+        wheel_timer& head = slots[0][current & (SLOTS - 1)];
+
+        while (head.next != &head) {
+            wheel_timer* timer = head.next;
+            cancel(timer);
+
+            // the callback may destroy the timer together with its owner
+            function<void()> callback = timer->callback;
+            callback();
+        }
+    }
+}
+
+uint64_t timer_wheel::next_event() const {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < LEVELS; level++) {
+        uint64_t block = current >> (SLOT_BITS * level);
+
+        for (int i = 1; i <= SLOTS; i++) {
+            const wheel_timer& head = slots[level][(block + i) & (SLOTS - 1)];
+
+            if (head.next != &head) {
+                // the timers of the slot fire (level 0) or move down then
+                next = min(next, (block + i) << (SLOT_BITS * level));
+                break;
+            }
+        }
+    }
+
+    return next;
+}
+
+int timer_wheel::next_timeout(uint64_t now) const {
+    if (count == 0) {
+        return -1;
+    }
+
+    uint64_t deadline = next_event() * tick_ns;
+    if (deadline <= now) {
+        return 0;
+    }
+
+    uint64_t timeout = (deadline - now + 999999) / 1000000;
+    return timeout > INT_MAX ? INT_MAX : (int)timeout;
+}
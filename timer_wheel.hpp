@@ -0,0 +1,72 @@
+#ifndef _TIMER_WHEEL_HPP
+#define _TIMER_WHEEL_HPP
+
+#include <stdint.h>
+#include <functional>
+
+// a timer that can be linked into a timer_wheel; it is owned by the object
+// it belongs to (no allocation when it is scheduled)
+struct wheel_timer {
+    // in ticks of the wheel
+    uint64_t expires;
+
+    // links in the slot list; nullptr when not scheduled
+    wheel_timer* prev;
+    wheel_timer* next;
+
+    // called from timer_wheel::advance(); it may reschedule the timer or
+    // destroy its owner
+    std::function<void()> callback;
+
+    wheel_timer() : expires(0), prev(nullptr), next(nullptr) {}
+
+    bool scheduled() const { return prev != nullptr; }
+};
+
+// hierarchical timing wheel: LEVELS wheels of SLOTS slots, each level
+// counting in SLOTS times larger units; scheduling and cancelling a timer
+// are O(1), and a timer moves down at most LEVELS - 1 times before firing
+class timer_wheel {
+public:
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr int LEVELS = 5;
+
+    // with 1ms ticks the levels span 64ms, 4s, 4.4min, 4.7h and 12.4 days;
+    // later deadlines wait in the last level and are placed again
+    timer_wheel(uint64_t tick_ns, uint64_t now);
+
+    // (re)schedule the timer at the given time (ns, same clock as now); a
+    // deadline in the past fires at the next tick
+    void schedule(wheel_timer* timer, uint64_t deadline);
+
+    void cancel(wheel_timer* timer);
+
+    // fire every timer that is due at the given time
+    void advance(uint64_t now);
+
+    // milliseconds until advance() has something to do (a timer to fire or
+    // to move down a level), for epoll_wait; -1 if there are no timers
+    int next_timeout(uint64_t now) const;
+
+    size_t size() const { return count; }
+private:
+    uint64_t tick_ns;
+    // the last processed tick
+    uint64_t current;
+    size_t count;
+
+    // list heads (sentinels) of the slots
+    wheel_timer slots[LEVELS][SLOTS];
+
+    // link the timer in the slot matching its expiration
+    void place(wheel_timer* timer);
+
+    // move the timers of the given slot to the lower levels
+    void cascade(int level, int slot);
+
+    // the first tick at which a timer fires or moves down a level
+    uint64_t next_event() const;
+};
+
+#endif  // _TIMER_WHEEL_HPP
@@ -2,11 +2,103 @@
 #include <algorithm>
 #include <iostream>
 
+#include "utils.h"
 #include "topics.hpp"
 
 using namespace std;
 
-void topics_tree::subscribe(string& ID, const char* topic) {
+bool subscription_options::parse(const char* options, subscription_options& result) {
+    while (*options != '\0') {
+        if (*options == ' ') {
+            options++;
+            continue;
+        }
+
+        const char* end = strchr(options, ' ');
+        if (end == nullptr) {
+            end = strchr(options, '\0');
+        }
+
+        string option(options, end - options);
+
+        if (option == "prio=high" || option == "prio=0") {
+            result.priority = PRIORITY_HIGH;
+        } else if (option == "prio=normal" || option == "prio=1") {
+            result.priority = PRIORITY_NORMAL;
+        } else if (option == "prio=low" || option == "prio=2") {
+            result.priority = PRIORITY_LOW;
+        } else if (option == "ts") {
+            result.timestamps = TIMESTAMPS_RECV;
+        } else if (option == "ts=send") {
+            result.timestamps = TIMESTAMPS_RECV_SEND;
+        } else if (option == "conflate") {
+            result.conflate = true;
+        } else if (option == "mcast") {
+            result.multicast = true;
+        } else if (option.compare(0, 7, "filter=") == 0
+                    && option.size() - 7 <= payload_filter::MAX_SOURCE) {
+            const payload_filter* filter = payload_filter::get(option.substr(7));
+            if (filter == nullptr) {
+                return false;
+            }
+
+            // the reference of get() is the one of the options
+            payload_filter::release(result.filter);
+            result.filter = filter;
+        } else {
+            // unknown option
+            return false;
+        }
+
+        options = end;
+    }
+
+    return !result.multicast
+            || (result.timestamps == TIMESTAMPS_NONE && result.filter == nullptr
+                && !result.conflate);
+}
+
+string subscription_options::to_string() const {
+    static const char* priorities[PRIORITY_CLASSES] = {"prio=high", "prio=normal", "prio=low"};
+    static const char* timestamp_modes[] = {"", " ts", " ts=send"};
+
+    string result = string(priorities[priority]) + timestamp_modes[timestamps];
+    if (filter) {
+        result += " filter=" + filter->get_source();
+    }
+
+    if (conflate) {
+        result += " conflate";
+    }
+
+    if (multicast) {
+        result += " mcast";
+    }
+
+    return result;
+}
+
+bool subscription_options::parse_request(const char* request, string& topic,
+                                            subscription_options& result) {
+    const char* options = strchr(request, ' ');
+    if (options == nullptr) {
+        topic = request;
+        return true;
+    }
+
+    topic = string(request, options - request);
+    return parse(options, result);
+}
+
+topics_tree::topics_tree() {
+    root = new node;
+}
+
+topics_tree::~topics_tree() {
+    if (root) delete_recursive(root);
+}
+
+topics_tree::node* topics_tree::find_or_create(const char* topic) {
     node* iter = root;
 
     while (*topic != '\0') {
@@ -52,14 +144,67 @@ void topics_tree::subscribe(string& ID, const char* topic) {
         topic = next_part;
     }
 
-    // avoid adding duplicates to the subscribers vector
-    if (find(iter->subscribers.begin(), iter->subscribers.end(), ID) 
-                                                == iter->subscribers.end()) {
-        iter->subscribers.push_back(ID);
+    return iter;
+}
+
+bool topics_tree::subscribe(const string& ID, const char* topic,
+                            const subscription_options& options) {
+    subscribers_map& subscribers = find_or_create(topic)->subscribers;
+    bool first = subscribers.empty();
+
+    subscribers[ID] = options;
+    return first;
+}
+
+void topics_tree::subscribe_many(const char* topic, const subscribers_map& subscribers) {
+    node* pattern = find_or_create(topic);
+
+    if (pattern->subscribers.empty()) {
+        pattern->subscribers = subscribers;
+        return;
+    }
+
+    for (auto& subscriber : subscribers) {
+        pattern->subscribers[subscriber.first] = subscriber.second;
+    }
+}
+
+void topics_tree::for_each_pattern(const pattern_visitor& visitor) const {
+    string path;
+    for_each_pattern(root, path, visitor);
+}
+
+void topics_tree::for_each_pattern(const node* iter, string& path,
+                                    const pattern_visitor& visitor) {
+    if (!iter->subscribers.empty()) {
+        visitor(path, iter->subscribers);
+    }
+
+    auto visit_child = [&path, &visitor](const node* child) {
+        size_t path_size = path.size();
+        if (path_size > 0) {
+            path.push_back('/');
+        }
+
+        path.append(child->name);
+        for_each_pattern(child, path, visitor);
+        path.resize(path_size);
+    };
+
+    if (iter->child_asterisk) {
+        visit_child(iter->child_asterisk);
+    }
+
+    if (iter->child_plus) {
+        visit_child(iter->child_plus);
+    }
+
+    for (auto& child : iter->children) {
+        visit_child(child.second);
     }
 }
 
-void topics_tree::unsubscribe(std::string& ID, const char* topic) {
+bool topics_tree::unsubscribe(const std::string& ID, const char* topic) {
     node* iter = root;
 
     while (*topic != '\0') {
@@ -73,13 +218,13 @@ void topics_tree::unsubscribe(std::string& ID, const char* topic) {
         // go to the correct child
         if (*topic == '*') {
             if (iter->child_asterisk == nullptr) {
-                return;
+                return false;
             }
 
             iter = iter->child_asterisk;
         } else if (*topic == '+') {
             if (iter->child_plus == nullptr) {
-                return;
+                return false;
             }
 
             iter = iter->child_plus;
@@ -94,7 +239,7 @@ void topics_tree::unsubscribe(std::string& ID, const char* topic) {
             auto map_iterator = iter->children.find(node_name);
 
             if (map_iterator == iter->children.end()) {
-                return;
+                return false;
             }
 
             iter = map_iterator->second;
@@ -103,12 +248,13 @@ void topics_tree::unsubscribe(std::string& ID, const char* topic) {
         topic = next_part;
     }
 
-    auto subscriber = find(iter->subscribers.begin(), iter->subscribers.end(), ID);
+    auto subscriber = iter->subscribers.find(ID);
     if (subscriber == iter->subscribers.end()) {
-        return;
+        return false;
     }
 
     iter->subscribers.erase(subscriber);
+    bool last = iter->subscribers.empty();
 
     // delete all unnecessary nodes (with no children and no subscribers)
     while (iter != root
@@ -131,18 +277,51 @@ void topics_tree::unsubscribe(std::string& ID, const char* topic) {
 
         iter = parent;
     }
+
+    return last;
+}
+
+topics_tree::node::node(string name, node* parent)
+    : name(name), parent(parent), child_asterisk(nullptr), child_plus(nullptr) {
+
+    hash = hash_bytes(name.data(), name.size(), parent ? parent->hash : 0);
 }
 
-set<string>* topics_tree::get_subscribers(const char* topic) {
-    set<string>* result = new set<string>();
-    root->get_subscribers(*result, topic);
+subscribers_map* topics_tree::get_subscribers(const char* topic, matched_patterns* matched) {
+    subscribers_map* result = new subscribers_map();
+    root->get_subscribers(*result, topic, matched);
     return result;
 }
 
-void topics_tree::node::get_subscribers(set<string>& result, const char* topic) {
+string topics_tree::pattern_of(const node* pattern) {
+    string result;
+
+    for (; pattern != nullptr && pattern->parent != nullptr; pattern = pattern->parent) {
+        result.insert(0, pattern->name);
+        if (pattern->parent->parent != nullptr) {
+            result.insert(0, "/");
+        }
+    }
+
+    return result;
+}
+
+uint64_t topics_tree::pattern_hash(const node* pattern) {
+    return pattern->hash;
+}
+
+void topics_tree::node::get_subscribers(subscribers_map& result, const char* topic,
+                                        matched_patterns* matched) {
     if (*topic == '\0') {
+        if (matched != nullptr && !subscribers.empty()) {
+            matched->push_back(this);
+        }
+
         for (auto& subscriber : subscribers) {
-            result.insert(subscriber);
+            auto inserted = result.insert(subscriber);
+            if (!inserted.second) {
+                inserted.first->second.merge(subscriber.second);
+            }
         }
 
         return;
@@ -157,15 +336,15 @@ void topics_tree::node::get_subscribers(set<string>& result, const char* topic)
 
     if (name == "*") {
         // * should replace any number of points from path
-        get_subscribers(result, next_part);
+        get_subscribers(result, next_part, matched);
     }
 
     if (child_asterisk != nullptr) {
-        child_asterisk->get_subscribers(result, next_part);
+        child_asterisk->get_subscribers(result, next_part, matched);
     }
 
     if (child_plus != nullptr) {
-        child_plus->get_subscribers(result, next_part);
+        child_plus->get_subscribers(result, next_part, matched);
     }
 
     string node_name;
@@ -176,7 +355,7 @@ void topics_tree::node::get_subscribers(set<string>& result, const char* topic)
 
     auto map_iterator = children.find(node_name);
     if (map_iterator != children.end()) {
-        map_iterator->second->get_subscribers(result, next_part);
+        map_iterator->second->get_subscribers(result, next_part, matched);
     }
 }
 
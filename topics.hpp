@@ -5,46 +5,175 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <functional>
+
+#include "connection.hpp"
+#include "filter.hpp"
+
+// per-subscription settings, given after the topic in a subscribe request:
+// "<topic>[ <option>]...", where the options are
+//  - prio=high|normal|low - delivery class of the topic's messages
+//  - ts / ts=send - send the messages as TIMED_INFO, carrying the time at
+//  which the server received the datagram (and at which it sent the frame)
+//  - filter=EXPR - send only the messages whose payload passes the filter
+//  (see payload_filter)
+//  - conflate - a message that was not sent yet is replaced by the next
+//  one of the same topic (for slow subscribers that only need the last value)
+//  - mcast - the messages may come from the server's multicast group
+//  (see server --multicast); not combined with ts, filter or conflate, that
+//  need the messages of this client only
+struct subscription_options {
+    enum timestamps_mode {
+        TIMESTAMPS_NONE,
+        TIMESTAMPS_RECV,
+        TIMESTAMPS_RECV_SEND
+    };
+
+    priority_class priority;
+    timestamps_mode timestamps;
+    // nullptr lets every message through
+    const payload_filter* filter;
+    bool conflate;
+    bool multicast;
+
+    subscription_options()
+        : priority(PRIORITY_NORMAL), timestamps(TIMESTAMPS_NONE), filter(nullptr),
+            conflate(false), multicast(false) {}
+
+    // every copy holds a reference to its filter
+    subscription_options(const subscription_options& other)
+        : priority(other.priority), timestamps(other.timestamps), filter(other.filter),
+            conflate(other.conflate), multicast(other.multicast) {
+        payload_filter::acquire(filter);
+    }
+
+    subscription_options& operator=(const subscription_options& other) {
+        payload_filter::acquire(other.filter);
+        payload_filter::release(filter);
+
+        priority = other.priority;
+        timestamps = other.timestamps;
+        filter = other.filter;
+        conflate = other.conflate;
+        multicast = other.multicast;
+        return *this;
+    }
+
+    ~subscription_options() {
+        payload_filter::release(filter);
+    }
+
+    // combine the options of two subscriptions of the same client that
+    // match the same message
+    void merge(const subscription_options& other) {
+        if (other.priority < priority) {
+            priority = other.priority;
+        }
+
+        if (other.timestamps > timestamps) {
+            timestamps = other.timestamps;
+        }
+
+        // a message is sent if any of the subscriptions wants it
+        const payload_filter* merged = nullptr;
+        if (filter != nullptr && other.filter != nullptr) {
+            merged = payload_filter::either(filter, other.filter);
+        }
+
+        payload_filter::acquire(merged);
+        payload_filter::release(filter);
+        filter = merged;
+
+        // unless every subscription accepts to lose messages
+        conflate = conflate && other.conflate;
+
+        // the others need the messages sent to this client
+        multicast = multicast && other.multicast;
+    }
+
+    // parse the space separated options; returns false for invalid ones
+    static bool parse(const char* options, subscription_options& result);
+
+    // the options in the format accepted by parse()
+    std::string to_string() const;
+
+    // split a subscribe request into its topic and its options
+    static bool parse_request(const char* request, std::string& topic,
+                                subscription_options& result);
+};
+
+// subscribers of a topic, with the merged options of their subscriptions
+typedef std::map<std::string, subscription_options> subscribers_map;
 
 class topics_tree {
 public:
-    topics_tree() { root = new node; }
-    ~topics_tree() { if (root) delete_recursive(root); }
+    topics_tree();
+    ~topics_tree();
 
-    // add the ID to the subscribers of the given topic
-    void subscribe(std::string& ID, const char* topic);
+    // add the ID to the subscribers of the given topic (the options of an
+    // existing subscription are replaced); returns true if the pattern had
+    // no subscribers before
+    bool subscribe(const std::string& ID, const char* topic,
+                    const subscription_options& options = subscription_options());
+
+    // add many subscribers to the same topic with a single walk of the tree
+    void subscribe_many(const char* topic, const subscribers_map& subscribers);
 
     // unsubscribe ID from the given topic (nothing happens if
-    // ID was not subscribed to that topic before)
-    void unsubscribe(std::string& ID, const char* topic);
+    // ID was not subscribed to that topic before); returns true if it was
+    // the last subscriber of the pattern
+    bool unsubscribe(const std::string& ID, const char* topic);
 
-    // get a set of all subscribers from the given topic (including wildcards)
-    std::set<std::string>* get_subscribers(const char* topic);
+    // tree node; each node with subscribers is a subscription pattern
+    struct node;
+    typedef std::vector<const node*> matched_patterns;
 
-private:
-    // tree node
-    struct node {
-        std::string name;
-        std::vector<std::string> subscribers;
+    // get all subscribers from the given topic (including wildcards); the
+    // patterns that matched are added to matched, if given
+    subscribers_map* get_subscribers(const char* topic,
+                                        matched_patterns* matched = nullptr);
 
-        // needs this parent for removing (unsubscribe)
-        node* parent;
+    // the full pattern of a node (e.g. "a/+/b") and a hash identifying it
+    static std::string pattern_of(const node* pattern);
+    static uint64_t pattern_hash(const node* pattern);
 
-        // treat "*" and "+" separately since they will be requested each time
-        node* child_asterisk;
-        node* child_plus;
-        std::map<std::string, node*> children;
+    typedef std::function<void(const std::string&, const subscribers_map&)> pattern_visitor;
 
-        node(std::string name = std::string(), node* parent = nullptr) 
-            : name(name), parent(parent), child_asterisk(nullptr), child_plus(nullptr) {}
-
-        // search recursively through the tree for the given topic
-        void get_subscribers(std::set<std::string>& result, const char* topic);
-    };
+    // call the visitor for every pattern that has subscribers
+    void for_each_pattern(const pattern_visitor& visitor) const;
 
+private:
     node* root;
 
+    // go to the node of the topic, creating the missing ones
+    node* find_or_create(const char* topic);
+
+    static void for_each_pattern(const node* iter, std::string& path,
+                                    const pattern_visitor& visitor);
+
     static void delete_recursive(node* root);
 };
 
+struct topics_tree::node {
+    std::string name;
+    subscribers_map subscribers;
+
+    // needs this parent for removing (unsubscribe)
+    node* parent;
+
+    // treat "*" and "+" separately since they will be requested each time
+    node* child_asterisk;
+    node* child_plus;
+    std::map<std::string, node*> children;
+
+    // hash of the whole path from the root
+    uint64_t hash;
+
+    node(std::string name = std::string(), node* parent = nullptr);
+
+    // search recursively through the tree for the given topic
+    void get_subscribers(subscribers_map& result, const char* topic,
+                            matched_patterns* matched);
+};
+
 #endif  // TOPICS_HPP
\ No newline at end of file
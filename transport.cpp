@@ -0,0 +1,96 @@
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/unistd.h>
+
+#include "transport.hpp"
+
+using namespace std;
+
+static socket_transport kernel_sockets;
+
+transport* transport::installed = &kernel_sockets;
+
+int socket_transport::socket(int type) {
+    return ::socket(AF_INET, type, 0);
+}
+
+int socket_transport::bind(int fd, const sockaddr_in& addr) {
+    return ::bind(fd, (const sockaddr*) &addr, sizeof(addr));
+}
+
+int socket_transport::listen(int fd, int backlog) {
+    return ::listen(fd, backlog);
+}
+
+int socket_transport::accept(int fd, sockaddr_in* addr) {
+    socklen_t size = sizeof(*addr);
+    return accept4(fd, (sockaddr*) addr, &size, SOCK_NONBLOCK);
+}
+
+int socket_transport::connect(int fd, const sockaddr_in& addr) {
+    return ::connect(fd, (const sockaddr*) &addr, sizeof(addr));
+}
+
+int socket_transport::close(int fd) {
+    return ::close(fd);
+}
+
+int socket_transport::set_option(int fd, int level, int name, const void* value,
+                                    socklen_t size) {
+    return setsockopt(fd, level, name, value, size);
+}
+
+int socket_transport::get_option(int fd, int level, int name, void* value, socklen_t* size) {
+    return getsockopt(fd, level, name, value, size);
+}
+
+int socket_transport::set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+ssize_t socket_transport::recv(int fd, void* buffer, size_t size) {
+    return ::recv(fd, buffer, size, 0);
+}
+
+ssize_t socket_transport::send(int fd, const void* data, size_t size, int flags) {
+    return ::send(fd, data, size, flags);
+}
+
+ssize_t socket_transport::recv_from(int fd, void* buffer, size_t size, sockaddr_in* source) {
+    socklen_t source_size = sizeof(*source);
+    return recvfrom(fd, buffer, size, 0, (sockaddr*) source,
+                    source ? &source_size : nullptr);
+}
+
+ssize_t socket_transport::send_to(int fd, const iovec* parts, int count,
+                                    const sockaddr_in& destination) {
+    msghdr datagram;
+    memset(&datagram, 0, sizeof(datagram));
+    datagram.msg_name = (void*) &destination;
+    datagram.msg_namelen = sizeof(destination);
+    datagram.msg_iov = (iovec*) parts;
+    datagram.msg_iovlen = count;
+
+    return sendmsg(fd, &datagram, 0);
+}
+
+int socket_transport::create_poller() {
+    return epoll_create1(0);
+}
+
+int socket_transport::control(int pollfd, int op, int fd, epoll_event* event) {
+    return epoll_ctl(pollfd, op, fd, event);
+}
+
+int socket_transport::wait(int pollfd, epoll_event* events, int max_events, int timeout_ms) {
+    return epoll_wait(pollfd, events, max_events, timeout_ms);
+}
+
+int socket_transport::wait_ns(int pollfd, epoll_event* events, int max_events,
+                                uint64_t timeout_ns) {
+    timespec timeout = {(time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000)};
+    return epoll_pwait2(pollfd, events, max_events, &timeout, nullptr);
+}
@@ -0,0 +1,81 @@
+#ifndef _TRANSPORT_HPP
+#define _TRANSPORT_HPP
+
+#include <stdint.h>
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// the socket and epoll calls of the server and of the connections, with the
+// same results and errno as the system calls they stand for; the sockets
+// are IPv4 and non-blocking (as the server uses them)
+class transport {
+public:
+    virtual ~transport() {}
+
+    // socket(AF_INET, type, 0); type may include SOCK_NONBLOCK
+    virtual int socket(int type) = 0;
+    virtual int bind(int fd, const sockaddr_in& addr) = 0;
+    virtual int listen(int fd, int backlog) = 0;
+    // accept4 with SOCK_NONBLOCK
+    virtual int accept(int fd, sockaddr_in* addr) = 0;
+    virtual int connect(int fd, const sockaddr_in& addr) = 0;
+    virtual int close(int fd) = 0;
+
+    virtual int set_option(int fd, int level, int name, const void* value, socklen_t size) = 0;
+    virtual int get_option(int fd, int level, int name, void* value, socklen_t* size) = 0;
+    virtual int set_nonblocking(int fd) = 0;
+
+    virtual ssize_t recv(int fd, void* buffer, size_t size) = 0;
+    virtual ssize_t send(int fd, const void* data, size_t size, int flags) = 0;
+
+    // one datagram; source may be nullptr
+    virtual ssize_t recv_from(int fd, void* buffer, size_t size, sockaddr_in* source) = 0;
+    virtual ssize_t send_to(int fd, const iovec* parts, int count,
+                            const sockaddr_in& destination) = 0;
+
+    // epoll_create1, epoll_ctl, epoll_wait and epoll_pwait2
+    virtual int create_poller() = 0;
+    virtual int control(int pollfd, int op, int fd, epoll_event* event) = 0;
+    virtual int wait(int pollfd, epoll_event* events, int max_events, int timeout_ms) = 0;
+    virtual int wait_ns(int pollfd, epoll_event* events, int max_events,
+                        uint64_t timeout_ns) = 0;
+
+    // the transport of the server and of the connections: the kernel's
+    // sockets, unless another one is installed before any of them is made
+    static transport* get() { return installed; }
+    static void install(transport* io) { installed = io; }
+private:
+    static transport* installed;
+};
+
+// the system calls themselves
+class socket_transport : public transport {
+public:
+    int socket(int type) override;
+    int bind(int fd, const sockaddr_in& addr) override;
+    int listen(int fd, int backlog) override;
+    int accept(int fd, sockaddr_in* addr) override;
+    int connect(int fd, const sockaddr_in& addr) override;
+    int close(int fd) override;
+
+    int set_option(int fd, int level, int name, const void* value, socklen_t size) override;
+    int get_option(int fd, int level, int name, void* value, socklen_t* size) override;
+    int set_nonblocking(int fd) override;
+
+    ssize_t recv(int fd, void* buffer, size_t size) override;
+    ssize_t send(int fd, const void* data, size_t size, int flags) override;
+
+    ssize_t recv_from(int fd, void* buffer, size_t size, sockaddr_in* source) override;
+    ssize_t send_to(int fd, const iovec* parts, int count,
+                    const sockaddr_in& destination) override;
+
+    int create_poller() override;
+    int control(int pollfd, int op, int fd, epoll_event* event) override;
+    int wait(int pollfd, epoll_event* events, int max_events, int timeout_ms) override;
+    int wait_ns(int pollfd, epoll_event* events, int max_events, uint64_t timeout_ns) override;
+};
+
+#endif  // _TRANSPORT_HPP
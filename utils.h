@@ -1,4 +1,10 @@
+#ifndef _UTILS_H
+#define _UTILS_H
+
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string.h>
 
 #define DIE(condition, explanation)                                             \
     do {                                                                        \
@@ -8,3 +14,44 @@
         }                                                                       \
     } while (0)
 
+// monotonic time in nanoseconds, used for measuring durations
+static inline uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// wall clock time in nanoseconds, comparable between the processes of a host
+static inline uint64_t realtime_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// fast non-cryptographic hash (8 bytes at a time)
+static inline uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0) {
+    const uint64_t MULTIPLIER = 0x9e3779b97f4a7c15ull;
+    const char* bytes = (const char*)data;
+    uint64_t hash = seed ^ (size * MULTIPLIER);
+
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * MULTIPLIER;
+        hash ^= hash >> 29;
+        bytes += 8;
+        size -= 8;
+    }
+
+    if (size > 0) {
+        uint64_t word = 0;
+        memcpy(&word, bytes, size);
+        hash = (hash ^ word) * MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+
+    hash *= MULTIPLIER;
+    return hash ^ (hash >> 32);
+}
+
+#endif  // _UTILS_H